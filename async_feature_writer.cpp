@@ -0,0 +1,120 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * async_feature_writer.cpp:
+ * The writer thread for asynchronous feature output. See async_feature_writer.h.
+ */
+
+#include "config.h"
+
+#include <chrono>
+#include <unordered_map>
+
+#include "async_feature_writer.h"
+#include "feature_recorder_file.h"
+
+async_feature_writer::async_feature_writer(size_t capacity):
+    queue(capacity), writer(&async_feature_writer::run, this)
+{
+}
+
+async_feature_writer::~async_feature_writer()
+{
+    {
+        const std::lock_guard<std::mutex> lock(M);
+        stop = true;
+    }
+    work_cv.notify_one();
+    writer.join();
+}
+
+void async_feature_writer::check_error()
+{
+    const std::lock_guard<std::mutex> lock(M);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void async_feature_writer::push(feature_recorder_file *fr, std::string_view line)
+{
+    if (failed) check_error();
+    record_t rec {fr, std::string(line)};
+    if (!queue.try_push(rec)) {
+        /* Backpressure: the writer is behind, so wait for it to make room */
+        stalls++;
+        unsigned int tries = 0;
+        while (!queue.try_push(rec)) {
+            if (failed) check_error();
+            work_cv.notify_one();
+            if (++tries < 64) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+    }
+    pushed++;
+    if (writer_idle) {
+        work_cv.notify_one();
+    }
+}
+
+void async_feature_writer::flush()
+{
+    const uint64_t target = pushed;
+    std::unique_lock<std::mutex> lock(M);
+    work_cv.notify_one();
+    written_cv.wait(lock, [&]{ return written >= target || error; });
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+/* The writer thread.
+ * Lines are joined per feature file so each file gets one large write per batch.
+ * The buffers are kept from batch to batch so that they are not reallocated.
+ */
+void async_feature_writer::run()
+{
+    std::unordered_map<feature_recorder_file *, std::string> pending;
+    record_t rec;
+    for (;;) {
+        size_t n = 0;
+        while (n < BATCH_SIZE && queue.try_pop(rec)) {
+            std::string &buf = pending[rec.fr];
+            buf += rec.line;
+            buf += '\n';
+            n++;
+        }
+        if (n == 0) {
+            std::unique_lock<std::mutex> lock(M);
+            if (stop) return;           // everything has been written
+            writer_idle = true;
+            work_cv.wait_for(lock, std::chrono::milliseconds(10));
+            writer_idle = false;
+            continue;
+        }
+        try {
+            for (auto &it: pending) {
+                if (!it.second.empty()) {
+                    it.first->write_lines(it.second);
+                    it.second.clear();
+                }
+            }
+        } catch (...) {
+            /* Remember the error for the scanner threads, and keep draining the queue so they do not wait forever */
+            const std::lock_guard<std::mutex> lock(M);
+            if (!error) error = std::current_exception();
+            failed = true;
+            for (auto &it: pending) {
+                it.second.clear();
+            }
+        }
+        written += n;
+        {
+            const std::lock_guard<std::mutex> lock(M);
+        }
+        written_cv.notify_all();
+    }
+}
@@ -0,0 +1,66 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef ASYNC_FEATURE_WRITER_H
+#define ASYNC_FEATURE_WRITER_H
+
+/**
+ * \file
+ * async_feature_writer.h:
+ * A thread that writes feature file lines for all of the feature_recorder_files in a feature_recorder_set
+ * (feature_recorder_set::flags_t::async_output).
+ *
+ * Scanner threads push formatted lines into a bounded mpsc_queue and return without touching the disk.
+ * The writer thread takes lines in batches, joins the lines for each feature file, and writes each
+ * feature file once per batch. If the queue is full, push() waits for the writer (backpressure).
+ * flush() waits until everything pushed before it has been written.
+ * An error in the writer thread (e.g. disk full) is rethrown by the next push() or flush().
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "mpsc_queue.h"
+
+class feature_recorder_file;
+class async_feature_writer {
+    async_feature_writer(const async_feature_writer &)=delete;
+    async_feature_writer &operator=(const async_feature_writer &)=delete;
+
+    struct record_t {
+        feature_recorder_file *fr {nullptr};
+        std::string line {};
+    };
+    mpsc_queue<record_t>    queue;
+    std::atomic<uint64_t>   pushed {0};
+    std::atomic<uint64_t>   written {0};
+    std::atomic<uint64_t>   stalls {0};          // pushes that found the queue full
+    std::atomic<bool>       writer_idle {false};
+    std::atomic<bool>       failed {false};     // error is set
+    bool                    stop {false};       // protected by M
+    std::exception_ptr      error {};           // protected by M
+    std::mutex              M {};
+    std::condition_variable work_cv {};          // the writer waits here for lines
+    std::condition_variable written_cv {};       // flush() waits here for the writer
+    std::thread             writer;              // last, so it starts after everything run() uses
+
+    void run();
+    void check_error();
+
+public:
+    static const size_t DEFAULT_CAPACITY = 65536; // lines
+    static const size_t BATCH_SIZE = 4096;        // most lines written per batch
+
+    async_feature_writer(size_t capacity=DEFAULT_CAPACITY);
+    virtual ~async_feature_writer();          // writes whatever is queued, then stops the thread
+
+    void     push(feature_recorder_file *fr, std::string_view line); // line does not include the \n
+    void     flush();
+    uint64_t stall_count() const { return stalls; }
+};
+
+#endif
@@ -0,0 +1,116 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * defines digest128_t and atomic_digest_set.
+ *
+ * atomic_digest_set is a set of 128-bit digests for finding duplicate sbufs.
+ * Compared with atomic_set<std::string> of hex digests it is:
+ * - sharded: the top bits of the digest pick one of SHARDS shards, each with its own mutex,
+ *   so threads almost never wait for each other.
+ * - compact: each shard is an open-addressed table of 16-byte slots (no per-entry heap allocation),
+ *   kept below 70% full.
+ *
+ * The all-zero digest marks an empty slot, so it is tracked with a separate flag.
+ */
+
+#ifndef ATOMIC_DIGEST_SET_H
+#define ATOMIC_DIGEST_SET_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+struct digest128_t {
+    uint64_t hi {0};
+    uint64_t lo {0};
+
+    /* The first 16 bytes of a longer digest */
+    static digest128_t from_bytes(const uint8_t *bytes) {
+        digest128_t d;
+        memcpy(&d.hi, bytes, 8);
+        memcpy(&d.lo, bytes+8, 8);
+        return d;
+    }
+    bool is_zero() const { return hi==0 && lo==0; }
+    bool operator==(const digest128_t &that) const { return hi==that.hi && lo==that.lo; }
+    bool operator!=(const digest128_t &that) const { return !(*this==that); }
+};
+
+class atomic_digest_set {
+    static const unsigned int SHARD_BITS = 6;
+    static const unsigned int SHARDS     = 1U << SHARD_BITS;
+    static const size_t INITIAL_SLOTS    = 1024; // per shard; always a power of 2
+
+    struct shard_t {
+        mutable std::mutex M {};        // protects slots and count
+        std::vector<digest128_t> slots = std::vector<digest128_t>(INITIAL_SLOTS);
+        size_t count {0};
+    };
+    std::array<shard_t, SHARDS> shards {};
+    std::atomic<bool> zero_present {false};
+
+    shard_t &shard_for(const digest128_t &d) { return shards[d.lo >> (64 - SHARD_BITS)]; }
+    const shard_t &shard_for(const digest128_t &d) const { return shards[d.lo >> (64 - SHARD_BITS)]; }
+
+    /* Linear probing. Returns the slot holding d, or the empty slot where it belongs. */
+    static size_t probe(const std::vector<digest128_t> &slots, const digest128_t &d) {
+        const size_t mask = slots.size() - 1;
+        size_t i = d.hi & mask;
+        while (!slots[i].is_zero() && slots[i] != d) {
+            i = (i+1) & mask;
+        }
+        return i;
+    }
+
+    static void grow(shard_t &s) {
+        std::vector<digest128_t> bigger(s.slots.size() * 2);
+        for (const auto &d: s.slots) {
+            if (!d.is_zero()) {
+                bigger[probe(bigger, d)] = d;
+            }
+        }
+        s.slots.swap(bigger);
+    }
+
+public:
+    atomic_digest_set(){}
+    atomic_digest_set(const atomic_digest_set &)=delete;
+    atomic_digest_set &operator=(const atomic_digest_set &)=delete;
+
+    bool contains(const digest128_t &d) const {
+        if (d.is_zero()) return zero_present;
+        const shard_t &s = shard_for(d);
+        const std::lock_guard<std::mutex> lock(s.M);
+        return !s.slots[probe(s.slots, d)].is_zero();
+    }
+    void insert(const digest128_t &d) {
+        check_for_presence_and_insert(d);
+    }
+    bool check_for_presence_and_insert(const digest128_t &d) {
+        if (d.is_zero()) return zero_present.exchange(true);
+        shard_t &s = shard_for(d);
+        const std::lock_guard<std::mutex> lock(s.M);
+        size_t i = probe(s.slots, d);
+        if (!s.slots[i].is_zero()) return true; // in the set
+        if ((s.count+1) * 10 > s.slots.size() * 7) {
+            grow(s);
+            i = probe(s.slots, d);
+        }
+        s.slots[i] = d;                 // otherwise insert it
+        s.count += 1;
+        return false;                   // and return that it wasn't
+    }
+    size_t size() const {
+        size_t total = zero_present ? 1 : 0;
+        for (const auto &s: shards) {
+            const std::lock_guard<std::mutex> lock(s.M);
+            total += s.count;
+        }
+        return total;
+    }
+};
+
+#endif
@@ -11,11 +11,14 @@
 #include "unicode_escape.h"
 #include "utf8.h"
 
+#include <algorithm>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <cwctype>
 #include <regex>
 #include <string>
+#include <thread>
 
 #include "atomic_unicode_histogram.h"
 
@@ -33,22 +36,197 @@ std::ostream & operator << (std::ostream &os, const AtomicUnicodeHistogram::auh_
 {
     os << "n=" << e.value.count << "\t" << validateOrEscapeUTF8( e.key, true, false, false);
     if (e.value.count16>0) os << "\t(utf16=" << e.value.count16<<")";
+    if (e.value.error>0) os << "\t(error<=" << e.value.error<<")";
     os << "\n";
     return os;
 }
 
 
+static std::atomic<uint64_t> next_histogram_id {1};
+
+AtomicUnicodeHistogram::AtomicUnicodeHistogram(const struct histogram_def &def_):
+    def(def_), id(next_histogram_id++),
+    shards(def_.flags.topk ? nullptr : std::make_unique<shard_t[]>(SHARDS)),
+    topk(def_.flags.topk ? std::make_unique<topk_t>() : nullptr)
+{
+}
+
+/* Each thread keeps a map from histogram to its partial, so finding the partial takes no lock.
+ * Histogram ids are never reused, so entries for histograms that have been deleted are never looked up.
+ */
+AtomicUnicodeHistogram::partial_t &AtomicUnicodeHistogram::get_partial()
+{
+    static thread_local std::unordered_map<uint64_t, partial_t *> cache;
+    partial_t *&partial = cache[id];
+    if (partial == nullptr) {
+        const std::lock_guard<std::mutex> lock(Mpartials);
+        partials.push_back(std::make_unique<partial_t>());
+        partial = partials.back().get();
+    }
+    return *partial;
+}
+
+/* Space-Saving update with weight t.count */
+void AtomicUnicodeHistogram::topk_add(const std::string &key, const HistogramTally &t)
+{
+    auto it = topk->counts.find(key);
+    if (it != topk->counts.end()) {
+        topk->by_count.erase({it->second.count, key});
+        it->second.count   += t.count;
+        it->second.count16 += t.count16;
+        topk->by_count.emplace(it->second.count, key);
+        return;
+    }
+    HistogramTally n(t);
+    if (topk->counts.size() >= def.flags.topk) {
+        /* The new key may have been one of the keys evicted before, each of which had at most the lowest count */
+        auto lowest = topk->by_count.begin();
+        n.count += lowest->first;
+        n.error += lowest->first;
+        key_bytes -= sizeof(tally_map_t::value_type) + sizeof(*lowest) + 2 * lowest->second.size();
+        keys--;
+        topk->counts.erase(lowest->second);
+        topk->by_count.erase(lowest);
+    }
+    topk->counts.emplace(key, n);
+    topk->by_count.emplace(n.count, key);
+    key_bytes += sizeof(tally_map_t::value_type) + sizeof(*topk->by_count.begin()) + 2 * key.size();
+    keys++;
+}
+
+/* Move the counts in p into the shards, taking each shard's lock once */
+void AtomicUnicodeHistogram::merge(partial_t &p)
+{
+    if (topk) {
+        const std::lock_guard<std::mutex> lock(topk->M);
+        for (const auto &it: p.counts) {
+            topk_add(it.first, it.second);
+        }
+        p.counts.clear();
+        p.adds = 0;
+        p.key_bytes = 0;
+        return;
+    }
+    std::vector<std::vector<tally_map_t::value_type *>> by_shard(SHARDS);
+    for (auto &it: p.counts) {
+        by_shard[std::hash<std::string>()(it.first) % SHARDS].push_back(&it);
+    }
+    for (size_t i=0; i<SHARDS; i++) {
+        if (by_shard[i].empty()) continue;
+        shard_t &shard = shards[i];
+        const std::lock_guard<std::mutex> lock(shard.M);
+        for (auto *it: by_shard[i]) {
+            auto [where, inserted] = shard.counts.try_emplace(it->first, it->second);
+            if (inserted) {
+                keys++;
+                key_bytes += sizeof(*it) + it->first.size();
+            } else {
+                where->second.count   += it->second.count;
+                where->second.count16 += it->second.count16;
+            }
+        }
+    }
+    p.counts.clear();
+    p.adds = 0;
+    p.key_bytes = 0;
+}
+
+void AtomicUnicodeHistogram::merge_partials()
+{
+    const std::lock_guard<std::mutex> lock(Mpartials);
+    for (auto &p: partials) {
+        const std::lock_guard<std::mutex> plock(p->M);
+        merge(*p);
+    }
+}
+
+/* The order of a histogram report. Histograms that were spilled to disk are merged in this order.
+ * Large reports are cut into pieces (at most max_threads, each of at least min_keys keys) that are sorted
+ * at the same time, and then neighbouring pieces are merged in rounds, the merges of each round at the same time.
+ */
+static void sort_report(AtomicUnicodeHistogram::auh_t::report &rep, unsigned int max_threads, size_t min_keys)
+{
+    typedef AtomicUnicodeHistogram::auh_t::AMReportElement element_t;
+    auto order = [](const element_t &a, const element_t &b) {
+        return element_t::compare(b, a); // reverse sort, as atomic_map::dump()
+    };
+    if (max_threads == 0) {
+        max_threads = std::thread::hardware_concurrency();
+    }
+    const size_t threads = std::min(size_t(max_threads), rep.size() / std::max(min_keys, size_t(1)));
+    if (threads < 2) {
+        std::sort(rep.begin(), rep.end(), order);
+        return;
+    }
+
+    std::vector<size_t> bounds;         // piece k is [bounds[k], bounds[k+1])
+    for (size_t k=0; k<=threads; k++) {
+        bounds.push_back(rep.size() * k / threads);
+    }
+    std::vector<std::thread> pool;
+    for (size_t k=0; k<threads; k++) {
+        pool.emplace_back([&rep, &bounds, order, k]() {
+            std::sort(rep.begin() + bounds[k], rep.begin() + bounds[k+1], order);
+        });
+    }
+    for (auto &th: pool) {
+        th.join();
+    }
+    for (size_t width=1; width<threads; width*=2) {
+        pool.clear();
+        for (size_t k=0; k+width<threads; k+=2*width) {
+            const size_t first = bounds[k], middle = bounds[k+width], last = bounds[std::min(k+2*width, threads)];
+            pool.emplace_back([&rep, order, first, middle, last]() {
+                std::inplace_merge(rep.begin() + first, rep.begin() + middle, rep.begin() + last, order);
+            });
+        }
+        for (auto &th: pool) {
+            th.join();
+        }
+    }
+}
+
+/* The summary, highest count first; optionally emptied */
+AtomicUnicodeHistogram::auh_t::report AtomicUnicodeHistogram::topk_report(bool clear)
+{
+    auh_t::report rep;
+    {
+        const std::lock_guard<std::mutex> lock(topk->M);
+        rep.reserve(topk->counts.size());
+        for (auto it = topk->by_count.rbegin(); it != topk->by_count.rend(); it++) {
+            rep.push_back(auh_t::AMReportElement(it->second, topk->counts.at(it->second)));
+        }
+        if (clear) {
+            topk->counts.clear();
+            topk->by_count.clear();
+            keys = 0;
+            key_bytes = 0;
+        }
+    }
+    return rep;
+}
+
 /* Create a histogram report.
  * @param topN - if >0, return only this many.
  * Return only the topN.
  */
 AtomicUnicodeHistogram::auh_t::report AtomicUnicodeHistogram::makeReport(size_t topN)
 {
-    std::cerr << "makeReport 1. topN=" << topN << " h.size=" << h.size() << "\n";
-
-    auh_t::report rep = h.dump( true );
+    merge_partials();
 
-    std::cerr << "makeReport 2. rep.size=" << rep.size() << "\n";
+    auh_t::report rep;
+    if (topk) {
+        rep = topk_report(false);
+    } else {
+        rep.reserve(keys);
+        for (size_t i=0; i<SHARDS; i++) {
+            const std::lock_guard<std::mutex> lock(shards[i].M);
+            for (const auto &it: shards[i].counts) {
+                rep.push_back(auh_t::AMReportElement(it.first, it.second));
+            }
+        }
+        sort_report(rep, sort_threads, sort_min_keys);
+    }
 
     /* If we only want some of them, delete the extra */
     if ( (topN > 0)  && ( topN < rep.size()) ){
@@ -57,6 +235,32 @@ AtomicUnicodeHistogram::auh_t::report AtomicUnicodeHistogram::makeReport(size_t
     return rep;
 }
 
+AtomicUnicodeHistogram::auh_t::report AtomicUnicodeHistogram::extractReport()
+{
+    merge_partials();
+    if (topk) {
+        return topk_report(true);
+    }
+    auh_t::report rep;
+    rep.reserve(keys);
+    for (size_t i=0; i<SHARDS; i++) {
+        tally_map_t counts;
+        {
+            const std::lock_guard<std::mutex> lock(shards[i].M);
+            counts.swap(shards[i].counts);
+            keys -= counts.size();
+        }
+        size_t freed = 0;
+        for (auto &it: counts) {
+            freed += sizeof(it) + it.first.size();
+            rep.push_back(auh_t::AMReportElement(it.first, it.second));
+        }
+        key_bytes -= freed;
+    }
+    sort_report(rep, sort_threads, sort_min_keys);
+    return rep;
+}
+
 /**
  * Takes a string (the key) passed in, figure out what it is, and add it to a unicode histogram.
  * Typically it is going to be UTF16 or UTF8.
@@ -77,7 +281,28 @@ AtomicUnicodeHistogram::auh_t::report AtomicUnicodeHistogram::makeReport(size_t
 uint32_t AtomicUnicodeHistogram::debug_histogram_malloc_fail_frequency = 0;
 void AtomicUnicodeHistogram::clear()
 {
-    h.clear();
+    {
+        const std::lock_guard<std::mutex> lock(Mpartials);
+        for (auto &p: partials) {
+            const std::lock_guard<std::mutex> plock(p->M);
+            p->counts.clear();
+            p->adds = 0;
+            p->key_bytes = 0;
+        }
+    }
+    if (topk) {
+        const std::lock_guard<std::mutex> lock(topk->M);
+        topk->counts.clear();
+        topk->by_count.clear();
+        keys = 0;
+    } else {
+        for (size_t i=0; i<SHARDS; i++) {
+            const std::lock_guard<std::mutex> lock(shards[i].M);
+            keys -= shards[i].counts.size();
+            shards[i].counts.clear();
+        }
+    }
+    key_bytes = 0;
 }
 
 void AtomicUnicodeHistogram::add(const std::string &key_unknown_encoding)
@@ -94,12 +319,9 @@ void AtomicUnicodeHistogram::add(const std::string &key_unknown_encoding)
         // and then convert it to utf32
         u32key = convert_utf8_to_utf32( convert_utf16_to_utf8(key_unknown_encoding, little_endian));
         found_utf16 = true;
-        std::cerr <<"point1\n";
     } else {
         u32key = convert_utf8_to_utf32( key_unknown_encoding );
-        std::cerr <<"point2\n";
     }
-    std::cerr << "len(u32key)="<<u32key.size() << "\n";
 
     /* At this point we have UTF-32, which we treat as raw unicode characters.
      *
@@ -118,36 +340,57 @@ void AtomicUnicodeHistogram::add(const std::string &key_unknown_encoding)
      * https://www.moria.us/articles/wchar-is-a-historical-accident/?
      */
 
-    std::string u8key = convert_utf32_to_utf8(u32key);
     std::string displayString;
 
-    if (def.match( u8key, &displayString )){
+    if (def.match( std::move(u32key), &displayString )){
         /* Escape as necessary */
         displayString = validateOrEscapeUTF8( displayString, true, true, false);
 
+        /* Add the key to this thread's partial histogram */
+        partial_t &p = get_partial();
+        const std::lock_guard<std::mutex> lock(p.M);
+
         /* For debugging low-memory handling logic,
          * specify DEBUG_MALLOC_FAIL to make malloc occasionally fail
          */
         if (debug_histogram_malloc_fail_frequency){
-            if ((h.size() % debug_histogram_malloc_fail_frequency)==(debug_histogram_malloc_fail_frequency-1)){
+            if (((keys + p.counts.size()) % debug_histogram_malloc_fail_frequency)==(debug_histogram_malloc_fail_frequency-1)){
                 throw std::bad_alloc();
             }
         }
 
-        /* Add the key to the histogram. Note that this is threadsafe */
-        h.insertIfNotContains(displayString, HistogramTally());
-        h[displayString].count++;
+        auto [it, inserted] = p.counts.try_emplace(displayString);
+        if (inserted) {
+            p.key_bytes += sizeof(*it) + it->first.size();
+        }
+        it->second.count++;
         if (found_utf16){
-            h[displayString].count16++;  // track how many UTF16s were converted
+            it->second.count16++;  // track how many UTF16s were converted
+        }
+        if (++p.adds >= PARTIAL_MAX_ADDS || p.counts.size() >= PARTIAL_MAX_KEYS) {
+            merge(p);
         }
     }
 }
 
+size_t AtomicUnicodeHistogram::size()
+{
+    size_t count = keys;
+    const std::lock_guard<std::mutex> lock(Mpartials);
+    for (auto &p: partials) {
+        const std::lock_guard<std::mutex> plock(p->M);
+        count += p->counts.size();
+    }
+    return count;
+}
+
 size_t AtomicUnicodeHistogram::bytes()               // returns the total number of bytes of the histogram,.
 {
-    size_t count = sizeof(*this);
-    for(auto it:h){
-        count += sizeof(it.first) + it.first.size() + it.second.bytes();
+    size_t count = sizeof(*this) + (topk ? sizeof(topk_t) : SHARDS * sizeof(shard_t)) + key_bytes;
+    const std::lock_guard<std::mutex> lock(Mpartials);
+    for (auto &p: partials) {
+        const std::lock_guard<std::mutex> plock(p->M);
+        count += sizeof(partial_t) + p->key_bytes;
     }
     return count;
 }
@@ -15,9 +15,26 @@
  *
  * Note - case transitions and text extraction is performed in UTF-32.
  *      - regular expression are then run on the UTF-8. (Not the best, but it works for now.)
+ *
+ * Counting does not contend: each thread counts into its own partial histogram, which is merged into a
+ * table of SHARDS separately locked shards when it has PARTIAL_MAX_KEYS keys or has counted PARTIAL_MAX_ADDS
+ * strings. makeReport() merges the partials of every thread first, so a report made once the threads are
+ * done counting includes everything; bytes() and clear() include the partials too.
+ *
+ * If def.flags.topk is set, the partials are merged into a Space-Saving summary of at most topk keys instead
+ * of the shards (Metwally, Agrawal and El Abbadi, "Efficient Computation of Frequent and Top-k Elements in
+ * Data Streams"). A key that is not in a full summary replaces the key with the lowest count, and takes over
+ * that count as its error. So the memory is O(topk) however many distinct keys there are, each reported count
+ * is at most error more than the true count, and every key seen more than (total/topk) times is reported.
+ * The report is ordered by count, highest first.
  */
 
 #include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
 #include "atomic_map.h"
 #include "histogram_def.h"
 #include "unicode_escape.h"
@@ -27,13 +44,16 @@ struct AtomicUnicodeHistogram  {
     struct HistogramTally {
         uint32_t count      {0}; // total strings seen
         uint32_t count16    {0}; // total utf16 strings seen
+        uint32_t error      {0}; // count may exceed the true count by up to this much (topk histograms)
         HistogramTally(const HistogramTally &a){
             this->count   = a.count;
             this->count16 = a.count16;
+            this->error   = a.error;
         }
         HistogramTally &operator=(const HistogramTally &a){
             this->count   = a.count;
             this->count16 = a.count16;
+            this->error   = a.error;
             return *this;
         }
 
@@ -41,7 +61,7 @@ struct AtomicUnicodeHistogram  {
         virtual ~HistogramTally(){};
 
         bool operator== (const HistogramTally &a) const {
-            return this->count==a.count && this->count16 == a.count16;
+            return this->count==a.count && this->count16 == a.count16 && this->error == a.error;
         };
         bool operator!= (const HistogramTally &a) const {
             return !(*this == a);
@@ -57,21 +77,67 @@ struct AtomicUnicodeHistogram  {
     typedef atomic_map<std::string, struct AtomicUnicodeHistogram::HistogramTally> auh_t;
     typedef std::vector<auh_t::AMReportElement> FrequencyReportVector;
 
-    AtomicUnicodeHistogram(const struct histogram_def &def_):def(def_){ }
+    AtomicUnicodeHistogram(const struct histogram_def &def_);
     virtual ~AtomicUnicodeHistogram(){};
 
     void   clear();                     //empties the histogram
     void   add(const std::string &key);  // adds Unicode string to the histogram count
     size_t bytes();               // returns the total number of bytes of the histogram,.
+    size_t size();                // number of keys; approximate while other threads are counting
 
     /** makeReport() makes a report and returns a
      * FrequencyReportVector.
      */
     auh_t::report makeReport(size_t topN=0); // returns just the topN; 0 means all
+    auh_t::report extractReport();  // makeReport(0) and clear() at once, so that no counts are lost in between
     const struct histogram_def def;   // the definition we are making
 
+    static const size_t SHARDS = 64;
+    static const size_t PARTIAL_MAX_KEYS = 4096;
+    static const size_t PARTIAL_MAX_ADDS = 65536;
+    static const size_t PARALLEL_SORT_MIN = 1024*1024; // a report is sorted by one thread for each this many keys
+
+    /* The threads that makeReport() and extractReport() may use to sort a report (0 means one per core),
+     * and the fewest keys each of them must have. Set it before making a report, not while one is being made.
+     */
+    void   set_sort_threads(unsigned int threads, size_t min_keys=PARALLEL_SORT_MIN) {
+        sort_threads = threads;
+        sort_min_keys = min_keys;
+    }
+
 private:
-    auh_t h {};                        // the histogram
+    typedef std::unordered_map<std::string, HistogramTally> tally_map_t;
+    struct shard_t {
+        std::mutex  M {};
+        tally_map_t counts {};
+    };
+    struct partial_t {
+        std::mutex  M {};               // only contended when another thread merges it
+        tally_map_t counts {};
+        size_t      adds {0};
+        size_t      key_bytes {0};
+    };
+    const uint64_t      id;             // tells this histogram apart from others in the thread-local cache
+    std::unique_ptr<shard_t[]> shards;  // the histogram, less what is still in the partials
+    std::atomic<size_t> keys {0};       // keys in the shards
+    std::atomic<size_t> key_bytes {0};  // bytes used by the keys in the shards
+    std::mutex          Mpartials {};   // protects partials
+    std::vector<std::unique_ptr<partial_t>> partials {}; // never shrinks, so threads may cache pointers to them
+
+    struct topk_t {
+        std::mutex  M {};
+        tally_map_t counts {};          // at most def.flags.topk keys
+        std::set<std::pair<uint32_t, std::string>> by_count {}; // (count, key) for each key, lowest first
+    };
+    std::unique_ptr<topk_t> topk;       // only if def.flags.topk; replaces the shards
+    unsigned int        sort_threads {0};
+    size_t              sort_min_keys {PARALLEL_SORT_MIN};
+    void   topk_add(const std::string &key, const HistogramTally &t); // requires topk->M
+    auh_t::report topk_report(bool clear);
+
+    partial_t &get_partial();           // this thread's partial
+    void   merge(partial_t &p);         // requires p.M
+    void   merge_partials();            // merge every thread's partial
 };
 
 std::ostream & operator << (std::ostream &os, const AtomicUnicodeHistogram::FrequencyReportVector &rep);
@@ -9,13 +9,19 @@ AC_C_BIGENDIAN([AC_DEFINE(BE13_API_BIGENDIAN, 1, [Big Endian aarchitecutre - lik
                 AC_DEFINE(BE13_API_LITTLEENDIAN, 1, [Little Endian aarchitecutre - like x86]))
 
 
-AC_CHECK_HEADERS([dirent.h dlfcn.h err.h errno.h fcntl.h limits.h limits/limits.h linux/if_ether.h net/ethernet.h netinet/if_ether.h netinet/in.h pcap.h pcap/pcap.h pthread.h sqlite3.h stdint.h stdio.h stdlib.h string.h sys/cdefs.h sys/mman.h sys/stat.h sys/time.h sys/types.h unistd.h windows.h windows.h windowsx.h winsock2.h wpcap/pcap.h mach-o/dyld.h])
+AC_CHECK_HEADERS([dirent.h dlfcn.h err.h errno.h fcntl.h limits.h limits/limits.h linux/if_ether.h net/ethernet.h netinet/if_ether.h netinet/in.h pcap.h pcap/pcap.h pthread.h sqlite3.h stdint.h stdio.h stdlib.h string.h sys/cdefs.h sys/file.h sys/mman.h sys/stat.h sys/time.h sys/types.h unistd.h windows.h windows.h windowsx.h winsock2.h wpcap/pcap.h mach-o/dyld.h zstd.h])
 
-AC_CHECK_FUNCS([gmtime_r ishexnumber isxdigit localtime_r unistd.h mmap err errx warn warnx pread64 pread strptime _lseeki64 utimes ])
+AC_CHECK_FUNCS([gmtime_r ishexnumber isxdigit localtime_r unistd.h mmap flock fallocate posix_memalign err errx warn warnx pread64 pread strptime _lseeki64 utimes ])
 
 AC_CHECK_LIB([sqlite3],[sqlite3_libversion])
 AC_CHECK_FUNCS([sqlite3_create_function_v2])
 
+# zstd_seekable.cpp compresses feature files if libzstd is present
+AC_CHECK_LIB([zstd],[ZSTD_compressCCtx])
+
+# thread_pool.cpp uses std::thread
+AC_SEARCH_LIBS([pthread_create],[pthread])
+
 AC_COMPILE_IFELSE([AC_LANG_PROGRAM(
 [[#pragma GCC diagnostic ignored "-Wredundant-decls"
   int a=3;
@@ -29,3 +35,10 @@ AC_COMPILE_IFELSE([AC_LANG_PROGRAM(
   ]])],
  [AC_DEFINE(HAVE_DIAGNOSTIC_CAST_ALIGN,1,[define 1 if GCC supports -Wcast-align])]
 )
+
+AC_COMPILE_IFELSE([AC_LANG_PROGRAM(
+[[#pragma GCC diagnostic ignored "-Wmissing-noreturn"
+ int a=3;
+  ]])],
+ [AC_DEFINE(HAVE_DIAGNOSTIC_MISSING_NORETURN,1,[define 1 if GCC supports -Wmissing-noreturn])]
+)
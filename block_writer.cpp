@@ -0,0 +1,200 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * block_writer.cpp:
+ * Large-block output for the feature files. See block_writer.h.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "block_writer.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+block_writer::block_writer(const std::string &fname_, bool use_direct_io):
+    fname(fname_)
+{
+#if defined(O_DIRECT) && defined(HAVE_POSIX_MEMALIGN)
+    if (use_direct_io) {
+        fd = ::open(fname.c_str(), O_RDWR|O_CREAT|O_BINARY|O_DIRECT, 0666);
+        direct = (fd >= 0);             // some filesystems (e.g. tmpfs) refuse O_DIRECT
+    }
+#endif
+    if (fd < 0) {
+        fd = ::open(fname.c_str(), O_RDWR|O_CREAT|O_BINARY, 0666);
+    }
+    if (fd < 0) {
+        throw WriteError(fname + ": " + strerror(errno));
+    }
+#ifdef HAVE_POSIX_MEMALIGN
+    void *mem = nullptr;
+    if (posix_memalign(&mem, ALIGNMENT, BLOCK_SIZE) != 0) {
+        mem = nullptr;
+    }
+    buf = static_cast<char *>(mem);
+#else
+    buf = static_cast<char *>(malloc(BLOCK_SIZE));
+#endif
+    if (buf == nullptr) {
+        ::close(fd);
+        throw WriteError(fname + ": cannot allocate output buffer");
+    }
+
+    try {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            throw WriteError(fname + ": " + strerror(errno));
+        }
+        position_at(st.st_size);
+    } catch (const WriteError &e) {
+        ::close(fd);
+        free(buf);
+        throw;
+    }
+}
+
+block_writer::~block_writer()
+{
+    try {
+        close();
+    } catch (const WriteError &e) {
+    }
+    free(buf);
+}
+
+void block_writer::position_at(uint64_t end)
+{
+    base = end & ~static_cast<uint64_t>(ALIGNMENT-1);
+    used = end - base;
+    if (used > 0) {
+        ssize_t r = pread(fd, buf, ALIGNMENT, base);
+        if (r < static_cast<ssize_t>(used)) {
+            throw WriteError(fname + ": cannot read end of file");
+        }
+    }
+}
+
+void block_writer::resume_after_last_newline()
+{
+    flush();
+    const uint64_t file_end = base + used;
+    uint64_t end = file_end;
+    while (end > 0) {
+        /* Read the block that holds byte end-1 and look backwards for a newline */
+        const uint64_t start = (end-1) & ~static_cast<uint64_t>(BLOCK_SIZE-1);
+        ssize_t r = pread(fd, buf, BLOCK_SIZE, start);
+        if (r < 0) {
+            throw WriteError(fname + ": " + strerror(errno));
+        }
+        size_t n = std::min(static_cast<uint64_t>(r), end - start);
+        while (n > 0 && buf[n-1] != '\n') {
+            n--;
+        }
+        end = start + n;
+        if (n > 0) break;               // found one
+    }
+    /* The search used buf, so reload the partial block at the end of the file before truncate() flushes it */
+    position_at(file_end);
+    truncate(end);
+}
+
+void block_writer::truncate(uint64_t end)
+{
+    block_writer::flush();
+    if (end != base + used) {
+        if (ftruncate(fd, end) != 0) {
+            throw WriteError(fname + ": " + strerror(errno));
+        }
+        allocated = std::min(allocated, end); // ftruncate() also frees the space preallocated past end
+    }
+    position_at(end);
+}
+
+ssize_t block_writer::read_at(char *dst, size_t len, uint64_t offset)
+{
+    block_writer::flush();
+    return pread(fd, dst, len, offset);
+}
+
+void block_writer::preallocate(uint64_t end)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+    if (!can_preallocate || end <= allocated) return;
+    const uint64_t start = std::max(allocated, base);
+    const uint64_t len   = std::max(end - start, uint64_t(PREALLOCATE_SIZE));
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, start, len) == 0) {
+        allocated = start + len;
+    } else {
+        can_preallocate = false;        // e.g. NFS; just write without it
+    }
+#endif
+}
+
+void block_writer::write_block(size_t len)
+{
+    preallocate(base + len);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = pwrite(fd, buf+done, len-done, base+done);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            throw WriteError(fname + ": " + strerror(errno));
+        }
+        done += r;
+    }
+}
+
+void block_writer::write(std::string_view data)
+{
+    while (!data.empty()) {
+        size_t n = std::min(data.size(), BLOCK_SIZE - used);
+        memcpy(buf+used, data.data(), n);
+        used += n;
+        data.remove_prefix(n);
+        if (used == BLOCK_SIZE) {
+            write_block(BLOCK_SIZE);
+            base += BLOCK_SIZE;
+            used  = 0;
+        }
+    }
+}
+
+void block_writer::flush()
+{
+    if (fd < 0 || used == 0) return;
+    if (direct) {
+        /* O_DIRECT writes whole aligned blocks; pad, then trim the file back */
+        size_t len = (used + ALIGNMENT - 1) & ~(ALIGNMENT-1);
+        memset(buf+used, 0, len-used);
+        write_block(len);
+        if (ftruncate(fd, base+used) != 0) {
+            throw WriteError(fname + ": " + strerror(errno));
+        }
+        allocated = std::min(allocated, base+used); // the preallocation past the end went with the padding
+    } else {
+        write_block(used);
+    }
+}
+
+void block_writer::close()
+{
+    if (fd < 0) return;
+    flush();
+    /* Give back any space that was preallocated past the end */
+    if (allocated > base + used && ftruncate(fd, base + used) != 0) {
+        throw WriteError(fname + ": " + strerror(errno));
+    }
+    ::close(fd);
+    fd = -1;
+}
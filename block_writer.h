@@ -0,0 +1,82 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef BLOCK_WRITER_H
+#define BLOCK_WRITER_H
+
+/**
+ * \file
+ * block_writer.h:
+ * An append-only output file for the feature recorders.
+ *
+ * Writes are collected in one large, page-aligned block and written with pwrite() at an offset that the
+ * block_writer keeps itself, so it never asks the kernel where it is (no lseek()/tellg()).
+ * Space is preallocated with fallocate() ahead of the writes where the filesystem supports it.
+ * With O_DIRECT, partial blocks are padded to the alignment when flushed and the file is trimmed back
+ * to its real size.
+ *
+ * The buffer always holds the bytes of the file from base to base+used, so a flushed partial block is
+ * simply rewritten, with more data, when the block fills.
+ *
+ * A block_writer is not threadsafe; feature_recorder_file calls it with Mios held.
+ */
+
+#include <cstdint>
+#include <exception>
+#include <string>
+#include <string_view>
+
+#include <sys/types.h>
+
+class block_writer {
+    block_writer(const block_writer &)=delete;
+    block_writer &operator=(const block_writer &)=delete;
+
+    const std::string fname;
+    int      fd {-1};
+    bool     direct {false};            // opened with O_DIRECT
+    char     *buf {nullptr};            // BLOCK_SIZE bytes, ALIGNMENT-aligned
+    uint64_t base {0};                  // file offset of buf[0]; a multiple of ALIGNMENT
+    size_t   used {0};                  // bytes of buf in use
+    uint64_t allocated {0};             // the file has been preallocated up to here
+    bool     can_preallocate {true};
+
+    void     position_at(uint64_t end); // make end the end of the file, reloading the partial block before it
+    void     write_block(size_t len);   // pwrite buf[0..len) at base
+    void     preallocate(uint64_t end);
+
+public:
+    static const size_t   ALIGNMENT  = 4096;
+    static const size_t   BLOCK_SIZE = 1024*1024;
+    static const uint64_t PREALLOCATE_SIZE = 16*1024*1024;
+
+    class WriteError : public std::exception {
+        std::string m_error{};
+    public:
+        WriteError(std::string_view error):m_error(error){}
+        const char *what() const noexcept override {return m_error.c_str();}
+    };
+
+    /* Opens fname for writing at its end, creating it if necessary.
+     * If use_direct_io, O_DIRECT is used where it is available; if the filesystem refuses it, it is not.
+     */
+    block_writer(const std::string &fname, bool use_direct_io=false);
+    virtual ~block_writer();            // flushes and closes; errors are ignored; call close() to see them
+
+    /* These are virtual so that a subclass can transform the data, e.g. compress it, on the way to the file */
+    virtual uint64_t size() const { return base + used; } // bytes in the file, including those not yet written
+    bool     is_direct() const { return direct; }
+    const std::string &get_fname() const { return fname; }
+
+    /* Discard everything after the last newline, so that appending starts on a new line */
+    virtual void resume_after_last_newline();
+    virtual void write(std::string_view data);
+    virtual void flush();               // write the buffer to the file (but keep it)
+    virtual void close();
+
+protected:
+    /* For subclasses: these work on the bytes in the file and call block_writer::flush(), not flush() */
+    void     truncate(uint64_t end);    // discard the file from end on
+    ssize_t  read_at(char *dst, size_t len, uint64_t offset); // pread; not for use with O_DIRECT
+};
+
+#endif
@@ -0,0 +1,249 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * digest_store.cpp:
+ * The persistent digest store. See digest_store.h for the file layout and the locking protocol.
+ */
+
+#include "config.h"
+
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(HAVE_MMAP) && defined(HAVE_FLOCK) && defined(HAVE_SYS_FILE_H)
+#include <sys/mman.h>
+#include <sys/file.h>
+#define DIGEST_STORE_SUPPORTED
+#endif
+
+#include "digest_store.h"
+
+const char digest_store::MAGIC[8] = {'B','E','1','3','D','G','S','T'};
+
+/* Digests are only stored while the table is less than this full, so probes stay short */
+static bool too_full(uint64_t count, uint64_t capacity)
+{
+    return count * 10 >= capacity * 9;
+}
+
+#ifdef DIGEST_STORE_SUPPORTED
+
+digest_store::digest_store(const std::string &fname_, uint32_t alg, uint64_t min_capacity):
+    fname(fname_)
+{
+    uint64_t capacity = 1024;
+    while (capacity < min_capacity) {
+        capacity *= 2;
+    }
+
+    fd = ::open(fname.c_str(), O_RDWR|O_CREAT, 0666);
+    if (fd < 0) {
+        throw StoreError(fname + ": " + strerror(errno));
+    }
+
+    try {
+        /* Try to be the only user, so that we can create or grow the store. Otherwise, wait to share it. */
+        if (flock(fd, LOCK_EX|LOCK_NB) == 0) {
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                throw StoreError(fname + ": " + strerror(errno));
+            }
+            if (st.st_size == 0) {
+                initialize(alg, capacity);
+            } else {
+                map();
+                if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) == 0 && header->version == FORMAT_VERSION) {
+                    if (header->capacity < header->count * 2) {
+                        grow(header->capacity * 4);
+                    } else if (has_torn_slots()) {
+                        grow(header->capacity); // rebuild without them; emptying a slot in place would break probes
+                    }
+                }
+            }
+            flock(fd, LOCK_SH);         // downgrade
+        } else {
+            flock(fd, LOCK_SH);
+        }
+        if (header == nullptr) {
+            map();
+        }
+        if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != FORMAT_VERSION) {
+            throw StoreError(fname + ": not a digest store");
+        }
+        if (header->alg != alg) {
+            throw StoreError(fname + ": digest store holds a different digest algorithm");
+        }
+    } catch (const StoreError &e) {
+        unmap();
+        ::close(fd);
+        throw;
+    }
+}
+
+digest_store::~digest_store()
+{
+    unmap();
+    if (fd >= 0) {
+        flock(fd, LOCK_UN);
+        ::close(fd);
+    }
+}
+
+void digest_store::map()
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        throw StoreError(fname + ": " + strerror(errno));
+    }
+    if (static_cast<size_t>(st.st_size) < HEADER_SIZE) {
+        throw StoreError(fname + ": not a digest store");
+    }
+    void *addr = mmap(nullptr, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        throw StoreError(fname + ": mmap: " + strerror(errno));
+    }
+    mapped_size = st.st_size;
+    header = static_cast<header_t *>(addr);
+    slots  = reinterpret_cast<slot_t *>(static_cast<char *>(addr) + HEADER_SIZE);
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) == 0 && file_size(header->capacity) > mapped_size) {
+        throw StoreError(fname + ": digest store is truncated");
+    }
+}
+
+void digest_store::unmap()
+{
+    if (header) {
+        munmap(header, mapped_size);
+        header = nullptr;
+        slots  = nullptr;
+        mapped_size = 0;
+    }
+}
+
+void digest_store::initialize(uint32_t alg, uint64_t capacity)
+{
+    unmap();
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, file_size(capacity)) != 0) {
+        throw StoreError(fname + ": " + strerror(errno));
+    }
+    map();
+    header->version  = FORMAT_VERSION;
+    header->alg      = alg;
+    header->capacity = capacity;
+    header->count    = 0;
+    memcpy(header->magic, MAGIC, sizeof(MAGIC)); // last, so a half-made store is never valid
+    msync(header, HEADER_SIZE, MS_SYNC);
+}
+
+/* Nobody else has the store open, so a slot with hi set and lo 0 was left by a run that died mid-insert. */
+bool digest_store::has_torn_slots() const
+{
+    for (uint64_t i=0; i<header->capacity; i++) {
+        if (slots[i].hi != 0 && slots[i].lo == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Read out every complete digest, make the file the new size, and put them back. */
+void digest_store::grow(uint64_t capacity)
+{
+    std::vector<slot_t> saved;
+    saved.reserve(header->count);
+    for (uint64_t i=0; i<header->capacity; i++) {
+        if (slots[i].hi != 0 && slots[i].lo != 0) {
+            saved.push_back(slots[i]);
+        }
+    }
+    const uint32_t alg = header->alg;
+    initialize(alg, capacity);
+    for (const auto &s: saved) {
+        probe_insert(s, true);
+    }
+}
+
+#else
+
+digest_store::digest_store(const std::string &fname_, uint32_t alg, uint64_t min_capacity):
+    fname(fname_)
+{
+    throw StoreError("digest stores require mmap and flock, which are not available on this platform");
+}
+
+digest_store::~digest_store()
+{
+}
+
+void digest_store::map() {}
+void digest_store::unmap() {}
+void digest_store::initialize(uint32_t alg, uint64_t capacity) {}
+void digest_store::grow(uint64_t capacity) {}
+bool digest_store::has_torn_slots() const { return false; }
+
+#endif
+
+/* Find want. If it is not there and insert is set, store it in the first empty slot.
+ * Returns true if want was already in the store.
+ */
+bool digest_store::probe_insert(const slot_t &want, bool insert)
+{
+    const uint64_t capacity = header->capacity;
+    const uint64_t mask = capacity - 1;
+    uint64_t i = want.hi & mask;
+    for (uint64_t probes = 0; probes < capacity; probes++, i = (i+1) & mask) {
+        slot_t &slot = slots[i];
+        uint64_t hi = __atomic_load_n(&slot.hi, __ATOMIC_ACQUIRE);
+        if (hi == 0) {
+            if (!insert) {
+                return false;
+            }
+            if (too_full(__atomic_load_n(&header->count, __ATOMIC_RELAXED), capacity)) {
+                dropped_count += 1;
+                return false;
+            }
+            if (__atomic_compare_exchange_n(&slot.hi, &hi, want.hi, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&slot.lo, want.lo, __ATOMIC_RELEASE);
+                __atomic_fetch_add(&header->count, 1, __ATOMIC_RELAXED);
+                return false;
+            }
+            /* Somebody else claimed the slot first; hi now holds what they stored */
+        }
+        if (hi == want.hi) {
+            uint64_t lo;
+            unsigned spins = 0;
+            while ((lo = __atomic_load_n(&slot.lo, __ATOMIC_ACQUIRE)) == 0 && spins++ < TORN_WAIT_SPINS) {
+                std::this_thread::yield(); // the other writer is between its two stores
+            }
+            if (lo == want.lo) {
+                return true;
+            }
+            /* lo still 0: a torn slot, which matches nothing; keep probing */
+        }
+    }
+    if (insert) {
+        dropped_count += 1;
+    }
+    return false;
+}
+
+bool digest_store::contains(const digest128_t &d)
+{
+    return probe_insert(stored(d), false);
+}
+
+bool digest_store::check_for_presence_and_insert(const digest128_t &d)
+{
+    return probe_insert(stored(d), true);
+}
+
+uint64_t digest_store::size() const
+{
+    return __atomic_load_n(&header->count, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,100 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef DIGEST_STORE_H
+#define DIGEST_STORE_H
+
+/**
+ * \file
+ * digest_store.h:
+ * A persistent set of 128-bit sbuf digests, kept in a memory-mapped file so that pages processed by one run
+ * are recognized as seen-before by the next. Several runs (processes) may share a store at the same time.
+ *
+ * File layout:
+ *   header (HEADER_SIZE bytes): magic, version, digest algorithm, capacity, count
+ *   capacity slots of 16 bytes: an open-addressed, linearly-probed hash table; an all-zero slot is empty.
+ *
+ * Each slot is {hi, lo}. Stored digests have the top bit of hi set (OCCUPIED) and the bottom bit of lo set (READY),
+ * so neither word of a used slot is ever 0. An insert claims an empty slot with a compare-and-swap on hi and then
+ * stores lo; a reader that finds a matching hi whose lo is still 0 waits for it, but only for TORN_WAIT_SPINS
+ * yields. A run that died between the two stores leaves a torn slot (hi set, lo 0) behind for good, so after
+ * that the slot is skipped. Torn slots are dropped the next time a run opens the store with the exclusive lock.
+ * Otherwise slots are never removed.
+ *
+ * Locking: a run holds a shared flock() on the file while it has the store open. The store is created or grown
+ * only by a run that can get the exclusive lock without waiting, i.e. when no other run is using it. If the table
+ * gets too full while it is in use, new digests are not stored (they are counted in dropped()) until the next
+ * run is able to grow it.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <string>
+#include <string_view>
+
+#include "atomic_digest_set.h"
+
+class digest_store {
+    digest_store(const digest_store &)=delete;
+    digest_store &operator=(const digest_store &)=delete;
+
+    struct header_t {
+        char     magic[8];
+        uint32_t version;
+        uint32_t alg;                   // which digest the store holds; digests of different algorithms never match
+        uint64_t capacity;              // number of slots; a power of 2
+        uint64_t count;                 // number of used slots; updated atomically
+    };
+    struct slot_t {
+        uint64_t hi;
+        uint64_t lo;
+    };
+
+    const std::string fname;
+    int       fd {-1};
+    header_t  *header {nullptr};
+    slot_t    *slots {nullptr};
+    size_t    mapped_size {0};
+    std::atomic<uint64_t> dropped_count {0};
+
+    static size_t   file_size(uint64_t capacity) { return HEADER_SIZE + capacity * sizeof(slot_t); }
+    static slot_t   stored(const digest128_t &d) { return slot_t{ d.hi | OCCUPIED, d.lo | READY }; }
+    void     initialize(uint32_t alg, uint64_t capacity); // requires the exclusive lock
+    void     grow(uint64_t capacity);                     // requires the exclusive lock
+    bool     has_torn_slots() const;
+    void     map();
+    void     unmap();
+    bool     probe_insert(const slot_t &want, bool insert);
+
+public:
+    static const char     MAGIC[8];
+    static const uint32_t FORMAT_VERSION = 1;
+    static const size_t   HEADER_SIZE = 4096;
+    static const uint64_t OCCUPIED = 1ULL << 63;
+    static const uint64_t READY    = 1;
+    static const uint64_t DEFAULT_CAPACITY = 1ULL << 20; // 16MiB of slots
+    static const unsigned TORN_WAIT_SPINS = 100000;     // how long to wait for another writer's lo
+
+    class StoreError : public std::exception {
+        std::string m_error{};
+    public:
+        StoreError(std::string_view error):m_error(error){}
+        const char *what() const noexcept override {return m_error.c_str();}
+    };
+
+    /* Open (or create) a store of digests made with algorithm alg.
+     * min_capacity is the number of slots a new store gets; an existing store that is more than half full is
+     * made four times larger if no other run is using it.
+     * Throws StoreError if the file cannot be used or holds a different algorithm.
+     */
+    digest_store(const std::string &fname, uint32_t alg, uint64_t min_capacity=DEFAULT_CAPACITY);
+    virtual ~digest_store();
+
+    bool     contains(const digest128_t &d);
+    bool     check_for_presence_and_insert(const digest128_t &d); // true if it was already there
+    uint64_t size() const;
+    uint64_t capacity() const { return header->capacity; }
+    uint64_t dropped() const { return dropped_count; }      // digests not stored because the table was full
+};
+
+#endif
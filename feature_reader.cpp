@@ -0,0 +1,344 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * feature_reader.cpp:
+ * Read feature files, compressed or not. See feature_reader.h.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "feature_reader.h"
+#include "feature_recorder.h"
+#include "zstd_seekable.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static const size_t MIN_CHUNK_SIZE = 1024*1024; // parallel_for_each does not split plain files finer than this
+
+/* Strips a trailing \r. Returns false for blank and comment lines */
+static bool is_feature_line(std::string_view &line)
+{
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    return !line.empty() && line[0] != '#';
+}
+
+/* Calls emit for each complete line in data, prefixing the first with carry if there is one.
+ * A partial line at the end is left in carry.
+ */
+template <class EMIT> static void split_lines(std::string_view data, std::string &carry, EMIT emit)
+{
+    while (!data.empty()) {
+        const char *nl = static_cast<const char *>(memchr(data.data(), '\n', data.size()));
+        if (nl == nullptr) {
+            carry.append(data);
+            return;
+        }
+        const size_t len = nl - data.data();
+        if (carry.empty()) {
+            emit(data.substr(0, len));
+        } else {
+            carry.append(data.substr(0, len));
+            emit(std::string_view(carry));
+            carry.clear();
+        }
+        data.remove_prefix(len+1);
+    }
+}
+
+/****************************************************************
+ *** Feature and FeatureView
+ ****************************************************************/
+
+Feature Feature::parse(std::string_view line)
+{
+    return FeatureView(line).to_feature();
+}
+
+FeatureView::FeatureView(std::string_view line)
+{
+    size_t tab1 = line.find('\t');
+    pos = line.substr(0, tab1);
+    if (tab1 == std::string_view::npos) return;
+    feature = line.substr(tab1+1);
+    size_t tab2 = feature.find('\t');
+    if (tab2 != std::string_view::npos) {
+        context = feature.substr(tab2+1);
+        feature = feature.substr(0, tab2);
+    }
+}
+
+/* The forensic path is everything before the last '-'; the offset is after it */
+pos0_t FeatureView::pos0() const
+{
+    size_t dash = pos.rfind('-');
+    return pos0_t(std::string(dash == std::string_view::npos ? std::string_view() : pos.substr(0, dash)), offset());
+}
+
+uint64_t FeatureView::offset() const
+{
+    size_t dash = pos.rfind('-');
+    std::string_view digits = (dash == std::string_view::npos) ? pos : pos.substr(dash+1);
+    uint64_t o = 0;
+    std::from_chars(digits.data(), digits.data()+digits.size(), o);
+    return o;
+}
+
+std::string FeatureView::unquoted_feature() const
+{
+    if (feature.find('\\') == std::string_view::npos) return std::string(feature);
+    return feature_recorder::unquote_string(std::string(feature));
+}
+
+std::string FeatureView::unquoted_context() const
+{
+    if (context.find('\\') == std::string_view::npos) return std::string(context);
+    return feature_recorder::unquote_string(std::string(context));
+}
+
+/****************************************************************
+ *** FeatureReader
+ ****************************************************************/
+
+FeatureReader::FeatureReader(const std::string &fname_):
+    fname(fname_)
+{
+    if (zstd_seekable_reader::is_zstd_file(fname)) {
+        try {
+            zin = std::make_unique<zstd_seekable_reader>(fname);
+        } catch (const zstd_seekable_reader::ReadError &e) {
+            throw ReadError(e.what());
+        }
+        return;
+    }
+
+    int fd = ::open(fname.c_str(), O_RDONLY|O_BINARY);
+    if (fd < 0) {
+        throw ReadError("cannot open feature file " + fname);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw ReadError(fname + ": " + strerror(errno));
+    }
+    const size_t size = st.st_size;
+#ifdef HAVE_MMAP
+    if (size > 0) {
+        void *m = mmap(nullptr, size, PROT_READ, MAP_FILE|MAP_SHARED, fd, 0);
+        if (m != MAP_FAILED) {
+            map_base = static_cast<const char *>(m);
+            map_size = size;
+#ifdef MADV_SEQUENTIAL
+            madvise(m, size, MADV_SEQUENTIAL);
+#endif
+        }
+    }
+#endif
+    if (map_base) {
+        text = std::string_view(map_base, map_size);
+    } else {
+        /* No mmap: read the whole file */
+        contents.resize(size);
+        size_t done = 0;
+        while (done < size) {
+            ssize_t r = pread(fd, contents.data()+done, size-done, done);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            done += r;
+        }
+        contents.resize(done);
+        text = contents;
+    }
+    ::close(fd);
+}
+
+FeatureReader::~FeatureReader()
+{
+#ifdef HAVE_MMAP
+    if (map_base) {
+        munmap(const_cast<char *>(map_base), map_size);
+    }
+#endif
+}
+
+bool FeatureReader::next_line(std::string_view &line)
+{
+    if (!zin) {
+        if (text_pos >= text.size()) return false;
+        const char *start = text.data() + text_pos;
+        const char *nl = static_cast<const char *>(memchr(start, '\n', text.size() - text_pos));
+        const size_t len = nl ? nl - start : text.size() - text_pos;
+        line = std::string_view(start, len);
+        text_pos += len + 1;
+        return true;
+    }
+
+    /* A line may continue into the next frame if the file was flushed in the middle of a line */
+    carry.clear();
+    bool in_carry = false;
+    for (;;) {
+        if (frame_pos >= frame.size()) {
+            if (next_frame == zin->frame_count()) {
+                line = carry;           // the last line had no newline
+                return in_carry;
+            }
+            try {
+                zin->read_frame(next_frame++, frame);
+            } catch (const zstd_seekable_reader::ReadError &e) {
+                throw ReadError(e.what());
+            }
+            frame_pos = 0;
+            continue;
+        }
+        size_t nl = frame.find('\n', frame_pos);
+        if (nl == std::string::npos) {
+            carry.append(frame, frame_pos, std::string::npos);
+            frame_pos = frame.size();
+            in_carry = true;
+            continue;
+        }
+        if (in_carry) {
+            carry.append(frame, frame_pos, nl - frame_pos);
+            line = carry;
+        } else {
+            line = std::string_view(frame).substr(frame_pos, nl - frame_pos);
+        }
+        frame_pos = nl + 1;
+        return true;
+    }
+}
+
+FeatureReader::iterator &FeatureReader::iterator::operator++()
+{
+    std::string_view line;
+    while (fr) {
+        if (!fr->next_line(line)) {
+            fr = nullptr;
+            fv = FeatureView();
+            break;
+        }
+        if (is_feature_line(line)) {
+            fv = FeatureView(line);
+            break;
+        }
+    }
+    return *this;
+}
+
+/* Chunks are handed out to the threads from a counter, so a thread that finishes early takes another.
+ * Plain files are cut at the first newline after each chunk boundary.
+ * Compressed files are cut at frames; a chunk that starts in the middle of a line skips to the next
+ * line, and a chunk that ends in the middle of one reads on into the next frames to finish it.
+ */
+void FeatureReader::parallel_for_each(const feature_callback_t &fn, unsigned int threads)
+{
+    if (threads == 0) {
+        threads = std::max(1U, std::thread::hardware_concurrency());
+    }
+    auto emit = [&fn](std::string_view line) {
+        if (is_feature_line(line)) {
+            fn(FeatureView(line));
+        }
+    };
+
+    size_t nchunks = 0;
+    std::vector<size_t> bounds;         // chunk k is [bounds[k], bounds[k+1]): bytes, or frames if compressed
+    if (zin) {
+        const size_t frames = zin->frame_count();
+        nchunks = std::min(frames, size_t(threads) * 4);
+        for (size_t k=0; k<=nchunks; k++) {
+            bounds.push_back(frames * k / std::max(nchunks, size_t(1)));
+        }
+    } else {
+        nchunks = std::max(size_t(1), std::min(size_t(threads) * 4, text.size() / MIN_CHUNK_SIZE + 1));
+        bounds.push_back(0);
+        for (size_t k=1; k<nchunks; k++) {
+            size_t p = std::max(text.size() * k / nchunks, bounds.back());
+            const char *nl = static_cast<const char *>(memchr(text.data()+p, '\n', text.size()-p));
+            bounds.push_back(nl ? nl - text.data() + 1 : text.size());
+        }
+        bounds.push_back(text.size());
+    }
+
+    std::atomic<size_t> next_chunk {0};
+    std::mutex          Merror;
+    std::exception_ptr  error {};
+    auto worker = [&]() {
+        try {
+            std::unique_ptr<zstd_seekable_reader> zr; // each thread decompresses with its own reader
+            if (zin) {
+                zr = std::make_unique<zstd_seekable_reader>(fname);
+            }
+            std::string chunk_frame, chunk_carry;
+            for (size_t k; (k = next_chunk++) < nchunks; ) {
+                chunk_carry.clear();
+                if (!zr) {
+                    split_lines(text.substr(bounds[k], bounds[k+1]-bounds[k]), chunk_carry, emit);
+                    if (!chunk_carry.empty()) emit(chunk_carry); // no newline at the end of the file
+                    continue;
+                }
+                bool skipping = false;  // skipping the end of a line that belongs to the previous chunk
+                if (bounds[k] > 0) {
+                    zr->read_frame(bounds[k]-1, chunk_frame);
+                    skipping = !chunk_frame.empty() && chunk_frame.back() != '\n';
+                }
+                bool in_carry = false;
+                for (size_t f = bounds[k]; f < zr->frame_count(); f++) {
+                    if (f >= bounds[k+1] && (skipping || !in_carry)) break;
+                    zr->read_frame(f, chunk_frame);
+                    std::string_view data(chunk_frame);
+                    if (f >= bounds[k+1]) {
+                        /* finishing the last line of this chunk */
+                        size_t nl = data.find('\n');
+                        chunk_carry.append(data.substr(0, nl));
+                        if (nl != std::string_view::npos) break;
+                        continue;
+                    }
+                    if (skipping) {
+                        size_t nl = data.find('\n');
+                        if (nl == std::string_view::npos) continue;
+                        data.remove_prefix(nl+1);
+                        skipping = false;
+                    }
+                    split_lines(data, chunk_carry, emit);
+                    in_carry = !chunk_carry.empty();
+                }
+                if (!chunk_carry.empty() && !skipping) emit(chunk_carry);
+            }
+        } catch (...) {
+            const std::lock_guard<std::mutex> lock(Merror);
+            if (!error) error = std::current_exception();
+            next_chunk = nchunks;       // stop the others
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned int i=1; i < std::min(size_t(threads), nchunks); i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto &th: pool) {
+        th.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
@@ -0,0 +1,121 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef FEATURE_READER_H
+#define FEATURE_READER_H
+
+/**
+ * \file
+ * feature_reader.h:
+ * Reads the features back from a feature file.
+ *
+ * Plain feature files are mapped into memory (or read into memory where there is no mmap) and split into
+ * lines in place; each line is parsed into a FeatureView, which points into the mapping, so nothing is
+ * copied. unquote_string() is only run when the caller asks for an unquoted feature or context.
+ *
+ * Files written with feature_recorder_set::flags_t::compress_output are recognized by the zstd magic
+ * number at their start and decompressed a frame at a time; lines point into the frame.
+ * Comment lines (the banner) and blank lines are skipped.
+ *
+ *   for (const auto &f : FeatureReader("email.txt")) { ... f.pos ... f.feature ... f.context ... }
+ *
+ * parallel_for_each() splits the file into chunks at newlines (at frames for compressed files) and
+ * parses the chunks on several threads.
+ */
+
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "pos0.h"
+
+class zstd_seekable_reader;
+
+/* New classes for a more object-oriented interface */
+struct Feature {
+    Feature(const pos0_t &pos_, const std::string &feature_, const std::string & context_):
+        pos(pos_), feature(feature_), context(context_){};
+    const pos0_t pos;
+    const std::string feature;
+    const std::string context;
+
+    /* Parse a line of a feature file: pos0 TAB feature [TAB context] */
+    static Feature parse(std::string_view line);
+};
+
+/* A feature file line split in place. The views are only valid while the line is. */
+struct FeatureView {
+    std::string_view pos {};            // the forensic path and offset, as written
+    std::string_view feature {};        // as written (quoted)
+    std::string_view context {};        // as written (quoted); empty if there is none
+
+    FeatureView(){}
+    FeatureView(std::string_view line);
+    pos0_t      pos0() const;
+    uint64_t    offset() const;         // pos0().offset, without making a pos0_t
+    std::string unquoted_feature() const;
+    std::string unquoted_context() const;
+    Feature     to_feature() const { return Feature(pos0(), std::string(feature), std::string(context)); }
+};
+
+/* Given a feature file, returns a class that iterates through it */
+class FeatureReader {
+    FeatureReader(const FeatureReader &)=delete;
+    FeatureReader &operator=(const FeatureReader &)=delete;
+
+    const std::string fname;
+
+    /* plain feature files */
+    const char  *map_base {nullptr};    // the mapping, if the file was mapped
+    size_t      map_size {0};
+    std::string contents {};            // the file, if it could not be mapped
+    std::string_view text {};           // the whole file
+    size_t      text_pos {0};           // start of the next line
+
+    /* compressed feature files */
+    std::unique_ptr<zstd_seekable_reader> zin {};
+    size_t      next_frame {0};
+    std::string frame {};               // the frame being read
+    size_t      frame_pos {0};          // next line in frame
+    std::string carry {};               // a line that started in an earlier frame
+
+    bool   next_line(std::string_view &line); // the next line, without the \n
+
+public:
+    class ReadError : public std::exception {
+        std::string m_error{};
+    public:
+        ReadError(std::string_view error):m_error(error){}
+        const char *what() const noexcept override {return m_error.c_str();}
+    };
+
+    FeatureReader(const std::string &fname);
+    virtual ~FeatureReader();
+
+    bool is_compressed() const { return zin != nullptr; }
+
+    /* Reads one feature at a time. There is only one pass through the file */
+    class iterator {
+        FeatureReader *fr {nullptr};    // nullptr at the end
+        FeatureView   fv {};
+    public:
+        iterator(){}
+        iterator(FeatureReader *fr_):fr(fr_) { ++(*this); }
+        iterator &operator++();
+        const FeatureView &operator*() const { return fv; }
+        const FeatureView *operator->() const { return &fv; }
+        bool operator==(const iterator &that) const { return fr == that.fr; }
+        bool operator!=(const iterator &that) const { return fr != that.fr; }
+    };
+    iterator begin() { return iterator(this); }
+    iterator end()   { return iterator(); }
+
+    /* Calls fn for every feature in the file, from as many as threads threads at once (0 means one per core).
+     * Independent of the iterator. The first exception thrown by fn or by a reader is rethrown.
+     */
+    typedef std::function<void(const FeatureView &)> feature_callback_t;
+    void   parallel_for_each(const feature_callback_t &fn, unsigned int threads=0);
+};
+
+#endif
@@ -6,15 +6,18 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include <charconv>
 #include <cstdarg>
 #include <regex>
 #include <sstream>
 #include <fstream>
 #include <iomanip>
 #include <filesystem>
+#include <queue>
 
 #include "feature_recorder.h"
 #include "feature_recorder_set.h"
+#include "feature_sink.h"
 #include "word_and_context_list.h"
 #include "unicode_escape.h"
 #include "utils.h"
@@ -70,6 +73,18 @@ feature_recorder::~feature_recorder()
 {
 }
 
+void feature_recorder::add_sink(std::unique_ptr<feature_sink> sink)
+{
+    sinks.push_back(std::move(sink));
+}
+
+void feature_recorder::sinks_shutdown()
+{
+    for (auto &sink: sinks) {
+        sink->shutdown();
+    }
+}
+
 /**
  * Unquote Python or octal-style quoting of a string
  */
@@ -156,6 +171,15 @@ const std::string feature_recorder::fname_in_outdir(std::string suffix, int coun
  */
 
 void feature_recorder::quote_if_necessary(std::string &feature,std::string &context) const
+{
+    std::string buf;
+    feature = std::string(quote_if_necessary(feature, fs.opt_max_feature_size, buf));
+    if ( flags.no_context == false) {
+        context = std::string(quote_if_necessary(context, fs.opt_max_context_size, buf));
+    }
+}
+
+std::string_view feature_recorder::quote_if_necessary(std::string_view str, size_t max_size, std::string &buf) const
 {
     /* By default quote string that is not UTF-8, and quote backslashes. */
     bool escape_bad_utf8  = true;
@@ -171,34 +195,31 @@ void feature_recorder::quote_if_necessary(std::string &feature,std::string &cont
         escape_backslash = false;
     }
 
-    feature = validateOrEscapeUTF8(feature,
-                                   escape_bad_utf8, escape_backslash,
-                                   validateOrEscapeUTF8_validate);
-
-    if (feature.size() > fs.opt_max_feature_size) {
-        feature.resize(fs.opt_max_feature_size);
+    /* Most features are already clean, so only make a copy if quoting changes something */
+    if ((escape_bad_utf8 || escape_backslash || validateOrEscapeUTF8_validate)
+        && validateOrEscapeUTF8_unchanged(str, escape_backslash) != str.size()) {
+        buf.clear();
+        validateOrEscapeUTF8(str, escape_bad_utf8, escape_backslash, validateOrEscapeUTF8_validate, buf);
+        str = buf;
     }
 
-    if ( flags.no_context == false) {
-        context = validateOrEscapeUTF8(context, escape_bad_utf8,
-                                       escape_backslash, validateOrEscapeUTF8_validate);
-        if (context.size() > fs.opt_max_context_size) {
-            context.resize(fs.opt_max_context_size);
-        }
+    if (str.size() > max_size) {
+        str = str.substr(0, max_size);
     }
+    return str;
 }
 
 /*
  * write0:
  */
-void feature_recorder::write0(const std::string &str)
+void feature_recorder::write0(std::string_view str)
 {
 }
 
 /*
  * Write: keep track of count of features written.
  */
-void feature_recorder::write0(const pos0_t &pos0, const std::string &feature, const std::string &context)
+void feature_recorder::write0(const pos0_t &pos0, std::string_view feature, std::string_view context)
 {
     features_written += 1;
 }
@@ -207,7 +228,7 @@ void feature_recorder::write0(const pos0_t &pos0, const std::string &feature, co
  * write() is the main entry point for writing a feature at a given position with context.
  * write() checks the stoplist and escapes non-UTF8 characters, then calls write0().
  */
-void feature_recorder::write(const pos0_t &pos0, const std::string &feature_, const std::string &context_)
+void feature_recorder::write(const pos0_t &pos0, std::string_view feature_, std::string_view context_)
 {
     if (fs.flags.disabled) return;           // disabled
 
@@ -222,11 +243,13 @@ void feature_recorder::write(const pos0_t &pos0, const std::string &feature_, co
 
     /* TODO: This needs to be change to do all processing in utf32 and not utf8 */
 
-    std::string feature      = feature_;
-    std::string context      = flags.no_context ? "" : context_;
-    std::string feature_utf8 = make_utf8(feature);
+    /* Quoted copies, if they are needed, are made in buffers that are reused by every write on this thread. */
+    thread_local std::string feature_buf;
+    thread_local std::string context_buf;
 
-    quote_if_necessary(feature,context);
+    std::string_view feature = quote_if_necessary(feature_, fs.opt_max_feature_size, feature_buf);
+    std::string_view context = flags.no_context ? std::string_view() :
+        quote_if_necessary(context_, fs.opt_max_context_size, context_buf);
 
     if ( feature.size()==0 ){
         std::cerr << name << ": zero length feature at " << pos0 << "\n";
@@ -254,8 +277,9 @@ void feature_recorder::write(const pos0_t &pos0, const std::string &feature_, co
     if (flags.no_stoplist==false
         && fs.stop_list
         && fs.stop_list_recorder
-        && fs.stop_list->check_feature_context(feature_utf8,context)) {
-        fs.stop_list_recorder->write(pos0,feature,context);
+        && fs.stop_list->check_feature_context(make_utf8(std::string(feature_)), std::string(context))) {
+        /* Copy out of this thread's buffers, which the nested write() reuses */
+        fs.stop_list_recorder->write(pos0, std::string(feature), std::string(context));
         return;
     }
 
@@ -278,8 +302,19 @@ void feature_recorder::write(const pos0_t &pos0, const std::string &feature_, co
     /* add the feature to any histograms; the regex is applied in the histogram */
     this->histograms_add_feature(feature);
 
-    /* Finally write out the feature and the context */
+    /* Finally write out the feature and the context, and pass them on to the sinks */
     this->write0(pos0, feature, context);
+    std::string feature_copy, context_copy;
+    for (auto &sink: sinks) {
+        if (sink->may_write_features() && feature.data() != feature_copy.data()) {
+            /* Copy out of this thread's buffers before a nested write() can reuse them */
+            feature_copy.assign(feature);
+            context_copy.assign(context);
+            feature = feature_copy;
+            context = context_copy;
+        }
+        sink->write(pos0, feature, context);
+    }
 }
 
 /**
@@ -319,8 +354,10 @@ void feature_recorder::write_buf(const sbuf_t &sbuf,size_t pos,size_t len)
         len = sbuf.bufsize - pos;
     }
 
-    std::string feature = sbuf.substr(pos,len);
-    std::string context;
+    /* The feature and context are written straight from the sbuf, without copying */
+    const char *base = reinterpret_cast<const char *>(sbuf.buf);
+    std::string_view feature(base+pos, len);
+    std::string_view context;
 
     if (flags.no_context==false) {
         /* Context write; create a clean context */
@@ -329,7 +366,7 @@ void feature_recorder::write_buf(const sbuf_t &sbuf,size_t pos,size_t len)
 
         if (p1>sbuf.bufsize) p1 = sbuf.bufsize;
         assert( p0<=p1 );
-        context = sbuf.substr(p0,p1-p0);
+        context = std::string_view(base+p0, p1-p0);
     }
     this->write(sbuf.pos0+pos, feature, context);
 }
@@ -690,15 +727,35 @@ void feature_recorder::histogram_add(const struct histogram_def &def)
 }
 
 /**
- * add a feature to all of the feature recorder's histograms
+ * add a feature to the sketch and to all of the feature recorder's histograms
  * @param feature - the feature to add.
  */
-void feature_recorder::histograms_add_feature(const std::string &feature)
+void feature_recorder::histograms_add_feature(std::string_view feature_)
 {
-    std::cerr << "add_feature('" << feature << "')\n";
+    sketch.add(feature_);
+    if (histograms.empty()) return;
+    const std::string feature(feature_);
     for (auto &h: histograms ){
-        h->add(feature);               // add the original feature
+        try {
+            h->add(feature);               // add the original feature
+        } catch (const std::bad_alloc &e) {
+            /* Out of memory. Spill the largest histogram to disk and try again */
+            if (!histogram_flush_largest()) throw;
+            h->add(feature);
+        }
+    }
+    if (fs.opt_histogram_memory > 0 && ++histogram_adds % HISTOGRAM_CHECK_INTERVAL == 0) {
+        fs.histograms_check_memory();
+    }
+}
+
+size_t feature_recorder::histogram_bytes()
+{
+    size_t count = 0;
+    for (auto &h: histograms) {
+        count += h->bytes();
     }
+    return count;
 }
 
 /**
@@ -706,39 +763,147 @@ void feature_recorder::histograms_add_feature(const std::string &feature)
  * allocated memory.
  *
  * In BE2.0, the file recorder's histograms are built in memory. If
- * they are too big for memory, file-histograms they are flushed and
- * need to be recombined in post-processing. SQL feature recorder uses the
+ * they are too big for memory, they are spilled to run files
+ * and recombined by histogram_merge(). SQL feature recorder uses the
  * SQLite3 to create the histograms.
  */
 
 bool feature_recorder::histogram_flush_largest()
 {
-    /* TODO - implement */
-    return false;
+    const std::lock_guard<std::mutex> lock(Mhistogram_runs);
+    AtomicUnicodeHistogram *largest = nullptr;
+    size_t largest_bytes = 0;
+    for (auto &h: histograms) {
+        if (h->def.flags.topk > 0 || h->size() == 0) continue; // topk histograms are already bounded
+        const size_t bytes = h->bytes();
+        if (bytes > largest_bytes) {
+            largest = h.get();
+            largest_bytes = bytes;
+        }
+    }
+    if (largest == nullptr) return false;
+    histogram_spill(*largest);
+    return true;
+}
+
+/* Write h's report to a new run file, one "count TAB count16 TAB key" line per key, and empty h.
+ * Keys cannot contain newlines, because features cannot.
+ */
+void feature_recorder::histogram_spill(AtomicUnicodeHistogram &h)
+{
+    std::string fname = fname_in_outdir(h.def.suffix + "_run", NEXT_COUNT);
+    std::ofstream out(fname.c_str(), std::ios_base::out|std::ios_base::trunc|std::ios_base::binary);
+    if (!out.is_open()) {
+        throw std::runtime_error("Cannot open histogram run file " + fname);
+    }
+    for (const auto &e: h.extractReport()) {
+        out << e.value.count << '\t' << e.value.count16 << '\t' << e.key << '\n';
+    }
+    out.close();
+    if (out.fail()) {
+        throw std::runtime_error("Disk full. Free up space and re-restart.");
+    }
+    histogram_runs[&h].push_back(fname);
 }
 
 void feature_recorder::histogram_flush_all()
 {
     for (auto &h: histograms ) {
-        std::cerr << "histogram_flush \n";
-        this->histogram_flush( *h );
+        this->histogram_generate( *h );
+    }
+}
+
+void feature_recorder::histogram_generate(AtomicUnicodeHistogram &h)
+{
+    bool spilled = false;
+    {
+        const std::lock_guard<std::mutex> lock(Mhistogram_runs);
+        spilled = histogram_runs.find(&h) != histogram_runs.end();
+    }
+    if (spilled) {
+        this->histogram_merge( h );
+    } else {
+        this->histogram_flush( h );
     }
 }
 
-#if 0
 /*
  * histogram_merge:
- * If possible, read all histogram files into memory and write them
- * out as a single histogram file. If we run out of memory during the process, fail.
- *
+ * Spill what is left of h, then merge all of its runs into its histogram file and remove them.
+ * Every run is in report order, so the merge reads one line of each run at a time and
+ * writes the histogram in the order makeReport() would have.
  */
-void feature_recorder::histogram_merge(const struct histogram_def &def)
-{
-    throw std::runtime_error("Implement histogram_merge");
+namespace {
+    struct histogram_run {
+        std::ifstream in;
+        AtomicUnicodeHistogram::auh_t::AMReportElement e {};
+        histogram_run(const std::string &fname):in(fname.c_str(), std::ios_base::in|std::ios_base::binary){}
+        bool next() {                   // read the next key; false at the end of the run
+            std::string line;
+            if (!getline(in, line)) return false;
+            size_t t1 = line.find('\t');
+            size_t t2 = (t1 == std::string::npos) ? t1 : line.find('\t', t1+1);
+            if (t2 == std::string::npos) {
+                throw std::runtime_error("corrupt histogram run: " + line);
+            }
+            std::from_chars(line.data(), line.data()+t1, e.value.count);
+            std::from_chars(line.data()+t1+1, line.data()+t2, e.value.count16);
+            e.key.assign(line, t2+1);
+            return true;
+        }
+    };
 }
 
-void feature_recorder::histogram_merge_all()
+void feature_recorder::histogram_merge(AtomicUnicodeHistogram &h)
 {
-    throw std::runtime_error("Implement histogram_merge_all");
+    std::vector<std::string> runs;
+    {
+        const std::lock_guard<std::mutex> lock(Mhistogram_runs);
+        if (h.size() > 0) {
+            histogram_spill(h);
+        }
+        runs = std::move(histogram_runs[&h]);
+        histogram_runs.erase(&h);
+    }
+
+    std::vector<std::unique_ptr<histogram_run>> inputs;
+    auto lower = [](const histogram_run *a, const histogram_run *b) { return a->e.key < b->e.key; };
+    std::priority_queue<histogram_run *, std::vector<histogram_run *>, decltype(lower)> heap(lower); // highest key on top
+    for (const auto &run: runs) {
+        inputs.push_back(std::make_unique<histogram_run>(run));
+        if (!inputs.back()->in.is_open()) {
+            throw std::runtime_error("Cannot open histogram run file " + run);
+        }
+        if (inputs.back()->next()) {
+            heap.push(inputs.back().get());
+        }
+    }
+
+    std::string fname = fname_in_outdir(h.def.suffix, NEXT_COUNT);
+    std::ofstream hfile(fname.c_str());
+    if (!hfile.is_open()) {
+        throw std::runtime_error("Cannot open feature histogram file " + fname);
+    }
+    while (!heap.empty()) {
+        histogram_run *r = heap.top();
+        heap.pop();
+        AtomicUnicodeHistogram::auh_t::AMReportElement e = r->e;
+        if (r->next()) heap.push(r);
+        while (!heap.empty() && heap.top()->e.key == e.key) {
+            histogram_run *s = heap.top();
+            heap.pop();
+            e.value.count   += s->e.value.count;
+            e.value.count16 += s->e.value.count16;
+            if (s->next()) heap.push(s);
+        }
+        hfile << e;
+    }
+    hfile.close();
+    if (hfile.fail()) {
+        throw std::runtime_error("Disk full. Free up space and re-restart.");
+    }
+    for (const auto &run: runs) {
+        std::filesystem::remove(run);
+    }
 }
-#endif
+
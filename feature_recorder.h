@@ -5,6 +5,7 @@
 #include <cassert>
 
 #include <string>
+#include <string_view>
 #include <set>
 #include <map>
 #include <thread>
@@ -12,12 +13,16 @@
 #include <fstream>
 #include <atomic>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 #include "pos0.h"
 #include "sbuf.h"
 #include "atomic_set.h"
 #include "histogram_def.h"
 #include "atomic_unicode_histogram.h"
+#include "feature_reader.h"
+#include "feature_sketch.h"
 
 /**
  * \addtogroup bulk_extractor_APIs
@@ -46,13 +51,15 @@
  * a second feature_recorder.
  *
  * Histogram - New in BE2.0, the histograms are built on-the-fly as features are recorded.
- * If memory runs below the LOW_MEMORY_THRESHOLD defined in the feature_recorder_sert,
- * the largest feature recorder is written to disk and a new feature_recorder histogram is started.
+ * If memory runs out, or the histograms use more than the opt_histogram_memory of the feature_recorder_set,
+ * the largest histogram is written to disk and a new histogram is started.
  *
  * When the feature_recorder_set shuts down, all remaining histograms are written to the disk.
  * Then, if there is any case where multiple histogram files were written, a merge-sort is performed.
  */
 
+class feature_sink;
+
 struct feature_recorder_def {
     std::string name;                   // the name of the feature recorder
     /**
@@ -86,28 +93,6 @@ struct feature_recorder_def {
 };
 
 
-/* New classes for a more object-oriented interface */
-struct Feature {
-    Feature(const pos0_t &pos_, const std::string &feature_, const std::string & context_):
-        pos(pos_), feature(feature_), context(context_){};
-    const pos0_t pos;
-    const std::string feature;
-    const std::string context;
-};
-
-/* Given an open feature_recorder, returns a class that iterates through it */
-class FeatureReader {
-    friend class feature_recorder;
-    FeatureReader(const class feature_recorder &fr);
-public:
-    std::fstream infile;
-    FeatureReader &operator++();
-    FeatureReader begin();
-    FeatureReader end();
-    Feature operator*();
-};
-
-
 class feature_recorder {
     /* default copy construction and assignment are meaningless and not implemented */
     feature_recorder(const feature_recorder &)=delete;
@@ -117,6 +102,7 @@ class feature_recorder {
 protected:
     class  feature_recorder_set &fs; // the set in which this feature_recorder resides
     virtual const std::string &get_outdir() const;      // cannot be inline because it accesses fs
+    std::vector<std::unique_ptr<feature_sink>> sinks {}; // see add_sink()
 
 public:;
     /* The main public interface:
@@ -132,6 +118,7 @@ public:;
     /* State variables for this feature recorder */
     std::atomic<size_t>       context_window {0};      // context window for this feature recorder
     std::atomic<int64_t>      features_written {0};
+    feature_sketch            sketch {};            // estimated frequencies and distinct count of the features
 
 
     /* Special tokens written into the file */
@@ -151,9 +138,21 @@ public:;
      */
     void quote_if_necessary(std::string &feature,std::string &context) const;
 
+    /* Returns str quoted as above and truncated to max_size. str itself is returned when quoting does not
+     * change it; otherwise the quoted copy is built in buf, which the caller can reuse from call to call.
+     */
+    std::string_view quote_if_necessary(std::string_view str, size_t max_size, std::string &buf) const;
+
     /* Called when the scanner set shutdown */
     virtual void shutdown();
 
+    /* Sinks (feature_sink.h) get every feature that write() writes, after it has been checked and quoted.
+     * Add them before features are written; the list is not locked.
+     */
+    void   add_sink(std::unique_ptr<feature_sink> sink);
+    size_t sink_count() const { return sinks.size(); }
+    void   sinks_shutdown();
+
     /* File management */
 
     /* fname_in_outdir(suffix, count):
@@ -175,9 +174,10 @@ public:;
      * It must be threadsafe (either uses locks or goes to a DBMS)
      * Callers therefore do not need locks.
      * It is only implemented in the subclasses.
+     * The views are only valid for the duration of the call.
      */
-    virtual void write0(const std::string &str);
-    virtual void write0(const pos0_t &pos0,const std::string &feature,const std::string &context);
+    virtual void write0(std::string_view str);
+    virtual void write0(const pos0_t &pos0, std::string_view feature, std::string_view context);
 
     /* Methods used by scanners to write.
      * write() is the basic write - you say where, and it does it.
@@ -187,8 +187,9 @@ public:;
      *
      * higher-level write a feature and its context; the feature may be in the context, but doesn't need to be.
      * entries processed by write below will be processed by histogram system
+     * write() does not allocate unless the feature or context must be escaped (or a stop list or histogram needs a copy).
      */
-    virtual void write(const pos0_t &pos0,const std::string &feature,const std::string &context);
+    virtual void write(const pos0_t &pos0, std::string_view feature, std::string_view context);
 
     /* write_buf():
      * write a feature located at a given place within an sbuf.
@@ -229,19 +230,32 @@ public:;
     /*
      * Each feature_recorder can have multiple histograms. They are generated on-the-fly for the file-based feature-recorder,
      * and generated in SQL for the SQL-based feature-recorder.
+     *
+     * When memory runs low (or the histograms use more than feature_recorder_set::opt_histogram_memory),
+     * the largest histogram is spilled: its report is written to a run file and it starts again empty.
+     * histogram_flush_all() then merges the runs and what is still in memory into the histogram file.
+     * Runs are in report order and are read a line at a time, so the merge needs little memory.
      */
     std::vector<std::unique_ptr<AtomicUnicodeHistogram>> histograms {};
+    static const size_t HISTOGRAM_CHECK_INTERVAL = 65536; // features between checks of opt_histogram_memory
 
     /* These must be specialized */
     virtual void histogram_flush(AtomicUnicodeHistogram &h) = 0; // flush a specific histogram
-    virtual void histograms_add_feature(const std::string &feature); // propose a feature to all of the histograms
+    virtual void histograms_add_feature(std::string_view feature); // propose a feature to all of the histograms
 
     virtual size_t histogram_count() { return histograms.size();}     // how many histograms it has
+    virtual size_t histogram_bytes();           // memory used by all of the histograms
     virtual void histogram_add(const struct histogram_def &def); // add a new histogram
     virtual bool histogram_flush_largest();     // flushes largest histogram. returns false if no histogram could be flushed.
     virtual void histogram_flush_all(); // flushes all histograms
-    //virtual void histogram_merge(const struct histogram_def &def); // merge sort on this histogram
-    //virtual void histogram_merge_all();                            // merge sort on all histograms
+    virtual void histogram_generate(AtomicUnicodeHistogram &h); // writes h's histogram file; threadsafe for different h
+    virtual void histogram_merge(AtomicUnicodeHistogram &h); // merge the runs of h and the rest of h into its histogram file
+
+private:
+    std::mutex   Mhistogram_runs {};    // protects histogram_runs; held while spilling
+    std::map<const AtomicUnicodeHistogram *, std::vector<std::string>> histogram_runs {}; // run files of each histogram
+    std::atomic<size_t> histogram_adds {0};
+    void   histogram_spill(AtomicUnicodeHistogram &h); // requires Mhistogram_runs
 };
 
 #endif
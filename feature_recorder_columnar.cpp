@@ -0,0 +1,435 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * feature_recorder_columnar.cpp:
+ * The column-oriented feature store. See feature_recorder_columnar.h.
+ */
+
+#include "config.h"
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#define USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "feature_recorder_columnar.h"
+#include "feature_recorder_set.h"
+#include "feature_reader.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static const char     FILE_MAGIC[] = "BE13COL1";
+static const size_t   FILE_MAGIC_SIZE = 8;
+static const uint32_t BLOCK_MAGIC = 0x4C4F4342; // "BCOL"
+static const size_t   COLUMN_HEADER_SIZE = 12;
+static const size_t   BLOCK_HEADER_SIZE = 28 + COLUMN_HEADER_SIZE * feature_recorder_columnar::NUM_COLUMNS;
+static const uint8_t  CODEC_RAW  = 0;
+static const uint8_t  CODEC_ZSTD = 1;
+static const size_t   MIN_COMPRESS_SIZE = 64; // smaller columns are stored raw
+static const int      COMPRESSION_LEVEL = 3;
+
+static void put_le32(std::string &out, uint32_t v)
+{
+    char b[4] = { char(v), char(v>>8), char(v>>16), char(v>>24) };
+    out.append(b, 4);
+}
+
+static void put_le64(std::string &out, uint64_t v)
+{
+    put_le32(out, uint32_t(v));
+    put_le32(out, uint32_t(v>>32));
+}
+
+static uint32_t get_le32(const char *p)
+{
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    return uint32_t(u[0]) | uint32_t(u[1])<<8 | uint32_t(u[2])<<16 | uint32_t(u[3])<<24;
+}
+
+static uint64_t get_le64(const char *p)
+{
+    return uint64_t(get_le32(p)) | uint64_t(get_le32(p+4))<<32;
+}
+
+static void put_varint(std::string &out, uint64_t v)
+{
+    while (v >= 0x80) {
+        out.push_back(char(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(char(v));
+}
+
+static bool get_varint(const char *&p, const char *end, uint64_t &v)
+{
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        const uint8_t b = *p++;
+        v |= uint64_t(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+static void put_string(std::string &out, std::string_view s)
+{
+    put_varint(out, s.size());
+    out.append(s);
+}
+
+static uint64_t zigzag(int64_t v)   { return (uint64_t(v) << 1) ^ uint64_t(v >> 63); }
+static int64_t  unzigzag(uint64_t v) { return int64_t(v >> 1) ^ -int64_t(v & 1); }
+
+/****************************************************************
+ *** feature_recorder_columnar
+ ****************************************************************/
+
+feature_recorder_columnar::feature_recorder_columnar(class feature_recorder_set &fs_, const feature_recorder_def def):
+    feature_recorder(fs_, def), fname(fs_.get_outdir() + "/" + def.name + ".col")
+{
+    if (fs.flags.disabled) return;
+
+    /* Reopening: carry on the path ids and append after the last complete block */
+    path_image_offsets.push_back(0);    // id 0 is the empty path
+    try {
+        if (std::filesystem::exists(fname) && std::filesystem::file_size(fname) > 0) {
+            columnar_feature_reader r(fname);
+            for (size_t id=1; id < r.paths().size(); id++) {
+                path_ids[r.paths()[id]] = id;
+                path_image_offsets.push_back(pos0_t(r.paths()[id]).imageOffset());
+            }
+            std::filesystem::resize_file(fname, r.valid_end());
+        }
+        out = std::make_unique<block_writer>(fname, fs.flags.direct_io);
+        if (out->size() == 0) {
+            out->write(std::string_view(FILE_MAGIC, FILE_MAGIC_SIZE));
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "*** feature_recorder_columnar CANNOT OPEN FEATURE STORE FOR WRITING " << e.what() << "\n";
+        throw std::invalid_argument("cannot open feature store for writing");
+    }
+    block = std::make_unique<block_t>();
+    block->first_path_id = path_image_offsets.size();
+}
+
+feature_recorder_columnar::~feature_recorder_columnar()
+{
+    try {
+        shutdown();
+    } catch (const std::exception &e) {
+        std::cerr << "*** feature_recorder_columnar: " << fname << ": " << e.what() << "\n";
+    }
+}
+
+void feature_recorder_columnar::shutdown()
+{
+    std::unique_ptr<block_t> last;
+    {
+        const std::lock_guard<std::mutex> lock(Mblock);
+        if (block && block->rows > 0) {
+            last = std::move(block);
+            block = std::make_unique<block_t>();
+            block->first_path_id = path_image_offsets.size();
+        }
+    }
+    if (last) {
+        write_block(*last);
+    }
+    const std::lock_guard<std::mutex> lock(Mout);
+    if (out) {
+        out->flush();
+    }
+}
+
+/* Lines are only written directly for recorders that format their own; store them as features */
+void feature_recorder_columnar::write0(std::string_view str)
+{
+    if (str.empty() || str[0] == '#') return;
+    Feature f = Feature::parse(str);
+    write0(f.pos, f.feature, f.context);
+}
+
+void feature_recorder_columnar::write0(const pos0_t &pos0, std::string_view feature, std::string_view context)
+{
+    if (fs.flags.disabled) return;
+    if (fs.offset_add != 0) {
+        add_feature(pos0.shift(fs.offset_add), feature, context);
+    } else {
+        add_feature(pos0, feature, context);
+    }
+    feature_recorder::write0(pos0, feature, context); // call super
+}
+
+void feature_recorder_columnar::add_feature(const pos0_t &pos0, std::string_view feature, std::string_view context)
+{
+    if (flags.no_context) {
+        context = std::string_view();
+    }
+
+    std::unique_ptr<block_t> full;
+    {
+        const std::lock_guard<std::mutex> lock(Mblock);
+        uint32_t id = 0;
+        if (!pos0.path.empty()) {
+            auto it = path_ids.find(pos0.path);
+            if (it != path_ids.end()) {
+                id = it->second;
+            } else {
+                id = path_image_offsets.size();
+                path_ids[pos0.path] = id;
+                path_image_offsets.push_back(pos0.imageOffset());
+                put_string(block->columns[PATHS], pos0.path);
+            }
+        }
+        const uint64_t image_offset = (id == 0) ? pos0.offset : path_image_offsets[id];
+
+        put_varint(block->columns[OFFSETS], zigzag(int64_t(pos0.offset - block->last_offset)));
+        put_varint(block->columns[PATH_IDS], id);
+        put_string(block->columns[FEATURES], feature);
+        put_string(block->columns[CONTEXTS], context);
+        block->last_offset = pos0.offset;
+        block->min_offset  = std::min(block->min_offset, image_offset);
+        block->max_offset  = std::max(block->max_offset, image_offset);
+        block->rows++;
+
+        if (block->rows >= ROWS_PER_BLOCK || block->bytes() >= BLOCK_BYTES) {
+            full = std::move(block);
+            block = std::make_unique<block_t>();
+            block->first_path_id = path_image_offsets.size();
+        }
+    }
+    if (full) {
+        write_block(*full);             // compress without holding Mblock
+    }
+}
+
+void feature_recorder_columnar::write_block(block_t &b)
+{
+    std::string header;
+    header.reserve(BLOCK_HEADER_SIZE);
+    put_le32(header, BLOCK_MAGIC);
+    put_le32(header, b.rows);
+    put_le64(header, b.min_offset);
+    put_le64(header, b.max_offset);
+    put_le32(header, b.first_path_id);
+
+    std::string stored[NUM_COLUMNS];
+    for (int c=0; c<NUM_COLUMNS; c++) {
+        const std::string &raw = b.columns[c];
+        const uint32_t raw_size = raw.size();
+        uint8_t codec = CODEC_RAW;
+#ifdef USE_ZSTD
+        if (raw.size() >= MIN_COMPRESS_SIZE) {
+            stored[c].resize(ZSTD_compressBound(raw.size()));
+            const size_t r = ZSTD_compress(stored[c].data(), stored[c].size(), raw.data(), raw.size(), COMPRESSION_LEVEL);
+            if (!ZSTD_isError(r) && r < raw.size()) {
+                stored[c].resize(r);
+                codec = CODEC_ZSTD;
+            }
+        }
+#endif
+        if (codec == CODEC_RAW) {
+            stored[c].swap(b.columns[c]);
+        }
+        header.push_back(char(codec));
+        header.append(3, '\0');
+        put_le32(header, raw_size);
+        put_le32(header, stored[c].size());
+    }
+
+    const std::lock_guard<std::mutex> lock(Mout);
+    if (out) {
+        out->write(header);
+        for (int c=0; c<NUM_COLUMNS; c++) {
+            out->write(stored[c]);
+        }
+    }
+}
+
+void feature_recorder_columnar::histogram_flush(AtomicUnicodeHistogram &h)
+{
+    std::string hname = fname_in_outdir(h.def.suffix, NEXT_COUNT);
+    std::ofstream hfile(hname.c_str());
+    if (!hfile.is_open()) {
+        throw std::runtime_error("Cannot open feature histogram file " + hname);
+    }
+    hfile << h.makeReport(0);           // sorted and clear
+}
+
+/****************************************************************
+ *** columnar_feature_reader
+ ****************************************************************/
+
+static bool pread_fully(int fd, char *dst, size_t len, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = pread(fd, dst+done, len-done, offset+done);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        done += r;
+    }
+    return true;
+}
+
+columnar_feature_reader::columnar_feature_reader(const std::string &fname_):
+    fname(fname_)
+{
+    fd = ::open(fname.c_str(), O_RDONLY|O_BINARY);
+    if (fd < 0) {
+        throw ReadError(fname + ": " + strerror(errno));
+    }
+    try {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            throw ReadError(fname + ": " + strerror(errno));
+        }
+        const uint64_t fsize = st.st_size;
+        char magic[FILE_MAGIC_SIZE];
+        if (fsize < FILE_MAGIC_SIZE || !pread_fully(fd, magic, FILE_MAGIC_SIZE, 0) ||
+            memcmp(magic, FILE_MAGIC, FILE_MAGIC_SIZE) != 0) {
+            throw ReadError(fname + ": not a columnar feature store");
+        }
+
+        /* Walk the block headers. A block that runs past the end of the file was not finished. */
+        path_dict.push_back("");
+        uint64_t off = FILE_MAGIC_SIZE;
+        char h[BLOCK_HEADER_SIZE];
+        while (off + BLOCK_HEADER_SIZE <= fsize && pread_fully(fd, h, BLOCK_HEADER_SIZE, off)) {
+            if (get_le32(h) != BLOCK_MAGIC) break;
+            block_info b;
+            b.rows = get_le32(h+4);
+            b.min_offset = get_le64(h+8);
+            b.max_offset = get_le64(h+16);
+            const uint32_t first_path_id = get_le32(h+24);
+            uint64_t coff = off + BLOCK_HEADER_SIZE;
+            for (int c=0; c<feature_recorder_columnar::NUM_COLUMNS; c++) {
+                const char *ch = h + 28 + c*COLUMN_HEADER_SIZE;
+                b.columns[c] = {uint8_t(ch[0]), get_le32(ch+4), get_le32(ch+8), coff};
+                coff += b.columns[c].stored_size;
+            }
+            if (coff > fsize) break;
+            blocks.push_back(b);
+            off = coff;
+
+            /* Blocks may be written out of order, so a block's paths can come after blocks that use them */
+            std::string paths = read_column(blocks.size()-1, feature_recorder_columnar::PATHS);
+            const char *p = paths.data(), *e = p + paths.size();
+            for (uint32_t id = first_path_id; p < e; id++) {
+                uint64_t len = 0;
+                if (!get_varint(p, e, len) || len > uint64_t(e-p)) {
+                    throw ReadError(fname + ": corrupt path column");
+                }
+                if (path_dict.size() <= id) path_dict.resize(id+1);
+                path_dict[id].assign(p, len);
+                p += len;
+            }
+        }
+        end = off;
+    } catch (const ReadError &e) {
+        ::close(fd);
+        throw;
+    }
+}
+
+columnar_feature_reader::~columnar_feature_reader()
+{
+    ::close(fd);
+}
+
+std::vector<size_t> columnar_feature_reader::blocks_overlapping(uint64_t lo, uint64_t hi) const
+{
+    std::vector<size_t> ret;
+    for (size_t i=0; i<blocks.size(); i++) {
+        if (blocks[i].rows > 0 && blocks[i].max_offset >= lo && blocks[i].min_offset <= hi) {
+            ret.push_back(i);
+        }
+    }
+    return ret;
+}
+
+std::string columnar_feature_reader::read_column(size_t i, feature_recorder_columnar::column_t c)
+{
+    const column_info &ci = blocks.at(i).columns[c];
+    std::string stored(ci.stored_size, '\0');
+    if (!pread_fully(fd, stored.data(), stored.size(), ci.file_offset)) {
+        throw ReadError(fname + ": cannot read block " + std::to_string(i));
+    }
+    if (ci.codec == CODEC_RAW) {
+        return stored;
+    }
+#ifdef USE_ZSTD
+    if (ci.codec == CODEC_ZSTD) {
+        std::string raw(ci.raw_size, '\0');
+        const size_t r = ZSTD_decompress(raw.data(), raw.size(), stored.data(), stored.size());
+        if (ZSTD_isError(r) || r != raw.size()) {
+            throw ReadError(fname + ": cannot decompress block " + std::to_string(i));
+        }
+        return raw;
+    }
+#endif
+    throw ReadError(fname + ": unsupported compression in block " + std::to_string(i));
+}
+
+void columnar_feature_reader::read_offsets(size_t i, std::vector<uint64_t> &out)
+{
+    const std::string col = read_column(i, feature_recorder_columnar::OFFSETS);
+    const char *p = col.data(), *e = p + col.size();
+    out.clear();
+    out.reserve(blocks[i].rows);
+    uint64_t last = 0, v = 0;
+    while (p < e && get_varint(p, e, v)) {
+        last += unzigzag(v);
+        out.push_back(last);
+    }
+}
+
+void columnar_feature_reader::read_path_ids(size_t i, std::vector<uint32_t> &out)
+{
+    const std::string col = read_column(i, feature_recorder_columnar::PATH_IDS);
+    const char *p = col.data(), *e = p + col.size();
+    out.clear();
+    out.reserve(blocks[i].rows);
+    uint64_t v = 0;
+    while (p < e && get_varint(p, e, v)) {
+        out.push_back(v);
+    }
+}
+
+void columnar_feature_reader::read_strings(size_t i, feature_recorder_columnar::column_t c, std::vector<std::string> &out)
+{
+    const std::string col = read_column(i, c);
+    const char *p = col.data(), *e = p + col.size();
+    out.clear();
+    out.reserve(blocks[i].rows);
+    uint64_t len = 0;
+    while (p < e) {
+        if (!get_varint(p, e, len) || len > uint64_t(e-p)) {
+            throw ReadError(fname + ": corrupt string column in block " + std::to_string(i));
+        }
+        out.emplace_back(p, len);
+        p += len;
+    }
+}
+
+void columnar_feature_reader::read_features(size_t i, std::vector<std::string> &out)
+{
+    read_strings(i, feature_recorder_columnar::FEATURES, out);
+}
+
+void columnar_feature_reader::read_contexts(size_t i, std::vector<std::string> &out)
+{
+    read_strings(i, feature_recorder_columnar::CONTEXTS, out);
+}
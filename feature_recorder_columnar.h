@@ -0,0 +1,138 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef FEATURE_RECORDER_COLUMNAR_H
+#define FEATURE_RECORDER_COLUMNAR_H
+
+/**
+ * \file
+ * feature_recorder_columnar.h:
+ * A feature recorder that writes a binary, column-oriented feature store (<name>.col) instead of, or as well as,
+ * a tab-separated feature file (feature_recorder_set::flags_t::record_columnar).
+ *
+ * Features are collected into blocks of up to ROWS_PER_BLOCK rows. Each block holds five columns, each
+ * compressed separately with zstd (when it is available):
+ *   paths    - forensic paths first used in this block; a path's id is its position in the file's dictionary
+ *   offsets  - pos0.offset, as zigzag varint deltas
+ *   path_ids - varints; id 0 is the empty path
+ *   features - varint length + bytes
+ *   contexts - varint length + bytes
+ * Every block header records the lowest and highest image offset in the block, so readers can skip
+ * blocks that are outside the range they want, and can read the features without the contexts.
+ *
+ * File format (all numbers little-endian):
+ *   "BE13COL1"
+ *   blocks: u32 BLOCK_MAGIC, u32 rows, u64 min image offset, u64 max image offset, u32 first new path id,
+ *           then for each column: u8 codec, u8 pad[3], u32 raw size, u32 stored size;
+ *           then the columns.
+ *
+ * A file that is reopened is appended to, after the last complete block.
+ */
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "block_writer.h"
+#include "feature_recorder.h"
+#include "pos0.h"
+
+class feature_recorder_columnar : public feature_recorder {
+public:
+    static const size_t ROWS_PER_BLOCK = 65536;
+    static const size_t BLOCK_BYTES = 4*1024*1024; // feature and context bytes per block
+
+    enum column_t { PATHS=0, OFFSETS, PATH_IDS, FEATURES, CONTEXTS, NUM_COLUMNS };
+
+    feature_recorder_columnar(class feature_recorder_set &fs, const feature_recorder_def def);
+    virtual ~feature_recorder_columnar();
+
+    const std::string fname;
+
+    virtual void write0(std::string_view str) override;  // parses a feature file line
+    virtual void write0(const pos0_t &pos0, std::string_view feature, std::string_view context) override;
+    virtual void histogram_flush(AtomicUnicodeHistogram &h) override;
+    virtual void shutdown() override;
+
+private:
+    struct block_t {
+        uint32_t    rows {0};
+        uint64_t    min_offset {UINT64_MAX};
+        uint64_t    max_offset {0};
+        uint64_t    last_offset {0};     // for the delta encoding
+        uint32_t    first_path_id {0};
+        std::string columns[NUM_COLUMNS] {};
+        size_t      bytes() const { return columns[FEATURES].size() + columns[CONTEXTS].size(); }
+    };
+
+    std::mutex   Mblock {};              // protects block, path_ids and path_image_offsets
+    std::unique_ptr<block_t> block {};
+    std::unordered_map<std::string, uint32_t> path_ids {};
+    std::vector<uint64_t> path_image_offsets {}; // pos0_t::imageOffset() of each path, by id
+
+    std::mutex   Mout {};                // protects out
+    std::unique_ptr<block_writer> out {};
+
+    void   add_feature(const pos0_t &pos0, std::string_view feature, std::string_view context);
+    void   write_block(block_t &b);      // compresses the columns; takes Mout to write them
+};
+
+/* Reads a file written by feature_recorder_columnar, a column at a time */
+class columnar_feature_reader {
+    columnar_feature_reader(const columnar_feature_reader &)=delete;
+    columnar_feature_reader &operator=(const columnar_feature_reader &)=delete;
+
+public:
+    struct column_info {
+        uint8_t  codec;
+        uint32_t raw_size;
+        uint32_t stored_size;
+        uint64_t file_offset;
+    };
+    struct block_info {
+        uint32_t rows;
+        uint64_t min_offset;             // image offsets, for skipping blocks
+        uint64_t max_offset;
+        column_info columns[feature_recorder_columnar::NUM_COLUMNS];
+    };
+
+    class ReadError : public std::exception {
+        std::string m_error{};
+    public:
+        ReadError(std::string_view error):m_error(error){}
+        const char *what() const noexcept override {return m_error.c_str();}
+    };
+
+    /* Opens fname and reads the block headers and the path dictionary */
+    columnar_feature_reader(const std::string &fname);
+    virtual ~columnar_feature_reader();
+
+    size_t   block_count() const { return blocks.size(); }
+    const block_info &block(size_t i) const { return blocks.at(i); }
+    uint64_t valid_end() const { return end; } // end of the last complete block
+    const std::vector<std::string> &paths() const { return path_dict; }
+    std::vector<size_t> blocks_overlapping(uint64_t lo, uint64_t hi) const; // blocks with image offsets in [lo,hi]
+
+    /* Decode one column of block i; the others are not read */
+    void read_offsets(size_t i, std::vector<uint64_t> &out);
+    void read_path_ids(size_t i, std::vector<uint32_t> &out);
+    void read_features(size_t i, std::vector<std::string> &out);
+    void read_contexts(size_t i, std::vector<std::string> &out);
+    pos0_t pos0(uint32_t path_id, uint64_t offset) const { return pos0_t(path_dict.at(path_id), offset); }
+
+private:
+    const std::string fname;
+    int      fd {-1};
+    uint64_t end {0};
+    std::vector<block_info> blocks {};
+    std::vector<std::string> path_dict {};
+
+    std::string read_column(size_t i, feature_recorder_columnar::column_t c);
+    void   read_strings(size_t i, feature_recorder_columnar::column_t c, std::vector<std::string> &out);
+};
+
+#endif
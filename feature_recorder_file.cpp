@@ -7,10 +7,14 @@
 #include <sys/stat.h>
 
 #include <cstdarg>
+#include <filesystem>
 #include <regex>
+#include <unordered_map>
 
 #include "feature_recorder_file.h"
+#include "zstd_seekable.h"
 #include "feature_recorder_set.h"
+#include "async_feature_writer.h"
 #include "word_and_context_list.h"
 #include "unicode_escape.h"
 #include "utils.h"
@@ -27,6 +31,8 @@
 #define DEBUG_PEDANTIC    0x0001// check values more rigorously
 #endif
 
+static std::atomic<uint64_t> next_fr_id {1};
+
 
 /**
  * Create a feature recorder object. Each recorder records a certain
@@ -46,7 +52,7 @@
  */
 //TODO - make it register itself with the feature recorder set. and do the stuff that's in init.
 feature_recorder_file::feature_recorder_file(class feature_recorder_set &fs_, const feature_recorder_def def):
-    feature_recorder(fs_, def)
+    feature_recorder(fs_, def), fr_id(next_fr_id++)
 {
     /* If the feature recorder set is disabled, just return. */
     if ( fs.flags.disabled ) return;
@@ -57,46 +63,44 @@ feature_recorder_file::feature_recorder_file(class feature_recorder_set &fs_, co
     //if ( fs.flag_set(feature_recorder_set::DISABLE_FILE_RECORDERS)) return;
 
     /* Open the file recorder for output.
-     * If the file exists, seek to the end and find the last complete line, and start there.
+     * If the file exists, find the last complete line, and start there.
      */
     const std::lock_guard<std::mutex> lock(Mios);
     std::string fname = fname_in_outdir("",NO_COUNT);
-    ios.open( fname.c_str(), std::ios_base::in|std::ios_base::out|std::ios_base::ate);
-    if ( ios.is_open()){                  // opened existing file
-        ios.seekg(0L,std::ios_base::end);
-        while ( ios.is_open() ) {
-            /* Get current position.
-             * If we are at the beginning, just return.
-             */
-            if (int(ios.tellg())==0 ) {
-                ios.seekp(0L,std::ios_base::beg);
-                return;
-            }
-            /* backup one character and see if the next character is a newline */
-            ios.seekg(-1,std::ios_base::cur); // backup to once less than the end of the file
-            if (ios.peek()=='\n'){           // we are finally on the \n
-                ios.seekg(1L,std::ios_base::cur); // move the getting one forward
-                ios.seekp(ios.tellg(),std::ios_base::beg); // put the putter at the getter location
-                //count_ = 1;                            // greater than zero
-                return;
+    try {
+        if (fs.flags.compress_output && zstd_block_writer::available()) {
+            out = std::make_unique<zstd_block_writer>(fname + ".zst");
+        } else {
+            if (fs.flags.compress_output) {
+                static std::once_flag warned;
+                std::call_once(warned, [](){
+                    std::cerr << "*** zstd compression was not compiled in; feature files will not be compressed\n";
+                });
             }
+            out = std::make_unique<block_writer>(fname, fs.flags.direct_io);
         }
-    }
-    /* Just open the stream for output */
-    ios.open(fname.c_str(),std::ios_base::out);
-    if (!ios.is_open()){
+        out->resume_after_last_newline();
+    } catch (const block_writer::WriteError &e) {
         std::cerr << "*** feature_recorder_file::open CANNOT OPEN FEATURE FILE FOR WRITING "
-                  << fname << ":" << strerror(errno) << "\n";
+                  << e.what() << "\n";
         throw std::invalid_argument("cannot open feature file for writing");
     }
 }
 
-/* Exiting: make sure that the stream is closed.
+/* Exiting: make sure that the file is closed.
  */
 feature_recorder_file::~feature_recorder_file()
 {
-    if (ios.is_open()){
-        ios.close();
+    out.reset();
+}
+
+/* If there is no banner, add it */
+void feature_recorder_file::stamp_banner_if_empty()
+{
+    if (out->size()==0){
+        std::stringstream ss;
+        banner_stamp(ss, feature_file_header);
+        out->write(ss.str());
     }
 }
 
@@ -145,7 +149,72 @@ const std::string feature_recorder_file::bulk_extractor_version_header("# " PACK
 
 void feature_recorder_file::shutdown()
 {
-    ios.flush();
+    if (fs.get_async_writer()) {
+        fs.get_async_writer()->flush();
+    }
+    merge_shards();
+    const std::lock_guard<std::mutex> lock(Mios);
+    if (out) {
+        out->flush();
+    }
+}
+
+void feature_recorder_file::write_lines(std::string_view lines)
+{
+    const std::lock_guard<std::mutex> lock(Mios);
+    if (out) {
+        stamp_banner_if_empty();
+        out->write(lines);
+    }
+}
+
+/* Each thread keeps a map from recorder to its shard, so finding the shard takes no lock.
+ * Recorder ids are never reused, so entries for recorders that have been deleted are never looked up.
+ */
+feature_recorder_file::shard_t &feature_recorder_file::get_shard()
+{
+    static thread_local std::unordered_map<uint64_t, shard_t *> cache;
+    shard_t *&shard = cache[fr_id];
+    if (shard == nullptr) {
+        const std::lock_guard<std::mutex> lock(Mshards);
+        shards.push_back(std::make_unique<shard_t>());
+        shard = shards.back().get();
+    }
+    if (!shard->os.is_open()) {
+        shard->fname = fname_in_outdir("shard", NEXT_COUNT);
+        shard->os.rdbuf()->pubsetbuf(shard->buf.data(), shard->buf.size());
+        shard->os.open(shard->fname.c_str(), std::ios_base::out|std::ios_base::trunc|std::ios_base::binary);
+        if (!shard->os.is_open()) {
+            throw std::invalid_argument("cannot open feature file shard " + shard->fname);
+        }
+    }
+    return *shard;
+}
+
+/* Append every shard to the feature file and remove it.
+ * Called at shutdown, when no thread is writing.
+ */
+void feature_recorder_file::merge_shards()
+{
+    const std::lock_guard<std::mutex> lock(Mios);
+    const std::lock_guard<std::mutex> slock(Mshards);
+    for (auto &shard: shards) {
+        if (!shard->os.is_open()) continue;
+        shard->os.close();
+        if (shard->os.fail()) {
+            throw std::runtime_error("Disk full. Free up space and re-restart.");
+        }
+        std::ifstream in(shard->fname.c_str(), std::ios_base::in|std::ios_base::binary);
+        if (in.is_open() && in.peek() != std::ifstream::traits_type::eof() && out) {
+            stamp_banner_if_empty();
+            /* The shard's stream buffer is free now; copy through it */
+            while (in.read(shard->buf.data(), shard->buf.size()) || in.gcount() > 0) {
+                out->write(std::string_view(shard->buf.data(), in.gcount()));
+            }
+        }
+        in.close();
+        std::filesystem::remove(shard->fname);
+    }
 }
 
 #if 0
@@ -224,7 +293,7 @@ size_t feature_recorder_file::count_histograms() const
  * this is the only place where writing happens.
  * so it's an easy place to do utf-8 validation in debug mode.
  */
-void feature_recorder_file::write0(const std::string &str)
+void feature_recorder_file::write0(std::string_view str)
 {
     if (fs.flags.pedantic && (utf8::find_invalid(str.begin(),str.end()) != str.end())) {
         std::cerr << "******************************************\n";
@@ -238,18 +307,31 @@ void feature_recorder_file::write0(const std::string &str)
         return;
     }
 
-    const std::lock_guard<std::mutex> lock(Mios);
-    if(ios.is_open()){
-        /* If there is no banner, add it */
-        if (ios.tellg()==0){
-            banner_stamp(ios, feature_file_header);
+    /* In sharded mode, write to this thread's shard without locking */
+    if (fs.flags.sharded_output) {
+        shard_t &shard = get_shard();
+        shard.os << str << '\n';
+        if (shard.os.fail()){
+            throw std::runtime_error("Disk full. Free up space and re-restart.");
         }
+        feature_recorder::write0(str);  // call super class
+        return;
+    }
+
+    /* In asynchronous mode, hand the line to the writer thread */
+    if (fs.get_async_writer()) {
+        fs.get_async_writer()->push(this, str);
+        feature_recorder::write0(str);  // call super class
+        return;
+    }
+
+    const std::lock_guard<std::mutex> lock(Mios);
+    if (out) {
+        stamp_banner_if_empty();
 
         /* Output the feature */
-        ios << str << '\n';
-        if (ios.fail()){
-            throw std::runtime_error("Disk full. Free up space and re-restart.");
-        }
+        out->write(str);
+        out->write("\n");
         feature_recorder::write0(str);  // call super class
     }
 }
@@ -265,18 +347,27 @@ void feature_recorder_file::write0(const std::string &str)
  * Interlocking is done in write().
  */
 
-void feature_recorder_file::write0(const pos0_t &pos0, const std::string &feature, const std::string &context)
+void feature_recorder_file::write0(const pos0_t &pos0, std::string_view feature, std::string_view context)
 {
     if ( fs.flags.disabled ) {
         return;
     }
-    std::stringstream ss;
-    ss << pos0.shift( fs.offset_add).str() << '\t' << feature;
+    /* The line is formatted in a buffer that is reused by every write on this thread */
+    thread_local std::string line;
+    line.clear();
+    if (fs.offset_add==0) {
+        pos0.append_str(line);
+    } else {
+        pos0.shift( fs.offset_add).append_str(line);
+    }
+    line += '\t';
+    line += feature;
     if ((flags.no_context == false) && ( context.size()>0 )) {
-        ss << '\t' << context;
+        line += '\t';
+        line += context;
     }
     feature_recorder::write0(pos0, feature, context); // call super
-    write0( ss.str() );                               // and do the actual write
+    write0( line );                                   // and do the actual write
 }
 
 
@@ -339,11 +430,8 @@ static void dump_hist(sqlite3_context *ctx,int argc,sqlite3_value**argv)
 void feature_recorder_file::histogram_flush(AtomicUnicodeHistogram &h)
 {
     /* Get the next filename */
-    std::cerr << "histogram_flush2 \n";
     std::string fname = fname_in_outdir(h.def.suffix, NEXT_COUNT);
-    std::cerr << "histogram_flush3 to " << fname << "\n";
     std::fstream hfile;
-    std::cerr << "feature_recorder_file::histogram_flush: writing histogram " << h.def << " to " << fname << "\n";
     hfile.open( fname.c_str(), std::ios_base::out);
     if (!hfile.is_open()){
         throw std::runtime_error("Cannot open feature histogram file "+fname);
@@ -12,7 +12,11 @@
 #include <iostream>
 #include <fstream>
 #include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
 
+#include "block_writer.h"
 #include "feature_recorder.h"
 #include "pos0.h"
 #include "sbuf.h"
@@ -25,7 +29,30 @@ public:;
 private:
     //std::string  fname {};              // feature filename
     std::mutex   Mios {};               // mutex for IOS
-    std::fstream ios {};                // where features are written
+    std::unique_ptr<block_writer> out {}; // where features are written
+    void   stamp_banner_if_empty();     // requires Mios
+
+    /* Sharded output (feature_recorder_set::flags_t::sharded_output):
+     * each thread appends to its own shard file without taking Mios.
+     * The shards are appended to the feature file and removed when the recorder shuts down.
+     */
+    static const size_t SHARD_BUFSIZE = 1024*1024;
+    struct shard_t {
+        std::string       fname {};
+        std::ofstream     os {};
+        std::vector<char> buf = std::vector<char>(SHARD_BUFSIZE);
+    };
+    const uint64_t fr_id;               // tells this recorder apart from others in the thread-local cache
+    std::mutex   Mshards {};            // protects shards
+    std::vector<std::unique_ptr<shard_t>> shards {}; // never shrinks, so threads may cache pointers to them
+    shard_t &get_shard();               // this thread's shard, opened if necessary
+    void   merge_shards();
+
+    /* Asynchronous output (feature_recorder_set::flags_t::async_output): the writer thread calls write_lines()
+     * with many newline-terminated lines at once.
+     */
+    friend class async_feature_writer;
+    void   write_lines(std::string_view lines);
 
     void   banner_stamp(std::ostream &os,const std::string &header) const; // stamp banner, and header
 
@@ -47,8 +74,8 @@ public:
      * Cannot be made inline becuase it accesses fs.
      */
     //virtual const std::string hash(const unsigned char *buf, size_t bufflen); // hash a block with the hasher
-    virtual void write0(const std::string &str) override;
-    virtual void write0(const pos0_t &pos0, const std::string &feature, const std::string &context) override;
+    virtual void write0(std::string_view str) override;
+    virtual void write0(const pos0_t &pos0, std::string_view feature, std::string_view context) override;
 
     /* feature file management */
     //virtual void open();
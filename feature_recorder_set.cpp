@@ -2,10 +2,20 @@
 
 #include "config.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdarg>
+#include <cstring>
+#include <thread>
+
 #include "scanner_config.h"
 #include "feature_recorder_set.h"
+#include "sbuf_profile.h"
+#include "feature_recorder_columnar.h"
 #include "feature_recorder_file.h"
 #include "feature_recorder_sql.h"
+#include "feature_sink.h"
 
 #include "dfxml/src/dfxml_writer.h"
 #include "dfxml/src/hash_t.h"
@@ -85,6 +95,16 @@ feature_recorder_set::feature_recorder_set( const flags_t &flags_,
     }
 #endif
 
+    if (flags.async_output && !flags.sharded_output && !flags.disabled) {
+        async_writer = std::make_unique<async_feature_writer>();
+    }
+
+#if defined(HAVE_SQLITE3_H) and defined(HAVE_LIBSQLITE3)
+    if (flags.record_sql && !flags.disabled) {
+        db_create();                    // before any feature_recorder_sql, including the alert recorder
+    }
+#endif
+
     /* Create an alert recorder if necessary */
     if (!flags.no_alert) {
         create_feature_recorder(feature_recorder_def(feature_recorder_set::ALERT_RECORDER_NAME,0)); // make the alert recorder
@@ -92,14 +112,6 @@ feature_recorder_set::feature_recorder_set( const flags_t &flags_,
 
     //message_enabled_scanners(scanner_params::PHASE_INIT); // tell all enabled scanners to init
 
-#if 0
-#if defined(HAVE_SQLITE3_H) and defined(HAVE_LIBSQLITE3)
-    if (flag_set(ENABLE_SQLITE3_RECORDERS)) {
-        db_create();
-    }
-#endif
-#endif
-
 #if 0
     /* Create the requested feature files */
     for( auto it:feature_files){
@@ -114,11 +126,10 @@ feature_recorder_set::feature_recorder_set( const flags_t &flags_,
  */
 feature_recorder_set::~feature_recorder_set()
 {
+    async_writer.reset();               // finish writing before the feature recorders go away
     frm.delete_all();
-#if 0
 #if defined(HAVE_SQLITE3_H) and defined(HAVE_LIBSQLITE3)
-    db_close();
-#endif
+    db_close();                         // the feature_recorder_sql destructors have flushed their rows
 #endif
 }
 
@@ -142,25 +153,36 @@ feature_recorder_set::~feature_recorder_set()
 
 void feature_recorder_set::create_feature_recorder(const feature_recorder_def def)
 {
-    if (flags.record_files and flags.record_sql){
-        throw std::runtime_error("currently can only record to files or SQL, not both");
-    }
-    if (!flags.record_files and !flags.record_sql){
-        throw std::runtime_error("Must record to either files or SQL");
+    if (!flags.record_files and !flags.record_sql and !flags.record_columnar){
+        throw std::runtime_error("Must record to files, SQL or columnar");
     }
     auto it = frm.find(def.name);
     if ( it != frm.end() ) {
         throw FeatureRecorderAlreadyExists {std::string("feature recorder already exists: ")+def.name};
     }
 
-    feature_recorder *fr = nullptr;
+    /* Make a recorder for each output. The first one is returned by named_feature_recorder();
+     * the others are its sinks, and get each feature after it has been checked and quoted.
+     * SQL comes last, because the first also writes the histograms and SQL does not.
+     */
+    std::vector<std::unique_ptr<feature_recorder>> outputs;
     if (flags.record_files) {
-        fr = new feature_recorder_file(*this, def);
+        outputs.push_back(std::make_unique<feature_recorder_file>(*this, def));
+    }
+    if (flags.record_columnar) {
+        outputs.push_back(std::make_unique<feature_recorder_columnar>(*this, def));
     }
     if (flags.record_sql) {
-        fr = new feature_recorder_sql(*this, def);
+#if defined(HAVE_SQLITE3_H) and defined(HAVE_LIBSQLITE3)
+        outputs.push_back(std::make_unique<feature_recorder_sql>(*this, def));
+#else
+        throw std::runtime_error("SQL recording requested but SQLite3 is not available");
+#endif
+    }
+    for (size_t i=1; i<outputs.size(); i++) {
+        outputs[0]->add_sink(std::make_unique<recorder_sink>(std::move(outputs[i])));
     }
-    frm.insert(def.name, fr);
+    frm.insert(def.name, outputs[0].release());
 }
 
 /*
@@ -193,6 +215,7 @@ void feature_recorder_set::feature_recorders_shutdown()
 {
     for(auto const &it : frm){
         it.second->shutdown();
+        it.second->sinks_shutdown();
     }
 }
 
@@ -208,8 +231,26 @@ void feature_recorder_set::feature_recorders_shutdown()
  */
 bool feature_recorder_set::check_previously_processed(const sbuf_t &sbuf)
 {
-    std::string sha1 = dfxml::sha1_generator::hash_buf(sbuf.buf,sbuf.bufsize).hexdigest();
-    return seen_set.check_for_presence_and_insert(sha1);
+    /* The digest is computed once per sbuf and shared with the scanner_set.
+     * If the sbuf was already profiled with another algorithm, hash it again with ours so the set stays consistent.
+     */
+    const sbuf_profile &prof = sbuf.profile(dedup_digest_alg());
+    digest128_t key = prof.key;
+    if (prof.alg != dedup_digest_alg()) {
+        key = sbuf_profile(sbuf, dedup_digest_alg()).key;
+    }
+    if (seen_set.check_for_presence_and_insert(key)) {
+        return true;
+    }
+    if (persistent_seen) {
+        return persistent_seen->check_for_presence_and_insert(key);
+    }
+    return false;
+}
+
+void feature_recorder_set::open_digest_store(const std::string &fname)
+{
+    persistent_seen = std::make_unique<digest_store>(fname, static_cast<uint32_t>(dedup_digest_alg()));
 }
 
 /****************************************************************
@@ -225,6 +266,8 @@ void feature_recorder_set::dump_name_count_stats(dfxml_writer *writer) const
             writer->push("feature_file");
             writer->xmlout("name",ij.second->name);
             writer->xmlout("count",ij.second->features_written);
+            writer->xmlout("distinct_estimate",static_cast<int64_t>(ij.second->sketch.distinct()));
+            writer->xmlout("max_count_estimate",static_cast<int64_t>(ij.second->sketch.max_count()));
             writer->pop();
             writer->set_oneline(false);
         }
@@ -263,13 +306,82 @@ size_t feature_recorder_set::histogram_count() const
 }
 
 
+/**
+ * Spill histograms to disk until all of them together fit in opt_histogram_memory,
+ * the largest first. Called by the feature recorders every so often; if another thread is
+ * already spilling, there is no need to wait for it.
+ * Other threads keep counting, so no more spills are made than there are histograms.
+ */
+void feature_recorder_set::histograms_check_memory()
+{
+    std::unique_lock<std::mutex> lock(Mhistogram_memory, std::try_to_lock);
+    if (!lock.owns_lock()) return;
+    for (size_t spills = histogram_count(); spills > 0; spills--) {
+        size_t total = 0;
+        size_t largest_bytes = 0;
+        feature_recorder *largest = nullptr;
+        for (auto const &it : frm) {
+            const size_t bytes = it.second->histogram_bytes();
+            total += bytes;
+            if (bytes > largest_bytes) {
+                largest = it.second;
+                largest_bytes = bytes;
+            }
+        }
+        if (total <= opt_histogram_memory || largest == nullptr || !largest->histogram_flush_largest()) {
+            return;
+        }
+    }
+}
+
+
 /**
  * Have every feature recorder generate all of its histograms.
  */
-void feature_recorder_set::histograms_generate()
+/* The histograms of every recorder are handed out to the threads from a counter, largest first,
+ * so that the largest do not start last. Each histogram may sort its report with its share of the threads.
+ */
+void feature_recorder_set::histograms_generate(unsigned int threads)
 {
+    if (threads == 0) {
+        threads = std::max(1U, std::thread::hardware_concurrency());
+    }
+    std::vector<std::pair<size_t, std::pair<feature_recorder *, AtomicUnicodeHistogram *>>> work;
     for (auto it : frm ){
-        it.second->histogram_flush_all();
+        for (auto &h: it.second->histograms) {
+            work.push_back({h->size(), {it.second, h.get()}});
+        }
+    }
+    std::sort(work.begin(), work.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+
+    const size_t workers = std::max(size_t(1), std::min(size_t(threads), work.size()));
+    const unsigned int sort_threads = std::max(size_t(1), threads / workers);
+
+    std::atomic<size_t> next {0};
+    std::mutex          Merror;
+    std::exception_ptr  error {};
+    auto worker = [&]() {
+        try {
+            for (size_t i; (i = next++) < work.size(); ) {
+                work[i].second.second->set_sort_threads(sort_threads);
+                work[i].second.first->histogram_generate(*work[i].second.second);
+            }
+        } catch (...) {
+            const std::lock_guard<std::mutex> lock(Merror);
+            if (!error) error = std::current_exception();
+            next = work.size();         // stop the others
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i=1; i < workers; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto &th: pool) {
+        th.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
     }
 }
 
@@ -284,8 +396,7 @@ std::vector<std::string> feature_recorder_set::get_feature_file_list()
 }
 
 
-#if 0
-//#if defined(HAVE_SQLITE3_H) and defined(HAVE_LIBSQLITE3)
+#if defined(HAVE_SQLITE3_H) and defined(HAVE_LIBSQLITE3)
 
 /*** SQL Support ***/
 
@@ -296,8 +407,9 @@ std::vector<std::string> feature_recorder_set::get_feature_file_list()
  * "PRAGMA synchronous =  OFF", - 146 second
  * "PRAGMA synchronous =  OFF", "PRAGMA journal_mode=MEMORY", - 79 seconds
  *
- * Time with domexusers:
- * no SQL -
+ * Rows are now inserted in large transactions (see COMMIT_ROWS) with a write-ahead log, which is about as
+ * fast as synchronous=OFF without risking a corrupt database if the program is killed.
+ * The indexes are built once the tables are full, which is much faster than updating them on every insert.
  */
 
 
@@ -306,11 +418,9 @@ std::vector<std::string> feature_recorder_set::get_feature_file_list()
 #define SQLITE_DETERMINISTIC 0
 #endif
 
-static int debug  = 0;
-
 static const char *schema_db[] = {
-    "PRAGMA synchronous =  OFF",
-    "PRAGMA journal_mode=MEMORY",
+    "PRAGMA journal_mode=WAL",
+    "PRAGMA synchronous = NORMAL",
     //"PRAGMA temp_store=MEMORY",  // did not improve performance
     "PRAGMA cache_size = 200000",
     "CREATE TABLE IF NOT EXISTS db_info (schema_ver INTEGER, bulk_extractor_ver INTEGER)",
@@ -322,14 +432,19 @@ static const char *schema_db[] = {
 /* Create a feature table and note that it has been created in be_features */
 static const char *schema_tbl[] = {
     "CREATE TABLE IF NOT EXISTS f_%s (offset INTEGER(12), path VARCHAR, feature_eutf8 TEXT, feature_utf8 TEXT, context_eutf8 TEXT)",
+    "INSERT INTO be_features (tablename,comment) VALUES ('f_%s','')",
+    0};
+
+/* Index a feature table once it is complete */
+static const char *schema_idx[] = {
     "CREATE INDEX IF NOT EXISTS f_%s_idx1 ON f_%s(offset)",
     "CREATE INDEX IF NOT EXISTS f_%s_idx2 ON f_%s(feature_eutf8)",
     "CREATE INDEX IF NOT EXISTS f_%s_idx3 ON f_%s(feature_utf8)",
-    "INSERT INTO be_features (tablename,comment) VALUES ('f_%s','')",
     0};
 
 static const char *begin_transaction[] = {"BEGIN TRANSACTION",0};
 static const char *commit_transaction[] = {"COMMIT TRANSACTION",0};
+
 void feature_recorder_set::db_send_sql(sqlite3 *db,const char **stmts, ...)
 {
     assert(db!=0);
@@ -341,35 +456,44 @@ void feature_recorder_set::db_send_sql(sqlite3 *db,const char **stmts, ...)
         va_start(ap,stmts);
         vsnprintf(buf,sizeof(buf),stmts[i],ap);
         va_end(ap);
-        if(debug) std::cerr << "SQL: " << buf << "\n";
+        if (flags.debug) std::cerr << "SQL: " << buf << "\n";
         // Don't error on a PRAGMA
-        if((sqlite3_exec(db,buf,NULL,NULL,&errmsg) != SQLITE_OK)  && (strncmp(buf,"PRAGMA",6)!=0)) {
-            fprintf(stderr,"Error executing '%s' : %s\n",buf,errmsg);
-            exit(1);
+        if ((sqlite3_exec(db,buf,NULL,NULL,&errmsg) != SQLITE_OK)  && (strncmp(buf,"PRAGMA",6)!=0)) {
+            std::string error = std::string("Error executing '") + buf + "' : " + (errmsg ? errmsg : "");
+            sqlite3_free(errmsg);
+            throw std::runtime_error(error);
         }
+        sqlite3_free(errmsg);
     }
 }
 
 void feature_recorder_set::db_create_table(const std::string &name)
 {
-    std::cerr << "db_create_table\n";
     assert(name.size()>0);
     assert(db3!=NULL);
     db_send_sql(db3,schema_tbl,name.c_str(),name.c_str());
 }
 
+void feature_recorder_set::db_create_indexes(const std::string &name)
+{
+    assert(name.size()>0);
+    assert(db3!=NULL);
+    db_send_sql(db3,schema_idx,name.c_str(),name.c_str());
+}
+
+/* Mdb serialises all use of the handle, so SQLite's own mutexes are not needed */
 sqlite3 *feature_recorder_set::db_create_empty(const std::string &name)
 {
     assert(name.size()>0);
     std::string dbfname  = outdir + "/" + name +  SQLITE_EXTENSION;
-    if(debug) std::cerr << "create_feature_database " << dbfname << "\n";
+    if (flags.debug) std::cerr << "create_feature_database " << dbfname << "\n";
     sqlite3 *db=0;
     if (sqlite3_open_v2(dbfname.c_str(), &db,
-                        SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE|SQLITE_OPEN_FULLMUTEX,
+                        SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE|SQLITE_OPEN_NOMUTEX,
                         0)!=SQLITE_OK) {
-        std::cerr << "Cannot create database '" << dbfname << "': " << sqlite3_errmsg(db) << "\n";
+        std::string error = "Cannot create database '" + dbfname + "': " + sqlite3_errmsg(db);
         sqlite3_close(db);
-        exit(1);
+        throw std::runtime_error(error);
     }
     return db;
 }
@@ -377,15 +501,20 @@ sqlite3 *feature_recorder_set::db_create_empty(const std::string &name)
 void feature_recorder_set::db_create()
 {
     assert(db3==0);
+    const std::lock_guard<std::mutex> lock(Mdb);
     db3 = db_create_empty("report");
     db_send_sql(db3,schema_db);
-    std::cout << "in db_create called\n";
 }
 
 void feature_recorder_set::db_close()
 {
-    if(db3){
-        if(debug) std::cerr << "db_close()\n";
+    const std::lock_guard<std::mutex> lock(Mdb);
+    if (db3) {
+        if (flags.debug) std::cerr << "db_close()\n";
+        if (in_transaction) {
+            db_send_sql(db3,commit_transaction);
+            in_transaction = false;
+        }
         sqlite3_close(db3);
         db3 = 0;
     }
@@ -393,21 +522,28 @@ void feature_recorder_set::db_close()
 
 void feature_recorder_set::db_transaction_begin()
 {
-    const std::lock_guard<std::mutex> lock(Min_transaction);
-    if(!in_transaction){
+    if (!in_transaction) {
         db_send_sql(db3,begin_transaction);
         in_transaction = true;
+        transaction_rows = 0;
+        transaction_started = std::chrono::steady_clock::now();
     }
 }
 
 void feature_recorder_set::db_transaction_commit()
 {
-    const std::lock_guard<std::mutex> lock(Min_transaction);
-    if(in_transaction){
+    if (in_transaction) {
         db_send_sql(db3,commit_transaction);
         in_transaction = false;
-    } else {
-        std::cerr << "No transaction to commit\n";
+    }
+}
+
+void feature_recorder_set::db_transaction_rows(size_t rows)
+{
+    transaction_rows += rows;
+    if (transaction_rows >= COMMIT_ROWS ||
+        std::chrono::steady_clock::now() - transaction_started >= std::chrono::seconds(COMMIT_SECONDS)) {
+        db_transaction_commit();
     }
 }
 
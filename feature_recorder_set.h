@@ -2,7 +2,10 @@
 #ifndef FEATURE_RECORDER_SET_H
 #define FEATURE_RECORDER_SET_H
 
+#include <chrono>
 #include <exception>
+#include <memory>
+#include <mutex>
 
 #if defined(HAVE_SQLITE3_H)
 #include <sqlite3.h>
@@ -12,6 +15,9 @@
 #include "feature_recorder.h"
 #include "atomic_set.h"
 #include "atomic_map.h"
+#include "atomic_digest_set.h"
+#include "digest_store.h"
+#include "async_feature_writer.h"
 
 /** \addtogroup internal_interfaces
  * @{
@@ -48,12 +54,15 @@ private:
     feature_recorder_set &operator=(const feature_recorder_set &fs)=delete;
 
     friend class feature_recorder;
+    friend class feature_recorder_sql;
 
     const std::string     input_fname {}; // input file; copy for convenience.
     const std::string     outdir {};      // where output goes; must know.
 
 
-    atomic_set<std::string> seen_set {};       // hex hash values of pages that have been seen
+    atomic_digest_set     seen_set {};       // 128-bit digests of pages that have been seen
+    std::unique_ptr<digest_store> persistent_seen {}; // digests of pages seen by this and previous runs, if enabled
+    std::unique_ptr<async_feature_writer> async_writer {}; // writes the feature files if flags.async_output
     size_t   context_window_default {16};           // global option
 
 
@@ -61,9 +70,17 @@ private:
     feature_recorder_map_t frm {};
 
     feature_recorder      *stop_list_recorder {nullptr}; // where stopped features get written (if there is one)
+    std::mutex            Mhistogram_memory {}; // held by the thread that is spilling histograms
 #if defined(HAVE_SQLITE3_H) and defined(HAVE_LIBSQLITE3)
-    /* If we are compiled with SQLite3, this is the handle to the open database */
+    /* If we are compiled with SQLite3, this is the handle to the open database (flags.record_sql).
+     * It is opened without SQLite's own locking; Mdb serialises everything that uses it,
+     * including the feature_recorder_sql statements.
+     */
     sqlite3               *db3 {};
+    std::mutex            Mdb {};
+    bool                  in_transaction {false};          // protected by Mdb
+    size_t                transaction_rows {0};            // rows inserted in this transaction
+    std::chrono::steady_clock::time_point transaction_started {};
 #endif
 
 public:
@@ -78,8 +95,14 @@ public:
         bool only_alert {false};  //  always return the alert recorder
         bool create_stop_list_recorders {false}; // static const uint32_t CREATE_STOP_LIST_RECORDERS= 0x04;  //
         bool debug {false};             // enable debug printing
-        bool record_files {true};       // record to files
+        bool record_files {true};       // record to files; any of these outputs may be combined
         bool record_sql {false};        // record to SQL
+        bool record_columnar {false};   // record to a binary column store (<name>.col)
+        bool dedup_fast_hash {false};   // find duplicate sbufs with MurmurHash3 instead of SHA1
+        bool sharded_output {false};    // each thread writes its own shard of each feature file; merged at shutdown
+        bool async_output {false};      // a writer thread writes the feature files; ignored if sharded_output
+        bool direct_io {false};         // write feature files with O_DIRECT where the filesystem allows it
+        bool compress_output {false};   // write feature files as seekable zstd (.txt.zst) if zstd is available
     } flags;
 
     /** Constructor:
@@ -99,6 +122,7 @@ public:
     /* File management */
     std::string   get_input_fname()           const { return input_fname;}
     virtual const std::string &get_outdir()   const { return outdir;}
+    async_feature_writer *get_async_writer()  const { return async_writer.get();}
 
     /* the feature recorder set automatically hashes all of the sbuf's that it processes. */
     typedef std::string (*hash_func_t)(const uint8_t *buf,const size_t bufsize);
@@ -140,15 +164,18 @@ public:
     uint32_t    opt_max_context_size {64};
     uint32_t    opt_max_feature_size {64};
     int64_t     offset_add {0};          // added to every reported offset, for use with hadoop
+    size_t      opt_histogram_memory {0};   // spill histograms to disk when together they use more than this; 0 for no limit
     std::string banner_filename {};         // banner for top of every file
 
     /* histogram support */
     void     histogram_add(const histogram_def &def); // adds it to a local set or to the specific feature recorder
     size_t   histogram_count() const;  // counts histograms in all feature recorders
+    void     histograms_check_memory(); // spill the largest histograms until they fit in opt_histogram_memory
 
     // called when scanner_set shuts down:
     void     feature_recorders_shutdown();
-    void     histograms_generate();     // make the histograms in the output directory (and optionally in the database)
+    void     histograms_generate(unsigned int threads=0); // make the histograms in the output directory (and optionally in the database)
+                                        // several at a time; threads=0 means one per core
 
 #if 0
     typedef  void (*xml_notifier_t)(const std::string &xmlstring);
@@ -185,16 +212,20 @@ public:
      *** DB interface
      ****************************************************************/
 
-#if 0
 #if defined(HAVE_SQLITE3_H) and defined(HAVE_LIBSQLITE3)
-    virtual  void db_send_sql(sqlite3 *db3,const char **stmts, ...) ;
+    /* Inserts are grouped into large transactions, committed after COMMIT_ROWS rows or COMMIT_SECONDS */
+    static const size_t   COMMIT_ROWS = 100000;
+    static const unsigned COMMIT_SECONDS = 5;
+
+    virtual  void db_send_sql(sqlite3 *db3,const char **stmts, ...) ; // these all require Mdb
     virtual  sqlite3 *db_create_empty(const std::string &name) ;
     void     db_create_table(const std::string &name) ;
+    void     db_create_indexes(const std::string &name) ;   // deferred until the table is complete
     void     db_create() ;
-    void     db_transaction_begin() ;
-    void     db_transaction_commit() ;               // commit current transaction
-    void     db_close() ;                            //
-#endif
+    void     db_transaction_begin() ;               // begin a transaction, unless one is open
+    void     db_transaction_commit() ;              // commit current transaction, if there is one
+    void     db_transaction_rows(size_t rows) ;     // count rows inserted; commits when there are enough
+    void     db_close() ;                           // commits
 #endif
     /****************************************************************
      *** External Functions
@@ -202,6 +233,15 @@ public:
 
     // Management of previously seen data
     virtual bool check_previously_processed(const sbuf_t &sbuf);
+    sbuf_digest_alg dedup_digest_alg() const { // the digest that check_previously_processed() uses
+        return flags.dedup_fast_hash ? sbuf_digest_alg::MURMUR3 : sbuf_digest_alg::SHA1;
+    }
+    /* Also remember pages in (and skip pages found in) the digest store fname, so that later runs
+     * over the same or overlapping media skip what this run has processed. Call before scanning starts.
+     * Throws digest_store::StoreError.
+     */
+    void    open_digest_store(const std::string &fname);
+    const digest_store *get_digest_store() const { return persistent_seen.get(); }
 
 
 };
@@ -1,11 +1,14 @@
+#ifndef FEATURE_RECORDER_SQL_H
+#define FEATURE_RECORDER_SQL_H
+
 #include <cinttypes>
 #include <cassert>
 
 #include <string>
-#include <regex>
-#include <map>
-#include <thread>
-#include <atomic>
+#include <string_view>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 #include "feature_recorder.h"
 #include "pos0.h"
@@ -14,23 +17,49 @@
 #include <sqlite3.h>
 #endif
 
-class feature_recorder_sql : public feature_recorder {
-    struct besql_stmt {
-        besql_stmt(const besql_stmt &)=delete;
-        besql_stmt &operator=(const besql_stmt &)=delete;
-        std::mutex Mstmt {};
-        sqlite3_stmt *stmt {};      // the prepared statement
-        besql_stmt(sqlite3 *db3,const char *sql);
-        virtual ~besql_stmt();
-        void insert_feature(const pos0_t &pos, // insert it into this table!
-                            const std::string &feature,const std::string &feature8, const std::string &context);
-    };
 #if defined(HAVE_SQLITE3_H) and defined(HAVE_LIBSQLITE3)
-    //virtual void dump_histogram_sqlite3(const histogram_def &def,void *user,feature_recorder::dump_callback_t cb) const;
-#endif
+/*
+ * Records features into the table f_<name> of the feature recorder set's report.sqlite
+ * (feature_recorder_set::flags_t::record_sql).
+ *
+ * Each thread collects rows in its own batch, with its own prepared INSERT statement, and only takes the
+ * set's database lock to insert a full batch. Batches go into the set's open transaction, which is committed
+ * every feature_recorder_set::COMMIT_ROWS rows or COMMIT_SECONDS. The table's indexes are built at shutdown.
+ */
+class feature_recorder_sql : public feature_recorder {
 public:
+    static const size_t BATCH_ROWS = 1024; // rows a thread collects before inserting them
+
     feature_recorder_sql(class feature_recorder_set &fs, feature_recorder_def def);
     virtual ~feature_recorder_sql();
-    virtual void histogram_flush(AtomicUnicodeHistogram &h); // flush a specific histogram
 
+    const std::string table;            // "f_" + name, with anything that is not allowed in a name replaced
+
+    virtual void write0(std::string_view str) override;  // parses a feature file line
+    virtual void write0(const pos0_t &pos0, std::string_view feature, std::string_view context) override;
+    virtual void histogram_flush(AtomicUnicodeHistogram &h) override; // flush a specific histogram
+    virtual void shutdown() override;
+
+private:
+    struct row_t {
+        int64_t     offset {0};
+        std::string path {};
+        std::string feature {};         // as it would be written to a feature file (escaped utf-8)
+        std::string feature8 {};        // unescaped; utf-16 converted to utf-8
+        std::string context {};
+    };
+    struct batch_t {
+        sqlite3_stmt       *stmt {nullptr}; // this thread's prepared statement; requires fs.Mdb
+        std::mutex         Mrows {};    // only contended at shutdown
+        std::vector<row_t> rows = std::vector<row_t>(BATCH_ROWS);
+        size_t             used {0};
+    };
+    const uint64_t fr_id;               // tells this recorder apart from others in the thread-local cache
+    std::mutex   Mbatches {};           // protects batches
+    std::vector<std::unique_ptr<batch_t>> batches {}; // never shrinks, so threads may cache pointers to them
+    batch_t &get_batch();               // this thread's batch
+    void   insert_batch(batch_t &b);    // requires b.Mrows; takes fs.Mdb
 };
+#endif
+
+#endif
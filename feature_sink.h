@@ -0,0 +1,85 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef FEATURE_SINK_H
+#define FEATURE_SINK_H
+
+/**
+ * \file
+ * feature_sink.h:
+ * Additional destinations for the features written to a feature recorder.
+ *
+ * feature_recorder::write() checks the stop list, validates and quotes the feature and context, and writes them
+ * with write0(). It then hands the same feature and context to each of the recorder's sinks, so a second output
+ * costs neither a second scan nor a second round of quoting:
+ *
+ *   recorder_sink  - the output of another feature recorder; this is how a feature_recorder_set records
+ *                    to files and SQL (and the columnar store) at the same time
+ *   histogram_sink - an in-memory histogram that is never written to disk
+ *   callback_sink  - calls a function, which may itself write features
+ */
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "atomic_unicode_histogram.h"
+#include "feature_recorder.h"
+#include "histogram_def.h"
+#include "pos0.h"
+
+class feature_sink {
+    feature_sink(const feature_sink &)=delete;
+    feature_sink &operator=(const feature_sink &)=delete;
+public:
+    feature_sink(){}
+    virtual ~feature_sink(){}
+
+    /* Called for every feature, from any thread, so it must be threadsafe.
+     * The views are only valid for the duration of the call.
+     */
+    virtual void write(const pos0_t &pos0, std::string_view feature, std::string_view context) = 0;
+    virtual void shutdown() {}          // called when the recorder set shuts down
+
+    /* True if write() may call feature_recorder::write() on this thread. The views that write() gets can point
+     * into per-thread buffers that a nested write() reuses, so the recorder copies them before calling such a sink.
+     */
+    virtual bool may_write_features() const { return false; }
+};
+
+/* Writes to another feature recorder, which the sink owns. Its write() is bypassed: the feature has been checked */
+class recorder_sink : public feature_sink {
+    std::unique_ptr<feature_recorder> fr;
+public:
+    recorder_sink(std::unique_ptr<feature_recorder> fr_):fr(std::move(fr_)){}
+    feature_recorder &recorder() { return *fr; }
+    void write(const pos0_t &pos0, std::string_view feature, std::string_view context) override {
+        fr->write0(pos0, feature, context);
+    }
+    void shutdown() override { fr->shutdown(); }
+};
+
+/* Counts the features in memory */
+class histogram_sink : public feature_sink {
+public:
+    histogram_sink(const histogram_def &def):h(def){}
+    AtomicUnicodeHistogram h;
+    void write(const pos0_t &pos0, std::string_view feature, std::string_view context) override {
+        (void)pos0; (void)context;
+        h.add(std::string(feature));
+    }
+};
+
+class callback_sink : public feature_sink {
+public:
+    typedef std::function<void(const pos0_t &pos0, std::string_view feature, std::string_view context)> callback_t;
+    callback_sink(const callback_t &cb_):cb(cb_){}
+    void write(const pos0_t &pos0, std::string_view feature, std::string_view context) override {
+        cb(pos0, feature, context);
+    }
+    bool may_write_features() const override { return true; } // the callback can do anything
+private:
+    const callback_t cb;
+};
+
+#endif
@@ -0,0 +1,124 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * feature_sketch.cpp:
+ * Count-min sketch and HyperLogLog estimates of recorded features. See feature_sketch.h.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "feature_sketch.h"
+#include "sbuf_profile.h"
+
+/****************************************************************
+ *** count_min_sketch
+ ****************************************************************/
+
+count_min_sketch::count_min_sketch():
+    counters(std::make_unique<std::atomic<uint32_t>[]>(DEPTH * WIDTH))
+{
+}
+
+/* Every row is incremented, rather than only the lowest (conservative update), because that would need
+ * the rows to be read and raised together to never underestimate when threads add at the same time.
+ */
+uint32_t count_min_sketch::add(uint64_t h1, uint64_t h2)
+{
+    uint32_t est = UINT32_MAX;
+    for (size_t row=0; row<DEPTH; row++) {
+        est = std::min(est, counters[row * WIDTH + column(row, h1, h2)].fetch_add(1, std::memory_order_relaxed) + 1);
+    }
+    return est;
+}
+
+uint32_t count_min_sketch::estimate(uint64_t h1, uint64_t h2) const
+{
+    uint32_t est = UINT32_MAX;
+    for (size_t row=0; row<DEPTH; row++) {
+        est = std::min(est, counters[row * WIDTH + column(row, h1, h2)].load(std::memory_order_relaxed));
+    }
+    return est;
+}
+
+void count_min_sketch::clear()
+{
+    for (size_t i=0; i<DEPTH * WIDTH; i++) {
+        counters[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+/****************************************************************
+ *** hyperloglog
+ ****************************************************************/
+
+hyperloglog::hyperloglog():
+    registers(std::make_unique<std::atomic<uint8_t>[]>(REGISTERS))
+{
+}
+
+/* The first P bits pick the register; it keeps the highest position of the first 1 bit in the rest */
+void hyperloglog::add(uint64_t h)
+{
+    const size_t  index = h >> (64 - P);
+    const uint64_t rest = h << P;
+    const uint8_t rank  = rest ? __builtin_clzll(rest) + 1 : 64 - P + 1;
+    std::atomic<uint8_t> &reg = registers[index];
+    uint8_t cur = reg.load(std::memory_order_relaxed);
+    while (cur < rank && !reg.compare_exchange_weak(cur, rank, std::memory_order_relaxed)) {
+    }
+}
+
+/* Flajolet et al., with linear counting for small cardinalities. The hash is 64 bits, so no large range correction */
+uint64_t hyperloglog::estimate() const
+{
+    const double m = REGISTERS;
+    double sum = 0;
+    size_t zeros = 0;
+    for (size_t i=0; i<REGISTERS; i++) {
+        const uint8_t r = registers[i].load(std::memory_order_relaxed);
+        sum += std::ldexp(1.0, -r);
+        if (r == 0) zeros++;
+    }
+    double e = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+    if (e <= 2.5 * m && zeros > 0) {
+        e = m * std::log(m / zeros);
+    }
+    return std::llround(e);
+}
+
+void hyperloglog::clear()
+{
+    for (size_t i=0; i<REGISTERS; i++) {
+        registers[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+/****************************************************************
+ *** feature_sketch
+ ****************************************************************/
+
+void feature_sketch::add(std::string_view feature)
+{
+    const digest128_t d = sbuf_profile::murmur3(reinterpret_cast<const uint8_t *>(feature.data()), feature.size());
+    hll.add(d.hi);
+    const uint32_t est = cms.add(d.lo, d.hi | 1);
+    uint32_t cur = max_count_.load(std::memory_order_relaxed);
+    while (cur < est && !max_count_.compare_exchange_weak(cur, est, std::memory_order_relaxed)) {
+    }
+}
+
+uint64_t feature_sketch::count(std::string_view feature) const
+{
+    const digest128_t d = sbuf_profile::murmur3(reinterpret_cast<const uint8_t *>(feature.data()), feature.size());
+    return cms.estimate(d.lo, d.hi | 1);
+}
+
+void feature_sketch::clear()
+{
+    cms.clear();
+    hll.clear();
+    max_count_ = 0;
+}
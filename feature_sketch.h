@@ -0,0 +1,69 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef FEATURE_SKETCH_H
+#define FEATURE_SKETCH_H
+
+/**
+ * \file
+ * feature_sketch.h:
+ * Fixed-memory estimates of the features recorded by a feature recorder, kept whether or not it has histograms:
+ *
+ *   count_min_sketch - how many times a feature was recorded. Never less than the true count, and more by at
+ *                      most e/WIDTH of all features recorded with probability 1-e^-DEPTH.
+ *   hyperloglog      - how many distinct features were recorded, with a standard error of 1.04/sqrt(2^P).
+ *
+ * Both are arrays of counters updated with relaxed atomics, so adding a feature takes no lock.
+ * feature_sketch hashes each feature once (MurmurHash3 x64_128) and feeds both.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+class count_min_sketch {
+public:
+    static const size_t DEPTH = 4;
+    static const size_t WIDTH = 8192;   // DEPTH*WIDTH*4 bytes = 128KiB
+
+    count_min_sketch();
+    uint32_t add(uint64_t h1, uint64_t h2);      // returns the new estimate
+    uint32_t estimate(uint64_t h1, uint64_t h2) const;
+    void     clear();
+
+private:
+    std::unique_ptr<std::atomic<uint32_t>[]> counters; // DEPTH rows of WIDTH
+    static size_t column(size_t row, uint64_t h1, uint64_t h2) { return (h1 + row * h2) % WIDTH; }
+};
+
+class hyperloglog {
+public:
+    static const unsigned P = 14;       // 2^P registers of one byte; 0.81% standard error
+    static const size_t   REGISTERS = size_t(1) << P;
+
+    hyperloglog();
+    void     add(uint64_t h);
+    uint64_t estimate() const;
+    void     clear();
+
+private:
+    std::unique_ptr<std::atomic<uint8_t>[]> registers;
+};
+
+class feature_sketch {
+public:
+    feature_sketch(){}
+    void     add(std::string_view feature);
+    uint64_t count(std::string_view feature) const;    // estimated times feature was added
+    uint64_t distinct() const { return hll.estimate(); } // estimated number of distinct features added
+    uint64_t max_count() const { return max_count_; }  // highest estimate of any feature that was added;
+                                                        // only tells of a frequent feature if well above adds/WIDTH
+    void     clear();
+
+private:
+    count_min_sketch    cms {};
+    hyperloglog         hll {};
+    std::atomic<uint32_t> max_count_ {0};
+};
+
+#endif
@@ -18,25 +18,19 @@ bool histogram_def::match(std::u32string u32key, std::string *displayString) con
     std::string u8key = convert_utf32_to_utf8( u32key );
 
 
-    std::cerr << "pt1. u8key=" << u8key << "\n";
-
     /* If a string is required and it is not present, return */
     if (require.size() > 0 && u8key.find_first_of(require)==std::string::npos){
-        std::cerr << "fail1\n";
         return false;
     }
 
     /* Check for pattern */
     if (pattern.size() > 0){
         std::smatch m {};
-        std::cerr << "calling regex_search. u8key=" << u8key << "\n";
         std::regex_search( u8key, m, this->reg);
         if (m.empty()==true){       // match does not exist
-            std::cerr << "fail2  pattern=" << pattern << "\n";
             return false;           // regex not found
         }
         u8key = m.str();
-        std::cerr << "m=" << m.str() << " \n";
     }
 
     if (displayString) {
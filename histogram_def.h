@@ -3,6 +3,7 @@
 
 #include <string>
 #include <regex>
+#include <cstdint>
 #include <cstdio>
 #include <string>
 #include <iostream>
@@ -20,11 +21,13 @@ struct histogram_def {
         flags_t(const flags_t &a){
             this->lowercase = a.lowercase;
             this->numeric   = a.numeric;
+            this->topk      = a.topk;
         };
 
         flags_t &operator=(const flags_t &a){
             this->lowercase = a.lowercase;
             this->numeric   = a.numeric;
+            this->topk      = a.topk;
             return *this;
         };
 
@@ -32,17 +35,20 @@ struct histogram_def {
             if (this->lowercase < a.lowercase) return true;
             if (this->lowercase > a.lowercase) return false;
             if (this->numeric   < a.numeric) return true;
+            if (this->numeric   > a.numeric) return false;
+            if (this->topk      < a.topk) return true;
             return false;
         }
 
         bool operator==(const flags_t &a) const {
-            return (this->lowercase == a.lowercase) && (this->numeric   == a.numeric);
+            return (this->lowercase == a.lowercase) && (this->numeric   == a.numeric) && (this->topk == a.topk);
         }
 
         flags_t(){};
-        flags_t(bool lowercase_,bool numeric_): lowercase(lowercase_),numeric(numeric_){}
+        flags_t(bool lowercase_,bool numeric_,uint32_t topk_=0): lowercase(lowercase_),numeric(numeric_),topk(topk_){}
         bool lowercase {false};         // make all flags lowercase
         bool numeric   {false};           // extract digits only
+        uint32_t topk  {0};             // if >0, keep only an approximate count of the topk most frequent features
     };
 
     /**
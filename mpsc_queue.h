@@ -0,0 +1,82 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * defines mpsc_queue, a bounded lock-free queue with many producers and one consumer.
+ *
+ * It is a ring of cells, each with a sequence number (D. Vyukov's bounded queue).
+ * A producer claims a cell by advancing tail with a compare-and-swap, fills it, and then publishes it
+ * by bumping the cell's sequence number; the consumer takes cells in order from head.
+ * try_push() returns false when the queue is full, so the caller decides how to wait.
+ */
+
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+template <class TYPE> class mpsc_queue {
+    struct cell_t {
+        std::atomic<size_t> seq {0};
+        TYPE value {};
+    };
+    const size_t mask;
+    std::unique_ptr<cell_t[]> cells;
+    alignas(64) std::atomic<size_t> tail {0}; // next cell for producers
+    alignas(64) size_t head {0};              // next cell for the consumer
+
+public:
+    mpsc_queue(const mpsc_queue &)=delete;
+    mpsc_queue &operator=(const mpsc_queue &)=delete;
+
+    /* capacity must be a power of 2 */
+    mpsc_queue(size_t capacity):mask(capacity-1),cells(new cell_t[capacity]) {
+        if (capacity==0 || (capacity & mask) != 0) {
+            throw std::invalid_argument("mpsc_queue capacity must be a power of 2");
+        }
+        for (size_t i=0; i<capacity; i++) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    size_t capacity() const { return mask+1; }
+
+    /* Any thread. Moves value into the queue and returns true, or returns false if the queue is full. */
+    bool try_push(TYPE &value) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        cell_t *cell;
+        for (;;) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (dif == 0) {
+                if (tail.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+            } else if (dif < 0) {
+                return false;           // the consumer has not taken this cell yet
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->seq.store(pos+1, std::memory_order_release);
+        return true;
+    }
+
+    /* Consumer thread only. Moves the oldest value into value and returns true, or returns false if empty. */
+    bool try_pop(TYPE &value) {
+        cell_t *cell = &cells[head & mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        if (static_cast<intptr_t>(seq) - static_cast<intptr_t>(head+1) < 0) {
+            return false;
+        }
+        value = std::move(cell->value);
+        cell->seq.store(head + mask + 1, std::memory_order_release);
+        head++;
+        return true;
+    }
+};
+
+#endif
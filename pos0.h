@@ -1,6 +1,7 @@
 #ifndef _FPOS0_H_
 #define _FPOS0_H_
 
+#include <charconv>
 #include <cinttypes>
 #include <sstream>
 #include <string>
@@ -57,6 +58,15 @@ public:
         ss << offset;
         return ss.str();
     }
+    void append_str(std::string &out) const { // append str() to out without making a temporary
+        if(path.size()>0){
+            out += path;
+            out += '-';
+        }
+        char buf[24];
+        auto res = std::to_chars(buf, buf+sizeof(buf), offset);
+        out.append(buf, res.ptr-buf);
+    }
     bool isRecursive() const {          // is there a path?
         return path.size() > 0;
     }
@@ -3,9 +3,11 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <stdio.h>
+#include <algorithm>
 #include <filesystem>
 
 #include "sbuf.h"
+#include "sbuf_profile.h"
 //#include "bulk_extractor_i.h"
 #include "unicode_escape.h"
 
@@ -181,12 +183,10 @@ const std::string sbuf_t::substr(size_t loc,size_t len) const
 
 bool sbuf_t::is_constant(size_t off,size_t len,uint8_t ch) const // verify that it's constant
 {
-    while(len>0){
-        if(((*this)[off])!=ch) return false;
-        off++;
-        len--;
-    }
-    return true;
+    /* operator[] reads past the end of the buffer as 0, so the part of the range past bufsize is constant only if ch is 0 */
+    size_t inside = off < bufsize ? std::min(len, bufsize-off) : 0;
+    if (inside < len && ch != 0) return false;
+    return bytes_constant(buf+off, inside, ch);
 }
 
 void sbuf_t::hex_dump(std::ostream &os) const
@@ -246,19 +246,173 @@ static const char *hexbuf(char *dst,int dst_len,const unsigned char *bin,int byt
 
 
 /* Determine if the sbuf consists of a repeating ngram */
+/*
+ * Returns the smallest ngram_size < max_ngram such that the page is that ngram repeated, or 0.
+ * Rather than trying every size, find the smallest period p of the first 2*(max_ngram-1) bytes and verify
+ * that the rest of the page repeats with period p. By the Fine-Wilf theorem, any other period q < max_ngram
+ * of the page is a multiple of p, so if p fails there is no answer.
+ */
 size_t sbuf_t::find_ngram_size(const size_t max_ngram) const
 {
-    for (size_t ngram_size = 1; ngram_size < max_ngram; ngram_size++){
-	bool ngram_match = true;
-	for (size_t i=ngram_size; i < pagesize && ngram_match; i++){
-	    if ((*this)[i%ngram_size]!=(*this)[i]) ngram_match = false;
-	}
-	if (ngram_match) return ngram_size;
+    /* Use the profile if some other caller has already paid for it */
+    const sbuf_profile *prof = profile_cache.load();
+    if (prof && max_ngram <= sbuf_profile::MAX_PERIOD+1) {
+        return prof->ngram_size(max_ngram);
+    }
+    if (max_ngram <= 1) return 0;
+    if (pagesize == 0) return 1;        // an empty page is a 1-gram
+
+    const size_t prefix = std::min(pagesize, 2*(max_ngram-1));
+    const size_t period = sbuf_profile::smallest_period(buf, prefix);
+    if (period >= max_ngram) return 0;
+    return bytes_equal(buf+prefix, buf+prefix-period, pagesize-prefix) ? period : 0;
+}
+
+/****************************************************************
+ *** SIMD kernels.
+ *** The best implementation for this CPU is chosen the first time each kernel is called.
+ ****************************************************************/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SBUF_X86_SIMD
+#endif
+
+typedef bool constant_kernel_t(const uint8_t *buf, size_t len, uint8_t ch);
+typedef bool equal_kernel_t(const uint8_t *a, const uint8_t *b, size_t len);
+
+static bool constant_scalar(const uint8_t *buf, size_t len, uint8_t ch)
+{
+    for (size_t i=0; i<len; i++) {
+        if (buf[i]!=ch) return false;
+    }
+    return true;
+}
+
+static bool equal_scalar(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    return len==0 || ::memcmp(a, b, len)==0;
+}
+
+#ifdef SBUF_X86_SIMD
+__attribute__((target("sse2")))
+static bool constant_sse2(const uint8_t *buf, size_t len, uint8_t ch)
+{
+    const __m128i c = _mm_set1_epi8(static_cast<char>(ch));
+    size_t i = 0;
+    for (; i+64 <= len; i+=64) {
+        __m128i e0 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(buf+i)),    c);
+        __m128i e1 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(buf+i+16)), c);
+        __m128i e2 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(buf+i+32)), c);
+        __m128i e3 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(buf+i+48)), c);
+        __m128i all = _mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3));
+        if (_mm_movemask_epi8(all) != 0xffff) return false;
+    }
+    for (; i+16 <= len; i+=16) {
+        __m128i e = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(buf+i)), c);
+        if (_mm_movemask_epi8(e) != 0xffff) return false;
+    }
+    return constant_scalar(buf+i, len-i, ch);
+}
+
+__attribute__((target("sse2")))
+static bool equal_sse2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i = 0;
+    for (; i+16 <= len; i+=16) {
+        __m128i e = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a+i)),
+                                   _mm_loadu_si128(reinterpret_cast<const __m128i *>(b+i)));
+        if (_mm_movemask_epi8(e) != 0xffff) return false;
+    }
+    return equal_scalar(a+i, b+i, len-i);
+}
+
+__attribute__((target("avx2")))
+static bool constant_avx2(const uint8_t *buf, size_t len, uint8_t ch)
+{
+    const __m256i c = _mm256_set1_epi8(static_cast<char>(ch));
+    size_t i = 0;
+    for (; i+128 <= len; i+=128) {
+        __m256i e0 = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf+i)),    c);
+        __m256i e1 = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf+i+32)), c);
+        __m256i e2 = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf+i+64)), c);
+        __m256i e3 = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf+i+96)), c);
+        __m256i all = _mm256_and_si256(_mm256_and_si256(e0, e1), _mm256_and_si256(e2, e3));
+        if (static_cast<uint32_t>(_mm256_movemask_epi8(all)) != 0xffffffffU) return false;
+    }
+    for (; i+32 <= len; i+=32) {
+        __m256i e = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf+i)), c);
+        if (static_cast<uint32_t>(_mm256_movemask_epi8(e)) != 0xffffffffU) return false;
+    }
+    return constant_scalar(buf+i, len-i, ch);
+}
+
+__attribute__((target("avx2")))
+static bool equal_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i = 0;
+    for (; i+32 <= len; i+=32) {
+        __m256i e = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a+i)),
+                                      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b+i)));
+        if (static_cast<uint32_t>(_mm256_movemask_epi8(e)) != 0xffffffffU) return false;
     }
-    return 0;                           // no ngram size
+    return equal_scalar(a+i, b+i, len-i);
+}
+#endif
+
+static constant_kernel_t *select_constant_kernel()
+{
+#ifdef SBUF_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return constant_avx2;
+    if (__builtin_cpu_supports("sse2")) return constant_sse2;
+#endif
+    return constant_scalar;
+}
+
+static equal_kernel_t *select_equal_kernel()
+{
+#ifdef SBUF_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return equal_avx2;
+    if (__builtin_cpu_supports("sse2")) return equal_sse2;
+#endif
+    return equal_scalar;
+}
+
+bool sbuf_t::bytes_constant(const uint8_t *buf, size_t len, uint8_t ch)
+{
+    static constant_kernel_t *const kernel = select_constant_kernel();
+    return (*kernel)(buf, len, ch);
 }
 
+bool sbuf_t::bytes_equal(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    static equal_kernel_t *const kernel = select_equal_kernel();
+    return (*kernel)(a, b, len);
+}
+
+
 
+/* Two threads may compute the profile at the same time; the first one to finish wins */
+const sbuf_profile &sbuf_t::profile(sbuf_digest_alg alg) const
+{
+    const sbuf_profile *prof = profile_cache.load();
+    if (prof == nullptr) {
+        const sbuf_profile *mine = new sbuf_profile(*this, alg);
+        if (profile_cache.compare_exchange_strong(prof, mine)) {
+            prof = mine;
+        } else {
+            delete mine;                // prof now holds the winner
+        }
+    }
+    return *prof;
+}
+
+void sbuf_t::release_profile()
+{
+    delete profile_cache.exchange(nullptr);
+}
 
 std::ostream & operator <<(std::ostream &os,const sbuf_t &t){
         char hex[17];
@@ -73,6 +73,9 @@ public:
 };
 
 
+/* Digest computed by sbuf_t::profile(): SHA1, or the much faster non-cryptographic 128-bit MurmurHash3 */
+enum class sbuf_digest_alg { SHA1, MURMUR3 };
+
 /**
  * \class sbuf_t
  * This class describes the search buffer.
@@ -112,6 +115,9 @@ private:
 public:
     mutable std::atomic<int>   children {0}; // number of child sbufs; can get increment in copy
     const unsigned int depth() const { return pos0.depth; }
+private:
+    mutable std::atomic<const class sbuf_profile *> profile_cache {nullptr}; // see profile()
+public:
 #ifdef PRIVATE_SBUF_BUF
 private:               // one day
 #else
@@ -128,6 +134,7 @@ public:
 
 private:
     void release();                     // release allocated storage
+    void release_profile();             // delete the cached profile
     sbuf_t &operator=(const sbuf_t &that) = delete; // default assignment not implemented
 public:
     /** Make an empty sbuf.
@@ -270,6 +277,12 @@ public:
     /* return true if the sbuf consists solely of ngrams */
     size_t find_ngram_size(size_t max_ngram) const;
 
+    /* The digest, byte histogram, ngram period and constant flags of the sbuf, computed in one pass
+     * the first time they are asked for. Threadsafe. See sbuf_profile.h
+     * alg is only used if the profile has not been computed yet; check profile().alg.
+     */
+    const class sbuf_profile &profile(sbuf_digest_alg alg = sbuf_digest_alg::SHA1) const;
+
     /****************************************************************
      *** range_exception_t
      *** An sbuf_range_exception object is thrown if the attempted sbuf access is out of range.
@@ -438,6 +451,10 @@ public:
     bool is_constant(size_t loc,size_t len,uint8_t ch) const; // verify that it's constant
     bool is_constant(uint8_t ch) const { return is_constant(0,this->pagesize,ch); }
 
+    /* SIMD kernels, chosen for the CPU at runtime. They are used by is_constant(), find_ngram_size() and profile() */
+    static bool bytes_constant(const uint8_t *buf, size_t len, uint8_t ch); // buf[0..len) all equal ch
+    static bool bytes_equal(const uint8_t *a, const uint8_t *b, size_t len); // a[0..len)==b[0..len)
+
     // Return a pointer to a structure contained within the sbuf if there is
     // room, otherwise return a null pointer.
     template<class TYPE>
@@ -467,6 +484,7 @@ public:
         }
 #endif
         if(parent) parent->del_child(*this);
+        release_profile();
 
 #ifdef HAVE_MMAP
         if(should_unmap && buf){
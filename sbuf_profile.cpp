@@ -0,0 +1,206 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "sbuf.h"
+#include "sbuf_profile.h"
+
+/*
+ * MurmurHash3 x64_128 (Austin Appleby, public domain), restructured so that it can be fed in pieces.
+ * Bytes that do not fill a 16-byte block are held until the next update() or final().
+ */
+class murmur3_128 {
+    static const uint64_t c1 = 0x87c37b91114253d5ULL;
+    static const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 {0};
+    uint64_t h2 {0};
+    uint64_t total {0};
+    uint8_t  tail[16] {};
+    size_t   tail_len {0};
+
+    static uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+    static uint64_t fmix64(uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    }
+    void block(const uint8_t *p) {
+        uint64_t k1, k2;
+        memcpy(&k1, p, 8);              // the reference implementation reads little-endian blocks
+        memcpy(&k2, p+8, 8);
+#ifdef BE13_API_BIGENDIAN
+        k1 = __builtin_bswap64(k1);
+        k2 = __builtin_bswap64(k2);
+#endif
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+    }
+public:
+    void update(const uint8_t *buf, size_t len) {
+        total += len;
+        if (tail_len > 0) {
+            size_t n = std::min(len, 16 - tail_len);
+            memcpy(tail + tail_len, buf, n);
+            tail_len += n; buf += n; len -= n;
+            if (tail_len < 16) return;
+            block(tail);
+            tail_len = 0;
+        }
+        for (; len >= 16; buf += 16, len -= 16) {
+            block(buf);
+        }
+        memcpy(tail, buf, len);
+        tail_len = len;
+    }
+    digest128_t final() {
+        uint64_t k1 = 0, k2 = 0;
+        for (size_t i = tail_len; i > 8; i--) {
+            k2 ^= uint64_t(tail[i-1]) << ((i-9) * 8);
+        }
+        if (tail_len > 8) {
+            k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        }
+        for (size_t i = std::min(tail_len, size_t(8)); i > 0; i--) {
+            k1 ^= uint64_t(tail[i-1]) << ((i-1) * 8);
+        }
+        if (tail_len > 0) {
+            k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        }
+        h1 ^= total; h2 ^= total;
+        h1 += h2; h2 += h1;
+        h1 = fmix64(h1); h2 = fmix64(h2);
+        h1 += h2; h2 += h1;
+        digest128_t d;
+        d.hi = h1;
+        d.lo = h2;
+        return d;
+    }
+};
+
+digest128_t sbuf_profile::murmur3(const uint8_t *buf, size_t len)
+{
+    murmur3_128 g;
+    g.update(buf, len);
+    return g.final();
+}
+
+std::string sbuf_profile::hexdigest() const
+{
+    if (alg == sbuf_digest_alg::SHA1) {
+        return digest.hexdigest();
+    }
+    static const char hexchars[] = "0123456789abcdef";
+    std::string ret;
+    for (uint64_t v: {key.hi, key.lo}) {
+        for (int shift = 0; shift < 64; shift += 8) { // h1 then h2, each little-endian, as the reference prints them
+            uint8_t b = (v >> shift) & 0xff;
+            ret.push_back(hexchars[b >> 4]);
+            ret.push_back(hexchars[b & 0x0f]);
+        }
+    }
+    return ret;
+}
+
+size_t sbuf_profile::smallest_period(const uint8_t *buf, size_t len)
+{
+    if (len == 0) {
+        return 0;
+    }
+    std::vector<size_t> fail(len+1, 0);
+    size_t k = 0;
+    for (size_t i=1; i<len; i++) {
+        while (k>0 && buf[i]!=buf[k]) {
+            k = fail[k];
+        }
+        if (buf[i]==buf[k]) {
+            k++;
+        }
+        fail[i+1] = k;
+    }
+    return len - fail[len];
+}
+
+/*
+ * The ngram period is found from the first 2*MAX_PERIOD bytes of the page and then verified over the rest.
+ * Verifying the smallest period p of that prefix is enough: by the Fine-Wilf theorem, any other period
+ * q <= MAX_PERIOD of the page is a multiple of p, so if p does not hold for the whole page, neither does q.
+ */
+sbuf_profile::sbuf_profile(const sbuf_t &sbuf, sbuf_digest_alg alg_):
+    alg(alg_)
+{
+    const uint8_t *buf      = sbuf.buf;
+    const size_t   pagesize = sbuf.pagesize;
+    const size_t   bufsize  = sbuf.bufsize;
+
+    /* Candidate period. As with find_ngram_size(), an empty page is a 1-gram, and a page shorter
+     * than MAX_PERIOD is trivially an ngram of its own length.
+     */
+    const size_t prefix = pagesize < 2*MAX_PERIOD ? pagesize : 2*MAX_PERIOD;
+    size_t period = (prefix == 0) ? 1 : smallest_period(buf, prefix);
+    if (period > MAX_PERIOD) {
+        period = 0;                     // no repeat within the prefix
+    }
+
+    /* Four histograms so that runs of the same byte do not serialize on one counter */
+    uint64_t h[4][256];
+    memset(h, 0, sizeof(h));
+
+    dfxml::sha1_generator g;
+    murmur3_128 m;
+    for (size_t start = 0; start < bufsize; start += CHUNK_SIZE) {
+        const size_t len = bufsize - start < CHUNK_SIZE ? bufsize - start : CHUNK_SIZE;
+        if (alg == sbuf_digest_alg::SHA1) {
+            g.update(buf + start, len);
+        } else {
+            m.update(buf + start, len);
+        }
+
+        /* The remaining kernels only look at the page */
+        if (start >= pagesize) {
+            continue;
+        }
+        const size_t plen = pagesize - start < len ? pagesize - start : len;
+        const uint8_t *p = buf + start;
+        size_t i = 0;
+        for (; i+4 <= plen; i+=4) {
+            h[0][p[i]]++;
+            h[1][p[i+1]]++;
+            h[2][p[i+2]]++;
+            h[3][p[i+3]]++;
+        }
+        for (; i < plen; i++) {
+            h[0][p[i]]++;
+        }
+
+        /* Verify page[j]==page[j-period] for the part of this chunk after the prefix */
+        if (period > 0) {
+            const size_t from = start > prefix ? start : prefix;
+            if (from < start + plen &&
+                !sbuf_t::bytes_equal(buf + from, buf + from - period, start + plen - from)) {
+                period = 0;
+            }
+        }
+    }
+    if (alg == sbuf_digest_alg::SHA1) {
+        digest = g.final();
+        key    = digest128_t::from_bytes(digest.digest);
+    } else {
+        key    = m.final();
+    }
+
+    for (size_t b=0; b<256; b++) {
+        histogram[b] = h[0][b] + h[1][b] + h[2][b] + h[3][b];
+    }
+    ngram_period = period;
+    constant     = (pagesize == 0) || histogram[buf[0]] == pagesize;
+    zero         = (pagesize == 0) || histogram[0] == pagesize;
+}
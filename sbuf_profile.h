@@ -0,0 +1,63 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef SBUF_PROFILE_H
+#define SBUF_PROFILE_H
+
+/**
+ * \file
+ * sbuf_profile.h:
+ * Everything that the scanner_set wants to know about an sbuf before it calls the scanners,
+ * computed in a single pass over the buffer:
+ *
+ * - digest        - SHA1 (or MurmurHash3 x64_128) of the whole buffer (bufsize), used to find sbufs
+ *                   that were seen before.
+ * - histogram     - count of each byte value in the page (pagesize).
+ * - ngram_period  - the smallest p <= MAX_PERIOD such that page[i]==page[i-p] for every i, or 0.
+ * - constant/zero - the page is a single repeated byte / is all zeros.
+ *
+ * The buffer is processed in chunks small enough to stay in cache, and each chunk is given to
+ * all three kernels before moving on, so memory is read only once.
+ *
+ * Get the profile with sbuf_t::profile(), which computes it the first time and caches it in the sbuf.
+ */
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+#include <string>
+
+#include "dfxml/src/hash_t.h"
+#include "atomic_digest_set.h"
+#include "sbuf.h"
+
+class sbuf_profile {
+public:
+    static const size_t MAX_PERIOD = 64;        // longest ngram that is detected
+    static const size_t CHUNK_SIZE = 64*1024;   // bytes processed by every kernel before moving on
+
+    explicit sbuf_profile(const sbuf_t &sbuf, sbuf_digest_alg alg_ = sbuf_digest_alg::SHA1);
+
+    sbuf_digest_alg alg {sbuf_digest_alg::SHA1};
+    dfxml::sha1_t digest {};            // only if alg is SHA1
+    digest128_t   key {};               // first 128 bits of the SHA1, or the MurmurHash3; for dedup sets
+    std::array<uint64_t, 256> histogram {};
+    size_t ngram_period {0};
+    bool   constant {false};
+    bool   zero {false};
+
+    /* The answer that sbuf_t::find_ngram_size() would give, for max_ngram <= MAX_PERIOD+1 */
+    size_t ngram_size(size_t max_ngram) const {
+        return (ngram_period > 0 && ngram_period < max_ngram) ? ngram_period : 0;
+    }
+
+    std::string hexdigest() const;      // of the SHA1 or the MurmurHash3
+
+    /* MurmurHash3 x64_128 with seed 0, as one call */
+    static digest128_t murmur3(const uint8_t *buf, size_t len);
+
+    /* smallest period of buf[0..len) (len if it has none shorter), using the KMP failure function */
+    static size_t smallest_period(const uint8_t *buf, size_t len);
+};
+
+#endif
@@ -25,3 +25,9 @@ const std::string &scanner_params::get_input_fname() const
 {
     return ss.get_input_fname();
 }
+
+/* Hand a decoded child sbuf to the scanner_set, which schedules it */
+void scanner_params::recurse(sbuf_t *child) const
+{
+    ss.recurse(*this, child);
+}
@@ -7,10 +7,13 @@
  * Interface for individual scanners.
  */
 
+#include <atomic>
 #include <string>
 #include <set>
 #include <sstream>
+#include <vector>
 #include <map>
+#include <memory>
 #include <ostream>
 
 
@@ -96,6 +99,10 @@ struct scanner_params {
         uint64_t          flags {};               //   flags
         std::set<feature_file_def>    feature_defs {};   //   feature files that this scanner needs.
         std::set<histogram_def>  histogram_defs {};      //   histogram definitions that the scanner needs
+        /* Prefilter: if not empty, the scanner is only called on sbufs that contain at least one of these
+         * byte sequences (e.g. "\x1f\x8b" for GZIP). Leave it empty for scanners that must see every sbuf.
+         */
+        std::vector<std::string> prefilter_signatures {};
         //void              *packet_user {};        //   data for network callback
         //be13::packet_callback_t *packet_cb {};    //   callback for processing network packets, or NULL
 
@@ -110,7 +117,8 @@ struct scanner_params {
             pathPrefix(source.pathPrefix),
             flags(source.flags),
             feature_names(source.feature_names),
-            histogram_defs(source.histogram_defs) {
+            histogram_defs(source.histogram_defs),
+            prefilter_signatures(source.prefilter_signatures) {
         }
     };
 
@@ -171,6 +179,14 @@ struct scanner_params {
     virtual ~scanner_params(){};
     virtual feature_recorder &named_feature_recorder(const std::string feature_recorder_name);
 
+    /* Called by a recursive scanner (scanner_flags.recurse) with a decoded child sbuf.
+     * The scanner_set takes ownership of the child and deletes it when it has been scanned.
+     * If the sbuf being scanned is owned by the scanner_set's scheduler, the child becomes its own task,
+     * and the parent is kept alive until the child and all of its descendants are deleted.
+     * Otherwise the child is scanned before recurse() returns.
+     */
+    virtual void recurse(sbuf_t *child) const;
+
 
 #if 0
     /* A scanner params with no print options */
@@ -207,6 +223,26 @@ struct scanner_params {
     PrintOptions                print_options {}; // how to print. Default is that there are no options
     const uint32_t              depth {0};     //  how far down are we? / only valid in SCAN_PHASE
     std::stringstream           *sxml{};       //  on scanning and shutdown: CDATA added to XML stream if provided
+    std::shared_ptr<const sbuf_t> sbuf_keepalive {}; // set when the scheduler owns sbuf; children hold a copy
+
+    /* Cooperative cancellation. A scanner that has used up its time budget is asked to stop.
+     * Scanners that can run for a long time should poll is_cancelled() in their inner loops and return early.
+     */
+    static const uint64_t CANCELLED = 1ULL << 63;
+    const std::atomic<uint64_t> *cancel_token {nullptr}; // set by the scanner_set during PHASE_SCAN
+    bool is_cancelled() const {
+        return cancel_token && (cancel_token->load(std::memory_order_relaxed) & CANCELLED);
+    }
+
+    /* scan_sbuf() reuses one scanner_params for all of the scanners called on an sbuf.
+     * reset() undoes anything that the previous scanner changed.
+     */
+    void reset(const std::shared_ptr<const sbuf_t> &keepalive, const std::atomic<uint64_t> *cancel_token_) {
+        print_options.clear();
+        sxml = nullptr;
+        if (sbuf_keepalive != keepalive) sbuf_keepalive = keepalive;
+        cancel_token = cancel_token_;
+    }
 
     std::string const &get_input_fname() const;
 };
@@ -216,26 +252,4 @@ inline std::ostream & operator <<(std::ostream &os,const scanner_params &sp){
     return os;
 };
 
-/**
- * the recursion_control_block keeps track of what gets added to
- * the path when there is recursive re-analysis. It's now a structure within the scanner_set
- * because it's controlled by the scanning process.
- */
-
-struct recursion_control_block {
-    /* process_t is a function that processes a scanner_params block.
-     */
-    typedef void process_t(const scanner_params &sp);
-
-    /**
-     * @param callback_ - the function to call back
-     * @param partName_ - the part of the forensic path processed by this scanner.
-     */
-    recursion_control_block(process_t *callback_,std::string partName_):
-        callback(callback_),partName(partName_){}
-    process_t *callback{};
-    std::string partName{};            /* eg "ZIP", "GZIP" */
-};
-
-
 #endif
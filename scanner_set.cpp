@@ -6,6 +6,9 @@
 
 #include "config.h"
 #include <cassert>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 
 #ifdef HAVE_ERR_H
 #include <err.h>
@@ -17,9 +20,9 @@
 
 #include "scanner_config.h"
 #include "scanner_set.h"
+#include "sbuf_profile.h"
 #include "dfxml/src/hash_t.h"
 #include "dfxml/src/dfxml_writer.h"
-#include "aftimer.h"
 
 
 /****************************************************************
@@ -50,11 +53,20 @@ packet_plugin_info_vector_t  packet_handlers;   // pcap callback handlers
 /****************************************************************
  * create the scanner set
  */
+static std::atomic<uint64_t> next_ss_id {1};
+
 scanner_set::scanner_set(const scanner_config &sc_,
                          const feature_recorder_set::flags_t &f,
                          class dfxml_writer *writer_):
-    sc(sc_),fs(f,sc_.hash_alg, sc_.input_fname, sc_.outdir), writer(writer_)
+    ss_id(next_ss_id++), sc(sc_),fs(f,sc_.hash_alg, sc_.input_fname, sc_.outdir), writer(writer_)
+{
+}
+
+scanner_set::~scanner_set()
 {
+    /* If we are unwinding without shutdown(), finish the queued tasks while the members they use still exist */
+    pool.reset();
+    stop_watchdog();
 }
 
 
@@ -405,10 +417,323 @@ void scanner_set::phase_scan()
         throw std::runtime_error("start_scan can only be run in scanner_params::PHASE_INIT");
     }
     current_phase = scanner_params::PHASE_SCAN;
+    compile_dispatch_plan();
+    if (worker_count > 0) {
+        pool = std::make_unique<thread_pool>(worker_count);
+    }
+    if (scanner_budget_ns > 0 || sbuf_budget_ns > 0) {
+        watchdog = std::thread( &scanner_set::watchdog_main, this );
+    }
+}
+
+/* Compile the enabled scanners into the dispatch table.
+ * Scanners are skipped for an sbuf that is deeper than depth 0 (depth_0 scanners), that is a repeating ngram
+ * (unless scan_ngram_buffer) or that has been seen before (unless scan_seen_before). Each of the eight
+ * combinations gets its own list, in scanner_info_db order.
+ */
+void scanner_set::compile_dispatch_plan()
+{
+    dispatch.clear();
+    for (int cls=0; cls<DISPATCH_CLASSES; cls++) {
+        dispatch_plan[cls].clear();
+        dispatch_prefiltered[cls] = false;
+    }
+    for (auto &sigs: prefilter) {
+        sigs.clear();
+    }
+    prefiltered_count = 0;
+    for (auto it: scanner_info_db) {
+        if (enabled_scanners.find(it.first) == enabled_scanners.end()){
+            continue;                       //  not enabled
+        }
+        const auto &flags = it.second->scanner_flags;
+        uint32_t index = dispatch.size();
+        bool prefiltered = false;
+        for (const auto &sig: it.second->prefilter_signatures) {
+            if (sig.empty()) {
+                throw std::invalid_argument("scanner " + it.second->name + " has an empty prefilter signature");
+            }
+            prefilter[ static_cast<uint8_t>(sig[0]) ].push_back( prefilter_sig_t{ sig, index });
+            prefiltered = true;
+        }
+        if (prefiltered) {
+            prefiltered_count += 1;
+        }
+        dispatch.push_back( dispatch_entry_t{ it.first, it.second->name, prefiltered });
+        for (int cls=0; cls<DISPATCH_CLASSES; cls++) {
+            if ((cls & DISPATCH_DEEP)  && flags.depth_0) continue;
+            if ((cls & DISPATCH_NGRAM) && flags.scan_ngram_buffer==false) continue;
+            if ((cls & DISPATCH_SEEN)  && flags.scan_seen_before==false) continue;
+            dispatch_plan[cls].push_back(index);
+            dispatch_prefiltered[cls] |= prefiltered;
+        }
+    }
+}
+
+/* One pass over the sbuf for all of the prefilter signatures.
+ * hits[i] is set if dispatch[i] is prefiltered and one of its signatures is in the sbuf.
+ * The pass ends early once every prefiltered scanner has a hit.
+ */
+void scanner_set::prefilter_sbuf(const sbuf_t &sbuf, std::vector<uint8_t> &hits) const
+{
+    hits.assign(dispatch.size(), 0);
+    size_t unhit = prefiltered_count;
+    const uint8_t *buf = sbuf.buf;
+    const size_t bufsize = sbuf.bufsize;
+    for (size_t i=0; i<bufsize && unhit>0; i++) {
+        const auto &sigs = prefilter[ buf[i] ];
+        if (sigs.empty()) {
+            continue;
+        }
+        for (const auto &it: sigs) {
+            if (hits[it.index]==0
+                && it.signature.size() <= bufsize-i
+                && memcmp(buf+i, it.signature.data(), it.signature.size())==0) {
+                hits[it.index] = 1;
+                unhit -= 1;
+            }
+        }
+    }
+}
+
+/* The worker count can only be changed before the scan starts */
+void scanner_set::set_worker_count(unsigned int count)
+{
+    if (current_phase != scanner_params::PHASE_INIT){
+        throw std::runtime_error("set_worker_count can only be run in scanner_params::PHASE_INIT");
+    }
+    worker_count = count;
+}
+
+/* Process a page sbuf in the thread pool.
+ * The scanner_set takes ownership of the sbuf and deletes it when every scanner is done with it.
+ */
+void scanner_set::submit_sbuf(sbuf_t *sbuf)
+{
+    if (current_phase != scanner_params::PHASE_SCAN){
+        throw std::runtime_error("submit_sbuf can only be run in scanner_params::PHASE_SCAN");
+    }
+    std::shared_ptr<const sbuf_t> owned(sbuf);
+    if (!pool) {
+        scan_sbuf(*owned, nullptr);
+        return;
+    }
+    pool->submit( [this, owned]{ scan_sbuf(*owned, owned); }, owned->depth() );
+}
+
+/* Schedule a child sbuf found by a recursive scanner.
+ * The child becomes a task whose priority is its depth, so that a worker finishes the subtree it is working on
+ * before it starts on anything else, while idle workers steal the shallowest (largest) subtrees.
+ * A child usually points into its parent's memory, so the child's deleter holds a reference to the parent.
+ * The parent is therefore not deleted until all of its children, grandchildren, and so on have been deleted.
+ */
+void scanner_set::recurse(const scanner_params &sp, sbuf_t *child)
+{
+    if (current_phase != scanner_params::PHASE_SCAN){
+        throw std::runtime_error("recurse can only be run in scanner_params::PHASE_SCAN");
+    }
+    std::shared_ptr<const sbuf_t> parent = sp.sbuf_keepalive;
+    if (!pool || !parent) {
+        /* The caller owns the parent, so the child must be finished before we return */
+        std::unique_ptr<const sbuf_t> owned(child);
+        scan_sbuf(*owned, nullptr);
+        return;
+    }
+    std::shared_ptr<const sbuf_t> owned(child, [parent](const sbuf_t *p){ delete p; });
+    pool->submit( [this, owned]{ scan_sbuf(*owned, owned); }, owned->depth() );
+}
+
+void scanner_set::set_scanner_budget_ms(uint64_t ms)
+{
+    if (current_phase != scanner_params::PHASE_INIT){
+        throw std::runtime_error("set_scanner_budget_ms can only be run in scanner_params::PHASE_INIT");
+    }
+    scanner_budget_ns = ms * 1000 * 1000;
+}
+
+void scanner_set::set_sbuf_budget_ms(uint64_t ms)
+{
+    if (current_phase != scanner_params::PHASE_INIT){
+        throw std::runtime_error("set_sbuf_budget_ms can only be run in scanner_params::PHASE_INIT");
+    }
+    sbuf_budget_ns = ms * 1000 * 1000;
+}
+
+static uint64_t steady_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* The earlier of two deadlines, where 0 means no deadline */
+static uint64_t earliest_deadline(uint64_t a, uint64_t b)
+{
+    if (a==0) return b;
+    if (b==0) return a;
+    return std::min(a, b);
+}
+
+/* The watchdog wakes up several times per budget and marks every thread whose deadline has passed.
+ * The compare-and-swap only succeeds if the thread is still running the scanner that the deadline was set for.
+ */
+void scanner_set::watchdog_main()
+{
+    uint64_t budget = (scanner_budget_ns && sbuf_budget_ns) ? std::min(scanner_budget_ns, sbuf_budget_ns)
+        : std::max(scanner_budget_ns, sbuf_budget_ns);
+    auto tick = std::chrono::nanoseconds( std::clamp<uint64_t>(budget/4, 1000*1000, 100*1000*1000));
+
+    std::unique_lock<std::mutex> lock(Mwatchdog);
+    while (!watchdog_cv.wait_for(lock, tick, [this]{ return watchdog_stop; })) {
+        const uint64_t now = steady_ns();
+        const std::lock_guard<std::mutex> slock(Mstats);
+        for (auto &it: thread_states) {
+            uint64_t deadline = it.second->deadline;
+            if (deadline != 0 && (deadline & scanner_params::CANCELLED)==0 && deadline < now) {
+                it.second->deadline.compare_exchange_strong(deadline, deadline | scanner_params::CANCELLED);
+            }
+        }
+    }
+}
+
+void scanner_set::stop_watchdog()
+{
+    if (watchdog.joinable()) {
+        {
+            const std::lock_guard<std::mutex> lock(Mwatchdog);
+            watchdog_stop = true;
+        }
+        watchdog_cv.notify_all();
+        watchdog.join();
+    }
+}
+
+/* Wait for the pool to empty. With no pool, every sbuf was processed when it was submitted. */
+void scanner_set::drain()
+{
+    if (pool) {
+        pool->drain();
+    }
 }
 
 
 
+/****************************************************************
+ *** scanner_stats
+ ****************************************************************/
+
+/* Values below 2^LATENCY_SUB_BITS get their own bucket. Above that, the top bit picks the power of two
+ * and the next LATENCY_SUB_BITS bits pick the bucket within it.
+ */
+unsigned int scanner_set::stats::latency_bucket(uint64_t ns)
+{
+    if (ns < (1U << LATENCY_SUB_BITS)) {
+        return ns;
+    }
+    unsigned int top = 63 - __builtin_clzll(ns);
+    unsigned int sub = (ns >> (top - LATENCY_SUB_BITS)) & ((1U << LATENCY_SUB_BITS) - 1);
+    return ((top - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + sub;
+}
+
+uint64_t scanner_set::stats::bucket_floor(unsigned int bucket)
+{
+    if (bucket < (1U << LATENCY_SUB_BITS)) {
+        return bucket;
+    }
+    unsigned int top = (bucket >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1U << LATENCY_SUB_BITS) - 1);
+    return ((1ULL << LATENCY_SUB_BITS) + sub) << (top - LATENCY_SUB_BITS);
+}
+
+void scanner_set::stats::add(uint64_t ns_, uint64_t bytes_)
+{
+    calls += 1;
+    ns    += ns_;
+    bytes += bytes_;
+    latency[latency_bucket(ns_)] += 1;
+}
+
+scanner_set::stats &scanner_set::stats::operator+=(const stats &that)
+{
+    calls += that.calls;
+    ns    += that.ns;
+    bytes += that.bytes;
+    for (unsigned int i=0; i<LATENCY_BUCKETS; i++) {
+        latency[i] += that.latency[i];
+    }
+    return *this;
+}
+
+uint64_t scanner_set::stats::percentile(double p) const
+{
+    uint64_t want = static_cast<uint64_t>(p * calls / 100.0 + 0.5);
+    if (want == 0) want = 1;
+    uint64_t seen = 0;
+    for (unsigned int i=0; i<LATENCY_BUCKETS; i++) {
+        seen += latency[i];
+        if (seen >= want) {
+            return i < latency_bucket(UINT64_MAX) ? bucket_floor(i+1) - 1 : UINT64_MAX;
+        }
+    }
+    return 0;                           // no calls
+}
+
+/* Only the owning thread writes a thread_stats, so a relaxed load and store is enough to add to a counter */
+static inline void add_relaxed(std::atomic<uint64_t> &counter, uint64_t value)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+void scanner_set::thread_stats::add(uint64_t ns_, uint64_t bytes_)
+{
+    add_relaxed(calls, 1);
+    add_relaxed(ns, ns_);
+    add_relaxed(bytes, bytes_);
+    add_relaxed(latency[stats::latency_bucket(ns_)], 1);
+}
+
+void scanner_set::thread_stats::add_to(stats &total) const
+{
+    total.calls += calls.load(std::memory_order_relaxed);
+    total.ns    += ns.load(std::memory_order_relaxed);
+    total.bytes += bytes.load(std::memory_order_relaxed);
+    for (unsigned int i=0; i<stats::LATENCY_BUCKETS; i++) {
+        total.latency[i] += latency[i].load(std::memory_order_relaxed);
+    }
+}
+
+/* Find this thread's state, creating it the first time the thread scans for this scanner_set.
+ * The last one used is cached in the thread, so the mutex is only taken when the thread changes scanner_sets.
+ */
+scanner_set::thread_state_t &scanner_set::get_thread_state()
+{
+    static thread_local uint64_t       cached_id {0};
+    static thread_local thread_state_t *cached   {nullptr};
+    if (cached_id != ss_id) {
+        const std::lock_guard<std::mutex> lock(Mstats);
+        auto &ts = thread_states[std::this_thread::get_id()];
+        if (!ts) {
+            ts = std::make_unique<thread_state_t>(dispatch.size());
+        }
+        cached_id = ss_id;
+        cached    = ts.get();
+    }
+    return *cached;
+}
+
+std::map<std::string, scanner_set::stats> scanner_set::get_scanner_stats() const
+{
+    std::map<std::string, stats> ret;
+    const std::lock_guard<std::mutex> lock(Mstats);
+    for (const auto &it: thread_states) {
+        const thread_stats_t &ts = it.second->stats;
+        for (size_t i=0; i<ts.size() && i<dispatch.size(); i++) {
+            ts[i].add_to(ret[dispatch[i].name]);
+        }
+    }
+    return ret;
+}
+
+
 /****************************************************************
  *** PHASE_SHUTDOWN methods.
  ****************************************************************/
@@ -425,6 +750,12 @@ void scanner_set::shutdown()
     if (current_phase != scanner_params::PHASE_SCAN){
         throw std::runtime_error("shutdown can only be called in scanner_params::PHASE_SCAN");
     }
+
+    /* Finish any sbufs still in the pool and stop the workers before the scanners are told to shut down */
+    drain();
+    pool.reset();
+    stop_watchdog();
+
     current_phase = scanner_params::PHASE_SHUTDOWN;
 
     /* Tell the scanners we are shutting down */
@@ -443,12 +774,18 @@ void scanner_set::shutdown()
     /* Output the scanner stats */
     if (writer) {
         writer->push("scanner_stats");
-        for( auto it: scanner_stats ){
+        for( const auto &it: get_scanner_stats() ){
+            const stats &st = it.second;
             writer->set_oneline("true");
             writer->push("scanner");
-            writer->xmlout("name", get_scanner_name(it.first));
-            writer->xmlout("ns", it.second->ns);
-            writer->xmlout("calls", it.second->calls);
+            writer->xmlout("name", it.first);
+            writer->xmlout("calls", static_cast<int64_t>(st.calls));
+            writer->xmlout("ns", static_cast<int64_t>(st.ns));
+            writer->xmlout("bytes", static_cast<int64_t>(st.bytes));
+            writer->xmlout("p50_ns", static_cast<int64_t>(st.percentile(50)));
+            writer->xmlout("p90_ns", static_cast<int64_t>(st.percentile(90)));
+            writer->xmlout("p99_ns", static_cast<int64_t>(st.percentile(99)));
+            writer->xmlout("p999_ns", static_cast<int64_t>(st.percentile(99.9)));
             writer->pop();
         }
         writer->pop();
@@ -468,6 +805,11 @@ void update_maximum(std::atomic<T>& maximum_value, T const& value) noexcept
 
 /* Process an sbuf! */
 void scanner_set::process_sbuf(const class sbuf_t &sbuf)
+{
+    scan_sbuf(sbuf, nullptr);
+}
+
+void scanner_set::scan_sbuf(const sbuf_t &sbuf, std::shared_ptr<const sbuf_t> owner)
 {
     /* If we  have not transitioned to PHASE::SCAN, error */
     if (current_phase != scanner_params::PHASE_SCAN){
@@ -490,14 +832,18 @@ void scanner_set::process_sbuf(const class sbuf_t &sbuf)
 
     update_maximum<unsigned int>(max_depth_seen, sbuf.depth() );
 
+    /* Profile the sbuf: one pass computes the digest and the ngram period.
+     * The profile is cached in the sbuf, so the scanners can use it too.
+     */
+    const sbuf_profile &profile = sbuf.profile(fs.dedup_digest_alg());
+
     /* Determine if we have seen this buffer before */
     bool seen_before = fs.check_previously_processed(sbuf);
     if (seen_before) {
-        dfxml::sha1_t sha1 = dfxml::sha1_generator::hash_buf(sbuf.buf, sbuf.bufsize);
         std::stringstream ss;
         ss << "<buflen>" << sbuf.bufsize  << "</buflen>";
         if(dup_data_alerts) {
-            fs.get_alert_recorder().write(sbuf.pos0,"DUP SBUF "+sha1.hexdigest(),ss.str());
+            fs.get_alert_recorder().write(sbuf.pos0,"DUP SBUF "+profile.hexdigest(),ss.str());
         }
         dup_bytes_encountered += sbuf.bufsize;
     }
@@ -507,7 +853,7 @@ void scanner_set::process_sbuf(const class sbuf_t &sbuf)
      * such sbufs are booring.)
      */
 
-    size_t ngram_size = sbuf.find_ngram_size( max_ngram );
+    size_t ngram_size = sbuf.find_ngram_size( max_ngram ); // answered from the profile
 
     /****************************************************************
      *** CALL EACH OF THE SCANNERS ON THE SBUF
@@ -519,66 +865,58 @@ void scanner_set::process_sbuf(const class sbuf_t &sbuf)
     }
 #endif
 
-    for (auto it: scanner_info_db) {
-        // Look for reasons not to run a scanner
-        if (enabled_scanners.find(it.first) == enabled_scanners.end()){
-            continue;                       //  not enabled
-        }
+    const int cls = (sbuf.depth() > 0 ? DISPATCH_DEEP : 0)
+        | (ngram_size > 0 ? DISPATCH_NGRAM : 0)
+        | (seen_before ? DISPATCH_SEEN : 0);
 
-        if ( ngram_size>0  && it.second->scanner_flags.scan_ngram_buffer==false ){
-            continue;
-        }
+    /* One scanner_params serves every scanner that is called on this sbuf; it is reset before each call */
+    scanner_params sp(*this, scanner_params::PHASE_SCAN, sbuf, scanner_params::PrintOptions());
 
-        if ( sbuf.depth() > 0 && it.second->scanner_flags.depth_0) {
-            // depth >0 and this scanner only run at depth 0
-            continue;
-        }
+    thread_state_t &my_state = get_thread_state();
 
-        if ( seen_before && it.second->scanner_flags.scan_seen_before==false ){
+    /* If this sbuf is a child being scanned in the thread that found it, the deadline of the scanner
+     * that found it still applies.
+     */
+    const uint64_t outer_deadline = my_state.deadline & ~scanner_params::CANCELLED;
+    const uint64_t sbuf_deadline  = earliest_deadline(outer_deadline,
+                                                      sbuf_budget_ns ? steady_ns() + sbuf_budget_ns : 0);
+    size_t remaining = dispatch_plan[cls].size();
+
+    /* Find out which of the prefiltered scanners have a signature in this sbuf */
+    std::vector<uint8_t> prefilter_hits;
+    if (dispatch_prefiltered[cls]) {
+        prefilter_sbuf(sbuf, prefilter_hits);
+    }
+
+    for (const auto index: dispatch_plan[cls]) {
+        const dispatch_entry_t &entry = dispatch[index];
+        const std::string &name = entry.name;
+        if (entry.prefiltered && prefilter_hits[index]==0) {
+            remaining -= 1;
             continue;
         }
-
-        const std::string &name = it.second->name;
-
-        try {
-
-            /* Compute the effective path for stats */
-            bool inname=false;
-            std::string epath;
-            for( auto cc: sbuf.pos0.path){
-                if (isupper(cc)) inname=true;
-                if (inname) epath.push_back(toupper(cc));
-                if (cc=='-') inname=false;
+        const uint64_t t0 = steady_ns();
+        if (sbuf_deadline != 0 && t0 > sbuf_deadline) {
+            std::stringstream ss;
+            ss << "<budget_exceeded skipped='" << remaining << "'/>";
+            try {
+                fs.get_alert_recorder().write(sbuf.pos0, "sbuf_budget", ss.str());
             }
-            if (epath.size()>0) epath.push_back('-');
-            for (auto cc:name){
-                epath.push_back(toupper(cc));
+            catch (feature_recorder_set::NoSuchFeatureRecorder &e){
             }
-
-            /* Create a RCB that will recursively call process_sbuf() */
-            //recursion_control_block rcb(process_sbuf, upperstr(name));
-
+            break;
+        }
+        remaining -= 1;
+        my_state.deadline = earliest_deadline(sbuf_deadline, scanner_budget_ns ? t0 + scanner_budget_ns : 0);
+        sp.reset(owner, &my_state.deadline); // nothing the last scanner did to sp is seen by this one
+        try {
             /* Call the scanner.*/
-            {
-                aftimer t;
 #if 0
-                if (debug & DEBUG_PRINT_STEPS){
-                    std::cerr << "sbuf.pos0=" << sbuf.pos0 << " calling scanner " << name << "\n";
-                }
-#endif
-                t.start();
-                scanner_params sp(*this, scanner_params::PHASE_SCAN, sbuf, scanner_params::PrintOptions());
-                (*it.first)( sp );
-                t.stop();
-#if 0
-                if (debug & DEBUG_PRINT_STEPS){
-                    std::cerr << "sbuf.pos0=" << sbuf.pos0 << " scanner "
-                              << name << " t=" << t.elapsed_seconds() << "\n";
-                }
-#endif
-                // fs.add_stats(epath,t.elapsed_seconds());
+            if (debug & DEBUG_PRINT_STEPS){
+                std::cerr << "sbuf.pos0=" << sbuf.pos0 << " calling scanner " << name << "\n";
             }
-
+#endif
+            (*entry.scanner)( sp );
         }
         catch (const std::exception &e ) {
             std::stringstream ss;
@@ -606,7 +944,23 @@ void scanner_set::process_sbuf(const class sbuf_t &sbuf)
             catch (feature_recorder_set::NoSuchFeatureRecorder &e){
             }
         }
+        const uint64_t t1 = steady_ns();
+        my_state.stats[index].add( t1-t0, sbuf.bufsize );
+
+        if ((my_state.deadline & scanner_params::CANCELLED) || (scanner_budget_ns && t1-t0 > scanner_budget_ns)) {
+            std::stringstream ss;
+            ss << "<budget_exceeded ns='" << t1-t0 << "' bufsize='" << sbuf.bufsize << "'/>";
+            try {
+                fs.get_alert_recorder().write(sbuf.pos0, "scanner="+name, ss.str());
+            }
+            catch (feature_recorder_set::NoSuchFeatureRecorder &e){
+            }
+        }
     }
+
+    /* Give the enclosing scanner, if any, its own deadline back */
+    my_state.deadline = (outer_deadline != 0 && steady_ns() > outer_deadline)
+        ? (outer_deadline | scanner_params::CANCELLED) : outer_deadline;
 }
 
 
@@ -8,11 +8,17 @@
 #include <string>
 #include <vector>
 #include <sstream>
+#include <memory>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
 #include "scanner_params.h"
 #include "scanner_config.h"
 #include "sbuf.h"
-#include "atomic_map.h"
+#include "thread_pool.h"
 
 /**
  * \file
@@ -31,14 +37,13 @@
  * 5. Scanners are shutdown.
  * 6. Histograms are written out.
  *
- * Scanners are called with two parameters:
- * A reference to a scanner_params (SP) object.
- * A reference to a recursion_control_block (RCB) object.
+ * Scanners are called with a reference to a scanner_params (SP) object.
  *
- * On startup, each scanner is called with a special SP and RCB.
+ * On startup, each scanner is called with a special SP.
  * The scanners respond by setting fields in the SP and returning.
  *
- * When executing, once again each scanner is called with the SP and RCB.
+ * When executing, once again each scanner is called with the SP.
+ * A recursive scanner hands each child sbuf that it decodes to sp.recurse(), which schedules it.
  * This is the only file that needs to be included for a scanner.
  *
  * \li \c phase_startup - scanners are loaded and register the names of the feature files they want.
@@ -48,8 +53,8 @@
  * The scanner_set references the feature_recorder_set, which is a set of feature_recorder objects.
  *
  * The scanner_set controls running of the scanners. It can run in a single-threaded mode, having a single
- * sbuf processed recursively within a single thread.
- * TODO: or it can be called with a threadpool.
+ * sbuf processed recursively within a single thread, or it can own a work-stealing thread_pool.
+ * In the second mode, the caller hands page sbufs to submit_sbuf() and calls drain() to wait for them.
  */
 
 #include "packet_info.h"
@@ -76,12 +81,67 @@ class scanner_set {
     std::map<scanner_t *, const struct scanner_params::scanner_info *>scanner_info_db {};
     std::set<scanner_t *> enabled_scanners {};    // the scanners that are enabled
 
-    // scanner_stats
+public:
+    /* scanner_stats: performance counters for one scanner.
+     * Latency is kept in an HDR-style histogram: each power of two of nanoseconds is split into
+     * 2^LATENCY_SUB_BITS linear buckets, so a bucket is never more than 25% wide.
+     */
     struct stats {
-        std::atomic<uint64_t> ns    {0};    // nanoseconds
-        std::atomic<uint64_t> calls {0}; // calls
+        static const unsigned int LATENCY_SUB_BITS = 2;
+        static const unsigned int LATENCY_BUCKETS  = 64 << LATENCY_SUB_BITS;
+        uint64_t calls {0};
+        uint64_t ns    {0};             // nanoseconds
+        uint64_t bytes {0};             // size of the sbufs scanned
+        std::array<uint64_t, LATENCY_BUCKETS> latency {};
+
+        static unsigned int latency_bucket(uint64_t ns);
+        static uint64_t bucket_floor(unsigned int bucket); // smallest latency counted in bucket
+        void     add(uint64_t ns, uint64_t bytes);
+        stats    &operator+=(const stats &that);
+        uint64_t percentile(double p) const; // upper bound in ns of the p'th percentile latency (0<p<=100)
+    };
+
+private:
+    /* The counters of one scanner in one thread. Only that thread writes them, so add() uses relaxed
+     * loads and stores rather than locked read-modify-writes. They are atomic so that get_scanner_stats()
+     * can read them while the thread is scanning.
+     */
+    struct thread_stats {
+        std::atomic<uint64_t> calls {0};
+        std::atomic<uint64_t> ns    {0};
+        std::atomic<uint64_t> bytes {0};
+        std::array<std::atomic<uint64_t>, stats::LATENCY_BUCKETS> latency {};
+
+        void     add(uint64_t ns, uint64_t bytes);
+        void     add_to(stats &total) const;
     };
-    atomic_map<scanner_t *,struct stats *> scanner_stats {}; // maps scanner name to performance stats
+
+    /* Each thread that scans gets its own thread_state_t:
+     * - stats, indexed like dispatch, so threads never share a counter. They are only added together when
+     *   they are reported.
+     * - deadline, when the scanner the thread is running must finish, as steady_clock nanoseconds
+     *   (0 if there is no budget). The watchdog sets scanner_params::CANCELLED in it when it passes.
+     */
+    typedef std::vector<thread_stats> thread_stats_t;
+    struct thread_state_t {
+        explicit thread_state_t(size_t count):stats(count){}
+        thread_stats_t        stats;
+        std::atomic<uint64_t> deadline {0};
+    };
+    mutable std::mutex Mstats {};       // protects thread_states
+    std::map<std::thread::id, std::unique_ptr<thread_state_t>> thread_states {};
+    const uint64_t ss_id;               // tells this scanner_set apart from others in the thread-local cache
+    thread_state_t &get_thread_state();
+
+    /* Budgets, in nanoseconds. 0 means no budget. */
+    uint64_t scanner_budget_ns {0};     // for one scanner on one sbuf
+    uint64_t sbuf_budget_ns    {0};     // for all of the scanners on one sbuf, including its recursion
+    std::thread             watchdog {};
+    std::mutex              Mwatchdog {};
+    std::condition_variable watchdog_cv {};
+    bool                    watchdog_stop {false};
+    void     watchdog_main();
+    void     stop_watchdog();
 
 
     // a pointer to every scanner info in all of the scanners.
@@ -107,12 +167,42 @@ class scanner_set {
     class dfxml_writer *writer     {nullptr}; // if provided, a dfxml writer
     scanner_params::phase_t     current_phase {scanner_params::PHASE_INIT};
 
+    unsigned int worker_count      {0};       // 0 means process sbufs in the calling thread
+    std::unique_ptr<thread_pool> pool {};      // created by phase_scan() if worker_count>0
+
+    /* The dispatch plan, compiled by phase_scan().
+     * dispatch holds the enabled scanners. dispatch_plan[] has one list of indexes into dispatch for each
+     * combination of the reasons that an sbuf is not given to a scanner, so scan_sbuf() just walks one list.
+     */
+    struct dispatch_entry_t {
+        scanner_t   *scanner {nullptr};
+        std::string name {};
+        bool        prefiltered {false}; // only called if one of its prefilter_signatures is in the sbuf
+    };
+    enum { DISPATCH_DEEP=1, DISPATCH_NGRAM=2, DISPATCH_SEEN=4, DISPATCH_CLASSES=8 };
+    std::vector<dispatch_entry_t> dispatch {};
+    std::vector<uint32_t> dispatch_plan[DISPATCH_CLASSES] {};
+    bool     dispatch_prefiltered[DISPATCH_CLASSES] {}; // true if any scanner in the plan is prefiltered
+    void     compile_dispatch_plan();
+
+    /* The prefilter signatures of all of the enabled scanners, indexed by their first byte */
+    struct prefilter_sig_t {
+        std::string signature {};
+        uint32_t    index {0};          // into dispatch
+    };
+    std::array<std::vector<prefilter_sig_t>, 256> prefilter {};
+    size_t   prefiltered_count {0};     // number of dispatch entries that are prefiltered
+    void     prefilter_sbuf(const sbuf_t &sbuf, std::vector<uint8_t> &hits) const;
+
+    /* Scan an sbuf. owner is set if the scheduler owns the sbuf, in which case children may become tasks */
+    void     scan_sbuf(const sbuf_t &sbuf, std::shared_ptr<const sbuf_t> owner);
+
 
 public:;
     /* constructor and destructor */
     scanner_set(const scanner_config &sc,
                 const feature_recorder_set::flags_t &f, class dfxml_writer *writerl=0);
-    virtual ~scanner_set(){};
+    virtual ~scanner_set();
 
     /* PHASE_INIT */
     // Add scanners to the scanner set.
@@ -174,14 +264,28 @@ public:;
     scanner_params::phase_t get_current_phase() const { return current_phase;};
     size_t   histogram_count() const { return fs.histogram_count();};       // passthrough, mostly for debugging
     size_t   feature_recorder_count() const { return fs.feature_recorder_count();};
+    std::map<std::string, stats> get_scanner_stats() const; // per-thread stats added together, by scanner name
 
     // Scanners automatically get initted when they are loaded.
     // They are immediately ready to process sbufs and packets!
     // As soon as sbufs or packets are processed, no new scanners should be added to this scanner set.
 
+    /* Threading. Must be set in PHASE_INIT; the pool is started by phase_scan(). */
+    void     set_worker_count(unsigned int count);
+    unsigned int get_worker_count() const { return worker_count;};
+
+    /* Time budgets. A scanner that runs past a budget is asked to stop through scanner_params::is_cancelled(),
+     * and the overrun is written to the alert recorder. 0 means no budget. Must be set in PHASE_INIT.
+     */
+    void     set_scanner_budget_ms(uint64_t ms); // for each scanner on each sbuf
+    void     set_sbuf_budget_ms(uint64_t ms);    // for all of the scanners on each sbuf; remaining scanners are skipped
+
     /* PHASE SCAN */
     void     phase_scan();              // start the scan phase
     void     process_sbuf(const sbuf_t &sbuf);                              /* process for feature extraction */
+    void     submit_sbuf(sbuf_t *sbuf); // process in a worker (or now, if there are no workers) and then delete sbuf
+    void     drain();                   // wait until every submitted sbuf has been processed
+    void     recurse(const scanner_params &sp, sbuf_t *child); // called by scanner_params::recurse()
     void     process_packet(const be13::packet_info &pi);
     uint32_t get_max_depth_seen() const; // max seen during scan
 
@@ -28,6 +28,7 @@
 #include <string>
 #include <iostream>
 #include <filesystem>
+#include <fstream>
 
 #include "atomic_unicode_histogram.h"
 #include "sbuf.h"
@@ -341,6 +342,117 @@ TEST_CASE( "Third AtomicUnicodeHistogram test", "[histogram]") {
     }
 }
 
+#include <thread>
+TEST_CASE( "AtomicUnicodeHistogram threads", "[histogram]") {
+    histogram_def h1("keys", "k", "", "", "keys", histogram_def::flags_t());
+    AtomicUnicodeHistogram hm(h1);
+
+    /* Enough keys and adds that every thread merges its partial several times */
+    std::vector<std::thread> threads;
+    for (int t=0; t<8; t++) {
+        threads.emplace_back([&hm]() {
+            for (int i=0; i<100000; i++) {
+                hm.add("key" + std::to_string(i % 5000));
+            }
+        });
+    }
+    for (auto &th: threads) {
+        th.join();
+    }
+    AtomicUnicodeHistogram::auh_t::report r = hm.makeReport(0);
+    REQUIRE( r.size() == 5000 );
+    for (const auto &e: r) {
+        REQUIRE( e.value.count == 8 * 20 );
+    }
+    REQUIRE( r.at(0).key == "key999" );      // same order as before
+    REQUIRE( hm.bytes() > 5000 * 4 );
+    hm.clear();
+    REQUIRE( hm.makeReport(0).size() == 0 );
+}
+
+TEST_CASE( "AtomicUnicodeHistogram topk", "[histogram]") {
+    histogram_def h1("keys", "k", "", "", "keys", histogram_def::flags_t(false, false, 100));
+    AtomicUnicodeHistogram hm(h1);
+
+    /* 10 keys seen 4000 times each, among 200,000 keys seen once. 4000 > 240,000/100, so all 10 must be reported */
+    std::vector<std::thread> threads;
+    for (int t=0; t<4; t++) {
+        threads.emplace_back([&hm, t]() {
+            for (int i=0; i<50000; i++) {
+                hm.add("noise" + std::to_string(t) + "_" + std::to_string(i));
+                if (i % 5 == 0) {
+                    hm.add("heavy" + std::to_string((i / 5) % 10));
+                }
+            }
+        });
+    }
+    for (auto &th: threads) {
+        th.join();
+    }
+    AtomicUnicodeHistogram::auh_t::report r = hm.makeReport(0);
+    REQUIRE( r.size() == 100 );
+    REQUIRE( hm.size() == 100 );
+    for (size_t i=1; i<r.size(); i++) {
+        REQUIRE( r[i-1].value.count >= r[i].value.count );  // highest count first
+    }
+    for (int j=0; j<10; j++) {
+        auto it = std::find_if(r.begin(), r.end(), [j](const auto &e) { return e.key == "heavy" + std::to_string(j); });
+        REQUIRE( it != r.end() );
+        REQUIRE( it->value.count >= 4000 );
+        REQUIRE( it->value.count - it->value.error <= 4000 );
+    }
+    hm.clear();
+    REQUIRE( hm.makeReport(0).size() == 0 );
+}
+
+TEST_CASE( "AtomicUnicodeHistogram parallel sort", "[histogram]") {
+    typedef AtomicUnicodeHistogram::auh_t::AMReportElement element_t;
+    histogram_def h1("keys", "k", "", "", "keys", histogram_def::flags_t());
+    AtomicUnicodeHistogram hm(h1);
+
+    /* 20,000 keys with only 7 different counts, so most of the order comes from the keys */
+    for (int i=0; i<20000; i++) {
+        for (int j=0; j <= i % 7; j++) {
+            hm.add("key" + std::to_string(i));
+        }
+    }
+    for (unsigned int threads : {1U, 2U, 3U, 8U}) {
+        hm.set_sort_threads(threads, 1000); // small pieces, so the pieces are sorted and merged in parallel
+        AtomicUnicodeHistogram::auh_t::report r = hm.makeReport(0);
+        REQUIRE( r.size() == 20000 );
+        AtomicUnicodeHistogram::auh_t::report expected(r.rbegin(), r.rend());
+        std::sort(expected.begin(), expected.end(),
+                  [](const element_t &a, const element_t &b) { return element_t::compare(b, a); });
+        REQUIRE( r == expected );
+    }
+    hm.set_sort_threads(3, 1000);
+    AtomicUnicodeHistogram::auh_t::report r = hm.extractReport();
+    REQUIRE( std::is_sorted(r.begin(), r.end(),
+                            [](const element_t &a, const element_t &b) { return element_t::compare(b, a); }) );
+    REQUIRE( hm.size() == 0 );
+}
+
+
+#include "feature_sketch.h"
+TEST_CASE( "feature_sketch", "[histogram]") {
+    feature_sketch fs;
+    /* key<i> is added i%10+1 times */
+    for (int i=0; i<20000; i++) {
+        for (int j=0; j<=i%10; j++) {
+            fs.add("key" + std::to_string(i));
+        }
+    }
+    for (int i=0; i<20000; i++) {
+        REQUIRE( fs.count("key" + std::to_string(i)) >= uint64_t(i%10+1) );
+    }
+    REQUIRE( fs.count("key0") < 1 + 110000 * 3 / count_min_sketch::WIDTH );
+    REQUIRE( fs.distinct() > 19000 );
+    REQUIRE( fs.distinct() < 21000 );
+    REQUIRE( fs.max_count() >= 10 );
+    fs.clear();
+    REQUIRE( fs.distinct() == 0 );
+    REQUIRE( fs.count("key9") == 0 );
+}
 
 /****************************************************************
  * hash_t.h
@@ -387,6 +499,17 @@ TEST_CASE("quote_if_necessary", "[feature_recorder]") {
     ft.quote_if_necessary(f1,c1);
     REQUIRE( f1=="feature" );
     REQUIRE( c1=="context" );
+
+    /* The string_view version only copies when quoting changes something */
+    std::string buf;
+    std::string_view clean("feature");
+    std::string_view q = ft.quote_if_necessary(clean, 64, buf);
+    REQUIRE( q.data() == clean.data() );
+    REQUIRE( buf.empty() );
+    q = ft.quote_if_necessary("back\\slash", 64, buf);
+    REQUIRE( q == "back\\x5Cslash" );
+    REQUIRE( q.data() == buf.data() );
+    REQUIRE( ft.quote_if_necessary("truncated", 5, buf) == "trunc" );
 }
 
 TEST_CASE("fname in outdir", "[feature_recorder]") {
@@ -471,6 +594,550 @@ TEST_CASE("write_features", "[feature_recorder_set]" ) {
 #endif
 }
 
+TEST_CASE("sharded_output", "[feature_recorder_set]" ) {
+    std::string outdir = get_tempdir() + "/sharded";
+    std::filesystem::create_directory(outdir);
+    {
+        feature_recorder_set::flags_t flags;
+        flags.no_alert = true;
+        flags.sharded_output = true;
+
+        feature_recorder_set fs( flags, "sha1", scanner_config::NO_INPUT, outdir);
+        feature_recorder &fr = fs.named_feature_recorder("test", true);
+        std::vector<std::thread> threads;
+        for (int t=0; t<4; t++) {
+            threads.emplace_back([&fr, t] {
+                for (int i=0; i<100; i++) {
+                    fr.write(pos0_t("", t*1000+i), "feature" + std::to_string(t), "context");
+                }
+            });
+        }
+        for (auto &th: threads) {
+            th.join();
+        }
+        fs.feature_recorders_shutdown();
+    }
+    size_t features = 0;
+    for (const auto &line: getLines(outdir + "/test.txt")) {
+        if (line[0] != '#') features++;
+    }
+    REQUIRE( features == 400 );
+    REQUIRE( std::filesystem::exists(outdir + "/test_shard.txt") == false );
+}
+
+TEST_CASE("async_output", "[feature_recorder_set]" ) {
+    std::string outdir = get_tempdir() + "/async";
+    std::filesystem::create_directory(outdir);
+    {
+        feature_recorder_set::flags_t flags;
+        flags.no_alert = true;
+        flags.async_output = true;
+
+        feature_recorder_set fs( flags, "sha1", scanner_config::NO_INPUT, outdir);
+        REQUIRE( fs.get_async_writer() != nullptr );
+        feature_recorder &fr = fs.named_feature_recorder("test", true);
+        std::vector<std::thread> threads;
+        for (int t=0; t<4; t++) {
+            threads.emplace_back([&fr, t] {
+                for (int i=0; i<1000; i++) {
+                    fr.write(pos0_t("", t*10000+i), "feature" + std::to_string(t), "context");
+                }
+            });
+        }
+        for (auto &th: threads) {
+            th.join();
+        }
+        fs.feature_recorders_shutdown();    // flushes the writer
+        size_t features = 0;
+        for (const auto &line: getLines(outdir + "/test.txt")) {
+            if (line[0] != '#') features++;
+        }
+        REQUIRE( features == 4000 );
+    }
+}
+
+#include "feature_recorder_columnar.h"
+TEST_CASE("record_columnar", "[feature_recorder_set]" ) {
+    std::string outdir = get_tempdir() + "/columnar";
+    std::filesystem::create_directory(outdir);
+    {
+        feature_recorder_set::flags_t flags;
+        flags.no_alert = true;
+        flags.record_files = false;
+        flags.record_columnar = true;
+
+        feature_recorder_set fs( flags, "sha1", scanner_config::NO_INPUT, outdir);
+        feature_recorder &fr = fs.named_feature_recorder("test", true);
+        for (int i=0; i<100000; i++) {
+            if (i % 10 == 0) {
+                fr.write(pos0_t(std::to_string(i) + "-GZIP", i % 100), "gzip" + std::to_string(i), "context");
+            } else {
+                fr.write(pos0_t("", i), "feature" + std::to_string(i), "context");
+            }
+        }
+        fs.feature_recorders_shutdown();
+    }
+    columnar_feature_reader r(outdir + "/test.col");
+    REQUIRE( r.block_count() == 2 );
+    REQUIRE( r.paths().size() == 10001 );
+    size_t rows = 0;
+    for (size_t b=0; b<r.block_count(); b++) {
+        std::vector<std::string> features;
+        std::vector<uint64_t> offsets;
+        std::vector<uint32_t> path_ids;
+        r.read_features(b, features);
+        r.read_offsets(b, offsets);
+        r.read_path_ids(b, path_ids);
+        REQUIRE( features.size() == r.block(b).rows );
+        for (size_t i=0; i<features.size(); i++) {
+            pos0_t pos = r.pos0(path_ids[i], offsets[i]);
+            REQUIRE( pos.imageOffset() == rows + i );
+            REQUIRE( features[i] == (path_ids[i] ? "gzip" : "feature") + std::to_string(rows + i) );
+        }
+        rows += features.size();
+    }
+    REQUIRE( rows == 100000 );
+
+    /* The block index skips blocks outside the offsets asked for */
+    REQUIRE( r.blocks_overlapping(0, 100).size() == 1 );
+    REQUIRE( r.blocks_overlapping(99990, 200000).size() == 1 );
+}
+
+/* Every row of a columnar store, as "path@offset feature" */
+static std::vector<std::string> columnar_rows(const std::string &fname)
+{
+    std::vector<std::string> ret;
+    columnar_feature_reader r(fname);
+    for (size_t b=0; b<r.block_count(); b++) {
+        std::vector<std::string> features;
+        std::vector<uint64_t> offsets;
+        std::vector<uint32_t> path_ids;
+        r.read_features(b, features);
+        r.read_offsets(b, offsets);
+        r.read_path_ids(b, path_ids);
+        REQUIRE( features.size() == r.block(b).rows );
+        for (size_t i=0; i<features.size(); i++) {
+            REQUIRE( path_ids[i] < r.paths().size() );
+            ret.push_back(r.paths()[path_ids[i]] + "@" + std::to_string(offsets[i]) + " " + features[i]);
+        }
+    }
+    return ret;
+}
+
+TEST_CASE("record_columnar reopen", "[feature_recorder_set]" ) {
+    std::string outdir = get_tempdir() + "/columnar_reopen";
+    std::filesystem::create_directory(outdir);
+    const std::string fname = outdir + "/test.col";
+    std::vector<std::string> expected;
+
+    /* Each run writes 1000 features; every 10th has a path, half of them used by the run before */
+    auto run = [&](int n) {
+        feature_recorder_set::flags_t flags;
+        flags.no_alert = true;
+        flags.record_files = false;
+        flags.record_columnar = true;
+        feature_recorder_set fs( flags, "sha1", scanner_config::NO_INPUT, outdir);
+        feature_recorder &fr = fs.named_feature_recorder("test", true);
+        for (int i=0; i<1000; i++) {
+            const std::string path = (i % 10 == 0) ? std::to_string(n*250 + i/2) + "-GZIP" : "";
+            const std::string feature = "run" + std::to_string(n) + "_" + std::to_string(i);
+            fr.write(pos0_t(path, i), feature, "context");
+            expected.push_back(path + "@" + std::to_string(i) + " " + feature);
+        }
+        fs.feature_recorders_shutdown();
+    };
+    run(0);
+    run(1);
+    REQUIRE( columnar_feature_reader(fname).block_count() == 2 );
+    REQUIRE( columnar_feature_reader(fname).paths().size() == 1 + 100 + 50 );
+    REQUIRE( columnar_rows(fname) == expected );
+
+    /* A writer that was killed part of the way through a block: the next run writes over the partial block */
+    const uint64_t valid = std::filesystem::file_size(fname);
+    {
+        std::ifstream in(fname, std::ios::binary);
+        std::string start(200, '\0');
+        in.seekg(8);                    // the first block
+        in.read(start.data(), start.size());
+        std::ofstream out(fname, std::ios::binary | std::ios::app);
+        out.write(start.data(), start.size());
+    }
+    REQUIRE( std::filesystem::file_size(fname) == valid + 200 );
+    REQUIRE( columnar_feature_reader(fname).valid_end() == valid );
+    REQUIRE( columnar_rows(fname) == expected );
+    run(2);
+    REQUIRE( columnar_feature_reader(fname).block_count() == 3 );
+    REQUIRE( columnar_feature_reader(fname).valid_end() == std::filesystem::file_size(fname) );
+    REQUIRE( columnar_rows(fname) == expected );
+}
+
+TEST_CASE("record_columnar threads", "[feature_recorder_set]" ) {
+    std::string outdir = get_tempdir() + "/columnar_threads";
+    std::filesystem::create_directory(outdir);
+    const int THREADS = 4;
+    const int PER_THREAD = 100000;      // about six blocks in all, compressed and written at the same time
+    {
+        feature_recorder_set::flags_t flags;
+        flags.no_alert = true;
+        flags.record_files = false;
+        flags.record_columnar = true;
+        feature_recorder_set fs( flags, "sha1", scanner_config::NO_INPUT, outdir);
+        feature_recorder &fr = fs.named_feature_recorder("test", true);
+        std::vector<std::thread> threads;
+        for (int t=0; t<THREADS; t++) {
+            threads.emplace_back([&fr, t] {
+                for (int i=0; i<PER_THREAD; i++) {
+                    if (i % 10 == 0) {
+                        const std::string path = std::to_string(t*PER_THREAD + i) + "-GZIP";
+                        fr.write(pos0_t(path, i % 100), "in " + path, "context");
+                    } else {
+                        fr.write(pos0_t("", i), "feature" + std::to_string(t), "context");
+                    }
+                }
+            });
+        }
+        for (auto &th: threads) {
+            th.join();
+        }
+        fs.feature_recorders_shutdown();
+    }
+
+    /* Whatever order the blocks were written in, every path id resolves to the path that was written */
+    columnar_feature_reader r(outdir + "/test.col");
+    REQUIRE( r.block_count() > 1 );
+    REQUIRE( r.paths().size() == size_t(1 + THREADS * PER_THREAD / 10) );
+    size_t rows = 0, with_paths = 0;
+    for (size_t b=0; b<r.block_count(); b++) {
+        std::vector<std::string> features;
+        std::vector<uint32_t> path_ids;
+        r.read_features(b, features);
+        r.read_path_ids(b, path_ids);
+        for (size_t i=0; i<features.size(); i++) {
+            REQUIRE( path_ids[i] < r.paths().size() );
+            if (path_ids[i] != 0) {
+                REQUIRE( features[i] == "in " + r.paths()[path_ids[i]] );
+                with_paths++;
+            }
+        }
+        rows += features.size();
+    }
+    REQUIRE( rows == size_t(THREADS * PER_THREAD) );
+    REQUIRE( with_paths == size_t(THREADS * PER_THREAD / 10) );
+}
+
+TEST_CASE("histogram_spill", "[feature_recorder_set]" ) {
+    std::string outdir = get_tempdir() + "/spill";
+    std::filesystem::create_directory(outdir);
+    {
+        feature_recorder_set::flags_t flags;
+        flags.no_alert = true;
+        feature_recorder_set fs( flags, "sha1", scanner_config::NO_INPUT, outdir);
+        fs.opt_histogram_memory = 1;    // spill at every check
+        feature_recorder &fr = fs.named_feature_recorder("test", true);
+        fr.histogram_add(histogram_def("h", "test", "", "", "hist", histogram_def::flags_t()));
+        for (size_t i=0; i < feature_recorder::HISTOGRAM_CHECK_INTERVAL * 3; i++) {
+            fr.write(pos0_t("", i), "key" + std::to_string(i % 1000), "");
+        }
+        REQUIRE( std::filesystem::exists(outdir + "/test_hist_run.txt") );
+        fs.feature_recorders_shutdown();
+        fs.histograms_generate();
+    }
+    /* The runs are merged into the same histogram that makeReport() would have made, and removed */
+    std::vector<std::string> lines {getLines(outdir + "/test_hist.txt")};
+    REQUIRE( lines.size() == 1000 );
+    REQUIRE( lines[0] == "n=" + std::to_string(feature_recorder::HISTOGRAM_CHECK_INTERVAL * 3 / 1000) + "\tkey999" );
+    REQUIRE( !std::filesystem::exists(outdir + "/test_hist_run.txt") );
+}
+
+TEST_CASE("histograms_generate", "[feature_recorder_set]" ) {
+    std::string outdir = get_tempdir() + "/histograms";
+    std::filesystem::create_directory(outdir);
+    {
+        feature_recorder_set::flags_t flags;
+        flags.no_alert = true;
+        feature_recorder_set fs( flags, "sha1", scanner_config::NO_INPUT, outdir);
+        for (int r=0; r<3; r++) {
+            const std::string name = "test" + std::to_string(r);
+            feature_recorder &fr = fs.named_feature_recorder(name, true);
+            fr.histogram_add(histogram_def("h", name, "", "", "hist", histogram_def::flags_t()));
+            fr.histogram_add(histogram_def("d", name, "([0-9]+)", "", "digits", histogram_def::flags_t()));
+            for (int i=0; i<10000; i++) {
+                fr.write(pos0_t("", i), "key" + std::to_string(i % (100 * (r+1))), "");
+            }
+        }
+        fs.feature_recorders_shutdown();
+        fs.histograms_generate(4);
+    }
+    for (int r=0; r<3; r++) {
+        const std::string name = outdir + "/test" + std::to_string(r);
+        REQUIRE( getLines(name + "_hist.txt").size() == size_t(100 * (r+1)) );
+        REQUIRE( getLines(name + "_digits.txt").size() == size_t(100 * (r+1)) );
+    }
+}
+
+#include "feature_sink.h"
+TEST_CASE("feature_sink", "[feature_recorder_set]" ) {
+    std::string outdir = get_tempdir() + "/fanout";
+    std::filesystem::create_directory(outdir);
+    std::atomic<int> callbacks {0};
+    histogram_sink *hs = nullptr;
+    {
+        feature_recorder_set::flags_t flags;
+        flags.no_alert = true;
+        flags.record_files = true;
+        flags.record_columnar = true;
+
+        feature_recorder_set fs( flags, "sha1", scanner_config::NO_INPUT, outdir);
+        feature_recorder &fr = fs.named_feature_recorder("test", true);
+        REQUIRE( fr.sink_count() == 1 ); // the columnar store
+        fr.add_sink(std::make_unique<callback_sink>(
+                        [&callbacks](const pos0_t &pos0, std::string_view feature, std::string_view context) {
+                            REQUIRE( feature == "feature" + std::to_string(pos0.offset % 10) );
+                            REQUIRE( context == "context" );
+                            callbacks++;
+                        }));
+        auto h = std::make_unique<histogram_sink>(histogram_def("h", "test", "", "", "", histogram_def::flags_t()));
+        hs = h.get();
+        fr.add_sink(std::move(h));
+        for (int i=0; i<1000; i++) {
+            fr.write(pos0_t("", i), "feature" + std::to_string(i % 10), "context");
+        }
+        fs.feature_recorders_shutdown();
+        REQUIRE( callbacks == 1000 );
+        AtomicUnicodeHistogram::auh_t::report r = hs->h.makeReport(0);
+        REQUIRE( r.size() == 10 );
+        REQUIRE( r.at(0).value.count == 100 );
+    }
+
+    /* One scan, both outputs */
+    size_t lines = 0;
+    for (const auto &f : FeatureReader(outdir + "/test.txt")) {
+        REQUIRE( f.feature == "feature" + std::to_string(f.offset() % 10) );
+        lines++;
+    }
+    REQUIRE( lines == 1000 );
+    columnar_feature_reader r(outdir + "/test.col");
+    REQUIRE( r.block_count() == 1 );
+    REQUIRE( r.block(0).rows == 1000 );
+
+    /* A callback that writes a feature must not change what the sinks after it get */
+    {
+        feature_recorder_set::flags_t flags;
+        flags.no_alert = true;
+        feature_recorder_set fs( flags, "sha1", scanner_config::NO_INPUT, scanner_config::NO_OUTDIR);
+        feature_recorder &outer = fs.named_feature_recorder("outer", true);
+        feature_recorder &inner = fs.named_feature_recorder("inner", true);
+        outer.add_sink(std::make_unique<callback_sink>(
+                           [&inner](const pos0_t &pos0, std::string_view feature, std::string_view context) {
+                               (void)feature; (void)context;
+                               inner.write(pos0, "nested\\feature", "nested\\context");
+                           }));
+        auto h = std::make_unique<histogram_sink>(histogram_def("h", "outer", "", "", "", histogram_def::flags_t()));
+        hs = h.get();
+        outer.add_sink(std::move(h));
+        outer.write(pos0_t("", 0), "back\\slash", "con\\text");
+        AtomicUnicodeHistogram::auh_t::report r2 = hs->h.makeReport(0);
+        REQUIRE( r2.size() == 1 );
+        REQUIRE( r2.at(0).key == "back\\x5Cslash" );
+    }
+}
+
+#if defined(HAVE_SQLITE3_H) and defined(HAVE_LIBSQLITE3)
+#include <thread>
+TEST_CASE("record_sql", "[feature_recorder_set]" ) {
+    std::string outdir = get_tempdir() + "/sql";
+    std::filesystem::create_directory(outdir);
+    {
+        feature_recorder_set::flags_t flags;
+        flags.no_alert = true;
+        flags.record_files = false;
+        flags.record_sql = true;
+
+        feature_recorder_set fs( flags, "sha1", scanner_config::NO_INPUT, outdir);
+        feature_recorder &fr = fs.named_feature_recorder("test", true);
+        std::vector<std::thread> threads;
+        for (int t=0; t<4; t++) {
+            threads.emplace_back([&fr,t]() {
+                for (int i=0; i<10000; i++) {
+                    fr.write(pos0_t("", t*10000 + i), "feature" + std::to_string(i), "context");
+                }
+            });
+        }
+        for (auto &th: threads) {
+            th.join();
+        }
+        fs.feature_recorders_shutdown();
+    }
+    sqlite3 *db = nullptr;
+    REQUIRE( sqlite3_open_v2((outdir + "/report.sqlite").c_str(), &db, SQLITE_OPEN_READONLY, nullptr) == SQLITE_OK );
+    sqlite3_stmt *stmt = nullptr;
+    REQUIRE( sqlite3_prepare_v2(db, "SELECT COUNT(*), SUM(offset) FROM f_test", -1, &stmt, nullptr) == SQLITE_OK );
+    REQUIRE( sqlite3_step(stmt) == SQLITE_ROW );
+    REQUIRE( sqlite3_column_int64(stmt, 0) == 40000 );
+    REQUIRE( sqlite3_column_int64(stmt, 1) == int64_t(40000) * 39999 / 2 );
+    sqlite3_finalize(stmt);
+    REQUIRE( sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM sqlite_master WHERE type='index' AND tbl_name='f_test'",
+                                -1, &stmt, nullptr) == SQLITE_OK );
+    REQUIRE( sqlite3_step(stmt) == SQLITE_ROW );
+    REQUIRE( sqlite3_column_int(stmt, 0) == 3 );
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+}
+#endif
+
+/****************************************************************
+ * block_writer.h
+ */
+#include "block_writer.h"
+TEST_CASE("block_writer", "[feature_recorder]") {
+    std::string fname = get_tempdir() + "/block_writer.txt";
+    std::filesystem::remove(fname);
+    std::string expected;
+    {
+        block_writer bw(fname);
+        REQUIRE( bw.size() == 0 );
+        /* Lines of every length, so they cross block boundaries */
+        for (size_t i=0; i<100000; i++) {
+            std::string line = std::to_string(i) + std::string(i % 50, 'x') + "\n";
+            bw.write(line);
+            expected += line;
+        }
+        REQUIRE( bw.size() == expected.size() );
+        bw.flush();
+        REQUIRE( std::filesystem::file_size(fname) == expected.size() );
+        bw.write("partial");
+    }
+    REQUIRE( std::filesystem::file_size(fname) == expected.size() + 7 );
+
+    /* Reopening resumes after the last complete line */
+    {
+        block_writer bw(fname, true);
+        bw.resume_after_last_newline();
+        REQUIRE( bw.size() == expected.size() );
+        bw.write("last\n");
+    }
+    expected += "last\n";
+    std::ifstream in(fname, std::ios_base::binary);
+    std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    REQUIRE( contents == expected );
+}
+
+/****************************************************************
+ * zstd_seekable.h and feature_reader.h
+ */
+#include "zstd_seekable.h"
+#include "feature_reader.h"
+TEST_CASE("zstd_seekable", "[feature_recorder]") {
+    std::string fname = get_tempdir() + "/zstd_seekable.txt.zst";
+    std::filesystem::remove(fname);
+    if (!zstd_block_writer::available()) {
+        REQUIRE_THROWS_AS( zstd_block_writer(fname), block_writer::WriteError );
+        REQUIRE( !std::filesystem::exists(fname) );
+        REQUIRE_THROWS_AS( zstd_seekable_reader(fname), zstd_seekable_reader::ReadError );
+        return;
+    }
+    std::string expected = "# banner\n";
+    {
+        zstd_block_writer zw(fname);
+        zw.write(expected);
+        for (size_t i=0; i<100000; i++) {
+            std::string line = std::to_string(i*100) + "\tfeature" + std::to_string(i) + "\tcontext\n";
+            zw.write(line);
+            expected += line;
+        }
+        REQUIRE( zw.size() == expected.size() );
+        zw.flush();
+        REQUIRE( zw.frame_count() > 1 );
+        REQUIRE( std::filesystem::file_size(fname) < expected.size() / 4 );
+        zw.write("partial");
+        zw.flush();                     // leaves a frame that ends in the middle of a line
+    }
+
+    /* Reopening finds the frames and resumes after the last complete line */
+    {
+        zstd_block_writer zw(fname);
+        zw.resume_after_last_newline();
+        REQUIRE( zw.size() == expected.size() );
+        zw.write("10-GZIP-20\tlast\tctx\n");
+    }
+    expected += "10-GZIP-20\tlast\tctx\n";
+
+    /* Random access */
+    zstd_seekable_reader zr(fname);
+    REQUIRE( zr.uncompressed_size() == expected.size() );
+    for (uint64_t offset : {uint64_t(0), uint64_t(zstd_block_writer::FRAME_SIZE - 10), uint64_t(expected.size() - 30)}) {
+        REQUIRE( zr.read(offset, 100) == expected.substr(offset, 100) );
+    }
+
+    /* FeatureReader decompresses transparently */
+    FeatureReader fr(fname);
+    REQUIRE( fr.is_compressed() );
+    size_t count = 0;
+    for (const auto &f : fr) {
+        if (count == 1234) {
+            REQUIRE( f.offset() == 123400 );
+            REQUIRE( f.feature == "feature1234" );
+            REQUIRE( f.context == "context" );
+        }
+        if (count == 100000) {
+            REQUIRE( f.pos0().path == "10-GZIP" );
+            REQUIRE( f.pos0().offset == 20 );
+            REQUIRE( f.feature == "last" );
+        }
+        count++;
+    }
+    REQUIRE( count == 100001 );
+
+    /* The frames can be parsed in parallel */
+    std::atomic<size_t> pcount {0};
+    fr.parallel_for_each([&pcount](const FeatureView &) { pcount++; }, 4);
+    REQUIRE( pcount == 100001 );
+}
+
+TEST_CASE("FeatureReader", "[feature_recorder]") {
+    std::string fname = get_tempdir() + "/feature_reader.txt";
+    {
+        std::ofstream out(fname);
+        out << "# Feature-File-Version: 1.1\n";
+        for (int i=0; i<200000; i++) {
+            out << i << "\tfeature" << i << "\tcontext\n";
+        }
+        out << "100-GZIP-5\tquoted\\x41\\101\tctx\\x42\n";
+        out << "7\tno context";             // no newline at the end
+    }
+    FeatureReader fr(fname);
+    REQUIRE( fr.is_compressed() == false );
+    size_t count = 0;
+    uint64_t offsets = 0;
+    for (const auto &f : fr) {
+        if (count == 200000) {
+            REQUIRE( f.pos == "100-GZIP-5" );
+            REQUIRE( f.pos0().path == "100-GZIP" );
+            REQUIRE( f.offset() == 5 );
+            REQUIRE( f.feature == "quoted\\x41\\101" );  // as written
+            REQUIRE( f.unquoted_feature() == "quotedAA" );
+            REQUIRE( f.unquoted_context() == "ctxB" );
+        }
+        if (count == 200001) {
+            REQUIRE( f.feature == "no context" );
+            REQUIRE( f.context == "" );
+        }
+        offsets += f.offset();
+        count++;
+    }
+    REQUIRE( count == 200002 );
+
+    /* The parallel parse sees the same features */
+    std::atomic<size_t>   pcount {0};
+    std::atomic<uint64_t> poffsets {0};
+    fr.parallel_for_each([&](const FeatureView &f) {
+        pcount++;
+        poffsets += f.offset();
+    }, 4);
+    REQUIRE( pcount == count );
+    REQUIRE( poffsets == offsets );
+}
+
 /****************************************************************
  * char_class.h
  */
@@ -518,6 +1185,13 @@ TEST_CASE( "pos0_t", "[feature_recorder]" ){
     REQUIRE( p1 > p0 );
     REQUIRE( p0 != p1 );
     REQUIRE( p1 == p2 );
+
+    std::string line("x");
+    p0.append_str(line);
+    REQUIRE( line == "x" + p0.str() );
+    line.clear();
+    pos0_t(std::string(""), 42).append_str(line);
+    REQUIRE( line == "42" );
 }
 
 
@@ -567,6 +1241,59 @@ TEST_CASE("hello_sbuf","[sbuf]") {
     REQUIRE(s == "world");
 }
 
+#include "sbuf_profile.h"
+TEST_CASE("sbuf_profile","[sbuf]") {
+    sbuf_t sb1(pos0_t("hello"), hello_buf, strlen(hello), strlen(hello), 0, false);
+    const sbuf_profile &p1 = sb1.profile();
+    REQUIRE( &p1 == &sb1.profile() );   // cached
+    REQUIRE( p1.digest.hexdigest() == hello_sha1 );
+    REQUIRE( p1.histogram['l'] == 3 );
+    REQUIRE( p1.histogram['H'] == 1 );
+    REQUIRE( p1.constant == false );
+    REQUIRE( sb1.find_ngram_size(10) == 0 );
+
+    /* A repeating 3-gram that is longer than the prefix used to find the period */
+    std::string abc;
+    for (int i=0; i<1000; i++) abc += "abc";
+    sbuf_t sb2(pos0_t("abc"), reinterpret_cast<const uint8_t *>(abc.data()), abc.size(), abc.size(), 0, false);
+    REQUIRE( sb2.find_ngram_size(10) == 3 );
+    REQUIRE( sb2.profile().ngram_period == 3 );
+    REQUIRE( sb2.find_ngram_size(10) == 3 );
+    REQUIRE( sb2.profile().ngram_size(3) == 0 );
+
+    /* Break the pattern at the end */
+    abc.back() = 'x';
+    sbuf_t sb3(pos0_t("abx"), reinterpret_cast<const uint8_t *>(abc.data()), abc.size(), abc.size(), 0, false);
+    REQUIRE( sb3.profile().ngram_period == 0 );
+
+    std::string zeros(100000, '\0');
+    sbuf_t sb4(pos0_t("zero"), reinterpret_cast<const uint8_t *>(zeros.data()), zeros.size(), zeros.size(), 0, false);
+    REQUIRE( sb4.profile().zero );
+    REQUIRE( sb4.profile().constant );
+    REQUIRE( sb4.profile().ngram_period == 1 );
+}
+
+TEST_CASE("murmur3","[sbuf]") {
+    const char *fox = "The quick brown fox jumps over the lazy dog";
+    sbuf_t sb(pos0_t("fox"), reinterpret_cast<const uint8_t *>(fox), strlen(fox), strlen(fox), 0, false);
+    const sbuf_profile &p = sb.profile(sbuf_digest_alg::MURMUR3);
+    REQUIRE( p.alg == sbuf_digest_alg::MURMUR3 );
+    REQUIRE( p.hexdigest() == "6c1b07bc7bbc4be347939ac4a93c437a" );
+    REQUIRE( p.key == sbuf_profile::murmur3(reinterpret_cast<const uint8_t *>(fox), strlen(fox)) );
+}
+
+TEST_CASE("is_constant","[sbuf]") {
+    std::string zeros(100000, '\0');
+    zeros[99990] = 'x';
+    sbuf_t sb(pos0_t("zero"), reinterpret_cast<const uint8_t *>(zeros.data()), zeros.size(), zeros.size(), 0, false);
+    REQUIRE( sb.is_constant(0, 99990, 0) );
+    REQUIRE( sb.is_constant(0, 99991, 0) == false );
+    REQUIRE( sb.is_constant(0) == false );
+    REQUIRE( sb.is_constant(99991, 100, 0) ); // reads past the end are 0
+    REQUIRE( sb.find_ngram_size(10) == 0 );
+    REQUIRE( sb.find_ngram_size(1) == 0 );
+}
+
 TEST_CASE("map_file","[sbuf]") {
     std::string tempdir = get_tempdir();
     std::ofstream os;
@@ -748,6 +1475,341 @@ TEST_CASE("run", "[scanner]") {
 }
 
 
+/****************************************************************
+ * thread_pool.h:
+ * The work-stealing executor used by the scanner_set.
+ */
+#include "thread_pool.h"
+TEST_CASE("thread_pool", "[thread_pool]") {
+    REQUIRE_THROWS_AS( thread_pool(0), std::invalid_argument );
+
+    /* Each task submits two children until the tree is 10 deep: 2^11-1 tasks in all */
+    thread_pool tp(4);
+    REQUIRE( tp.size() == 4 );
+    std::atomic<int> count {0};
+    std::function<void(int)> node = [&](int depth) {
+        count += 1;
+        if (depth < 10) {
+            tp.submit( [&node,depth]{ node(depth+1); } );
+            tp.submit( [&node,depth]{ node(depth+1); } );
+        }
+    };
+    tp.submit( [&node]{ node(0); } );
+    tp.drain();
+    REQUIRE( count == 2047 );
+    REQUIRE( tp.outstanding_count() == 0 );
+}
+
+TEST_CASE("thread_pool priority", "[thread_pool]") {
+    /* A worker runs its deepest task first */
+    thread_pool tp(1);
+    std::vector<unsigned int> order;
+    tp.submit( [&]{
+        for (unsigned int p : {1, 3, 2}) {
+            tp.submit( [&order,p]{ order.push_back(p); }, p );
+        }
+    });
+    tp.drain();
+    REQUIRE( order == std::vector<unsigned int>({3, 2, 1}) );
+}
+
+TEST_CASE("submit_sbuf", "[scanner]") {
+    scanner_config sc;
+    sc.outdir = get_tempdir();
+    sc.hash_alg = "sha1";
+    sc.push_scanner_command(std::string("sha1_test"), scanner_config::scanner_command::ENABLE);
+
+    struct feature_recorder_set::flags_t f;
+    scanner_set ss(sc, f);
+    ss.add_scanner(scan_sha1_test);
+    ss.set_worker_count(2);
+    REQUIRE( ss.get_worker_count() == 2 );
+    ss.set_scanner_budget_ms(1000);     // starts the watchdog
+    ss.phase_scan();
+    REQUIRE_THROWS_AS( ss.set_worker_count(4), std::runtime_error );
+    REQUIRE_THROWS_AS( ss.set_sbuf_budget_ms(1000), std::runtime_error );
+    for (int i=0; i<10; i++){
+        ss.submit_sbuf( new sbuf_t(pos0_t("hello"), hello_buf, strlen(hello), strlen(hello), 0, false, false, false));
+    }
+    ss.drain();
+    ss.shutdown();
+}
+
+/* Test scanners that run until they are cancelled (or for 10 seconds), counting their calls */
+static std::atomic<int> slow_calls {0};
+static std::atomic<int> slow_cancelled {0};
+static void slow_scan(scanner_params &sp, scanner_t *scanner, const std::string &name)
+{
+    if (sp.phase==scanner_params::PHASE_INIT) {
+        auto info = new scanner_params::scanner_info();
+        info->scanner = scanner;
+        info->name    = name;
+        sp.register_info(info);
+        return;
+    }
+    if (sp.phase==scanner_params::PHASE_SCAN) {
+        slow_calls += 1;
+        const auto until = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (!sp.is_cancelled() && std::chrono::steady_clock::now() < until) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (sp.is_cancelled()) {
+            slow_cancelled += 1;
+        }
+    }
+}
+static void scan_slow_a(scanner_params &sp) { slow_scan(sp, scan_slow_a, "slow_a"); }
+static void scan_slow_b(scanner_params &sp) { slow_scan(sp, scan_slow_b, "slow_b"); }
+
+/* The alerts whose context contains what */
+static size_t count_alerts(const std::string &outdir, const std::string &what)
+{
+    size_t count = 0;
+    for (const auto &line : getLines(outdir + "/alerts.txt")) {
+        if (line.find(what) != std::string::npos) {
+            count++;
+        }
+    }
+    return count;
+}
+
+TEST_CASE("scanner_budget", "[scanner]") {
+    scanner_config sc;
+    sc.outdir = get_tempdir() + "/scanner_budget";
+    std::filesystem::create_directory(sc.outdir);
+    sc.hash_alg = "sha1";
+    slow_calls = 0;
+    slow_cancelled = 0;
+    {
+        struct feature_recorder_set::flags_t f;
+        scanner_set ss(sc, f);
+        ss.add_scanner(scan_slow_a);
+        ss.set_scanner_budget_ms(50);
+        ss.phase_scan();
+        const auto t0 = std::chrono::steady_clock::now();
+        ss.process_sbuf( hello_sbuf() );
+        REQUIRE( std::chrono::steady_clock::now() - t0 < std::chrono::seconds(5) );
+        ss.shutdown();
+    }
+    /* The watchdog cancelled the scanner, and the overrun was written as an alert */
+    REQUIRE( slow_calls == 1 );
+    REQUIRE( slow_cancelled == 1 );
+    REQUIRE( count_alerts(sc.outdir, "scanner=slow_a\t<budget_exceeded ns=") == 1 );
+}
+
+TEST_CASE("sbuf_budget", "[scanner]") {
+    scanner_config sc;
+    sc.outdir = get_tempdir() + "/sbuf_budget";
+    std::filesystem::create_directory(sc.outdir);
+    sc.hash_alg = "sha1";
+    slow_calls = 0;
+    slow_cancelled = 0;
+    {
+        struct feature_recorder_set::flags_t f;
+        scanner_set ss(sc, f);
+        ss.add_scanner(scan_slow_a);
+        ss.add_scanner(scan_slow_b);
+        ss.set_sbuf_budget_ms(50);
+        ss.phase_scan();
+        ss.process_sbuf( hello_sbuf() );
+        ss.shutdown();
+    }
+    /* Whichever scanner ran first used up the sbuf's budget, so the other one was skipped */
+    REQUIRE( slow_calls == 1 );
+    REQUIRE( slow_cancelled == 1 );
+    REQUIRE( count_alerts(sc.outdir, "sbuf_budget\t<budget_exceeded skipped='1'/>") == 1 );
+}
+
+/* A test scanner that is only called on sbufs that contain a gzip header or MAGIC */
+static std::atomic<int> magic_calls {0};
+static void scan_magic_test(scanner_params &sp)
+{
+    if (sp.phase==scanner_params::PHASE_INIT) {
+        auto info = new scanner_params::scanner_info();
+        info->scanner = scan_magic_test;
+        info->name    = "magic_test";
+        info->prefilter_signatures = { std::string("\x1f\x8b", 2), "MAGIC" };
+        sp.register_info(info);
+        return;
+    }
+    if (sp.phase==scanner_params::PHASE_SCAN) {
+        magic_calls += 1;
+    }
+}
+
+TEST_CASE("prefilter", "[scanner]") {
+    scanner_config sc;
+    sc.outdir = get_tempdir() + "/prefilter";
+    std::filesystem::create_directory(sc.outdir);
+    sc.hash_alg = "sha1";
+    magic_calls = 0;
+
+    struct feature_recorder_set::flags_t f;
+    scanner_set ss(sc, f);
+    ss.add_scanner(scan_magic_test);
+    ss.phase_scan();
+    auto scan = [&ss](const std::string &data) {
+        const int before = magic_calls;
+        ss.process_sbuf( sbuf_t(pos0_t(data), reinterpret_cast<const uint8_t *>(data.data()),
+                                data.size(), data.size(), 0, false, false, false));
+        return magic_calls - before;
+    };
+    REQUIRE( scan("no signature in here") == 0 );
+    REQUIRE( scan("gzip \x1f\x8b\x08 in the middle") == 1 );
+    REQUIRE( scan("half of a gzip header at the very end: \x1f") == 0 );
+    REQUIRE( scan("the signature at the very end: MAGIC") == 1 );
+    REQUIRE( scan("cut off at the very end: MAGI") == 0 );
+    ss.shutdown();
+}
+
+/* Two test scanners that change their scanner_params, which scan_sbuf() reuses for the next scanner */
+static std::atomic<int> meddle_calls {0};
+static std::atomic<int> meddle_leaks {0};
+static void scan_meddle(scanner_params &sp, scanner_t *scanner, const char *name)
+{
+    if (sp.phase==scanner_params::PHASE_INIT) {
+        auto info = new scanner_params::scanner_info();
+        info->scanner = scanner;
+        info->name    = name;
+        sp.register_info(info);
+        return;
+    }
+    if (sp.phase==scanner_params::PHASE_SCAN) {
+        static std::stringstream xml;
+        meddle_calls += 1;
+        if (!sp.print_options.empty() || sp.sxml != nullptr || sp.cancel_token == nullptr) {
+            meddle_leaks += 1;
+        }
+        scanner_params::setPrintMode(sp.print_options, scanner_params::MODE_HEX);
+        sp.sxml = &xml;
+        sp.cancel_token = nullptr;
+    }
+}
+static void scan_meddle_a(scanner_params &sp) { scan_meddle(sp, scan_meddle_a, "meddle_a"); }
+static void scan_meddle_b(scanner_params &sp) { scan_meddle(sp, scan_meddle_b, "meddle_b"); }
+
+TEST_CASE("scanner_params reset", "[scanner]") {
+    scanner_config sc;
+    sc.outdir = get_tempdir() + "/scanner_params_reset";
+    std::filesystem::create_directory(sc.outdir);
+    sc.hash_alg = "sha1";
+    meddle_calls = 0;
+    meddle_leaks = 0;
+
+    struct feature_recorder_set::flags_t f;
+    scanner_set ss(sc, f);
+    ss.add_scanner(scan_meddle_a);
+    ss.add_scanner(scan_meddle_b);
+    ss.phase_scan();
+    ss.process_sbuf( hello_sbuf() );
+    ss.shutdown();
+    REQUIRE( meddle_calls == 2 );
+    REQUIRE( meddle_leaks == 0 );
+}
+
+TEST_CASE("scanner_stats", "[scanner]") {
+    /* Every latency falls in a bucket that starts at or below it and ends above it */
+    for (uint64_t ns : {0ULL, 3ULL, 4ULL, 7ULL, 9ULL, 1000ULL, 123456789ULL}) {
+        unsigned int b = scanner_set::stats::latency_bucket(ns);
+        REQUIRE( scanner_set::stats::bucket_floor(b) <= ns );
+        REQUIRE( ns < scanner_set::stats::bucket_floor(b+1) );
+    }
+    scanner_set::stats st;
+    for (uint64_t ns=1; ns<=100; ns++) {
+        st.add(ns * 1000, 10);
+    }
+    REQUIRE( st.calls == 100 );
+    REQUIRE( st.bytes == 1000 );
+    /* Buckets are at most 25% wide */
+    REQUIRE( st.percentile(50) >= 50000 );
+    REQUIRE( st.percentile(50) <= 50000 * 5 / 4 );
+    REQUIRE( st.percentile(100) >= 100000 );
+}
+
+/****************************************************************
+ * atomic_digest_set.h
+ */
+#include "atomic_digest_set.h"
+TEST_CASE("atomic_digest_set", "[atomic]") {
+    atomic_digest_set ds;
+    digest128_t zero;
+    REQUIRE( ds.check_for_presence_and_insert(zero) == false );
+    REQUIRE( ds.check_for_presence_and_insert(zero) == true );
+    /* Enough digests to make every shard grow several times */
+    for (uint64_t i=1; i<=200000; i++) {
+        digest128_t d;
+        d.hi = i * 0x9e3779b97f4a7c15ULL;
+        d.lo = i * 0xc2b2ae3d27d4eb4fULL;
+        REQUIRE( ds.check_for_presence_and_insert(d) == false );
+    }
+    REQUIRE( ds.size() == 200001 );
+    digest128_t d;
+    d.hi = 7 * 0x9e3779b97f4a7c15ULL;
+    d.lo = 7 * 0xc2b2ae3d27d4eb4fULL;
+    REQUIRE( ds.contains(d) );
+    d.lo += 1;
+    REQUIRE( ds.contains(d) == false );
+}
+
+/****************************************************************
+ * digest_store.h
+ */
+#include "digest_store.h"
+TEST_CASE("digest_store", "[atomic]") {
+    std::string fname = get_tempdir() + "/digests.db";
+    std::filesystem::remove(fname);
+    auto nth = [](uint64_t i) {
+        digest128_t d;
+        d.hi = i * 0x9e3779b97f4a7c15ULL;
+        d.lo = i * 0xc2b2ae3d27d4eb4fULL;
+        return d;
+    };
+    {
+        digest_store ds(fname, 0, 1024);
+        for (uint64_t i=1; i<=600; i++) {
+            REQUIRE( ds.check_for_presence_and_insert(nth(i)) == false );
+        }
+        REQUIRE( ds.check_for_presence_and_insert(nth(7)) == true );
+        REQUIRE( ds.size() == 600 );
+    }
+    /* A second run finds the digests of the first, and grows the store because it is more than half full */
+    {
+        digest_store ds(fname, 0, 1024);
+        REQUIRE( ds.capacity() == 4096 );
+        REQUIRE( ds.size() == 600 );
+        for (uint64_t i=1; i<=600; i++) {
+            REQUIRE( ds.contains(nth(i)) );
+        }
+        REQUIRE( ds.contains(nth(601)) == false );
+        REQUIRE( ds.dropped() == 0 );
+    }
+    REQUIRE_THROWS_AS( digest_store(fname, 1), digest_store::StoreError );
+
+    /* A run that died between its two stores leaves a torn slot; it must not hang or match later lookups */
+    std::filesystem::remove(fname);
+    const digest128_t torn = nth(1000);
+    {
+        digest_store ds(fname, 0, 1024);
+        REQUIRE( ds.check_for_presence_and_insert(nth(1)) == false );
+        const uint64_t slot = (torn.hi | digest_store::OCCUPIED) & (ds.capacity() - 1);
+        const uint64_t words[2] = { torn.hi | digest_store::OCCUPIED, 0 };
+        std::fstream f(fname, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(digest_store::HEADER_SIZE + slot * sizeof(words));
+        f.write(reinterpret_cast<const char *>(words), sizeof(words));
+        f.close();
+        REQUIRE( ds.contains(torn) == false );
+        REQUIRE( ds.check_for_presence_and_insert(torn) == false );
+        REQUIRE( ds.contains(torn) );
+    }
+    /* The next exclusive open drops the torn slot and keeps the complete ones */
+    {
+        digest_store ds(fname, 0, 1024);
+        REQUIRE( ds.size() == 2 );
+        REQUIRE( ds.contains(nth(1)) );
+        REQUIRE( ds.contains(torn) );
+    }
+}
+
 /****************************************************************
  *  word_and_context_list.h
  */
@@ -786,6 +1848,23 @@ TEST_CASE("unicode_escape", "[unicode]") {
         }
     }
     REQUIRE( validateOrEscapeUTF8("backslash=\\", false, true, false) == "backslash=\\x5C");
+    REQUIRE( hexesc(0xfe) == "\\xFE");
+
+    /* Long strings go through the vector kernels; put the byte to escape at every position */
+    std::string longs(150, 'a');
+    REQUIRE( validateOrEscapeUTF8_unchanged(longs, true) == longs.size() );
+    for (size_t i=0; i<longs.size(); i++) {
+        std::string bad(longs);
+        bad[i] = '\x01';
+        REQUIRE( validateOrEscapeUTF8_unchanged(bad, true) == i );
+        REQUIRE( validateOrEscapeUTF8(bad, true, true, false) == longs.substr(0, i) + "\\x01" + longs.substr(i+1) );
+        bad[i] = '\\';
+        REQUIRE( validateOrEscapeUTF8_unchanged(bad, false) == longs.size() );
+        REQUIRE( validateOrEscapeUTF8_unchanged(bad, true) == i );
+    }
+    std::string mixed = longs + "\xC3\xA9" + longs + "\xE6\x88\x91" + longs;  // multi-byte sequences between runs
+    REQUIRE( validateOrEscapeUTF8_unchanged(mixed, true) == mixed.size() );
+    REQUIRE( validateOrEscapeUTF8_unchanged(mixed + "\xC3", true) == mixed.size() );
 
     /* Try some round-trips */
     std::u32string u32s = U"我想玩";
@@ -0,0 +1,163 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * thread_pool.cpp:
+ * The work-stealing executor. See thread_pool.h for the scheduling rules.
+ */
+
+#include "config.h"
+
+#include <cassert>
+#include <iostream>
+#include <stdexcept>
+
+#include "thread_pool.h"
+
+/* Which pool, and which worker in that pool, the current thread is. */
+static thread_local const thread_pool *tl_pool   {nullptr};
+static thread_local size_t             tl_worker {0};
+
+thread_pool::thread_pool(unsigned int count)
+{
+    if (count==0) {
+        throw std::invalid_argument("thread_pool requires at least one worker");
+    }
+    for (unsigned int i=0; i<count; i++){
+        workers.push_back( std::make_unique<worker_t>() );
+    }
+    /* Start the threads only after all of the deques exist, because a worker may steal from any of them */
+    for (size_t i=0; i<workers.size(); i++){
+        workers[i]->thread = std::thread( &thread_pool::worker_main, this, i );
+    }
+}
+
+thread_pool::~thread_pool()
+{
+    assert(!in_worker());               // a worker cannot join itself; see thread_pool.h
+    drain();
+    stopping = true;
+    {
+        const std::lock_guard<std::mutex> lock(Mwait);
+        work_available.notify_all();
+    }
+    for (auto &w: workers) {
+        if (w->thread.joinable()) {
+            w->thread.join();
+        }
+    }
+}
+
+bool thread_pool::in_worker() const
+{
+    return tl_pool == this;
+}
+
+/* Put a task on the back of a worker's deque and wake up someone to run it. */
+void thread_pool::push(size_t worker, unsigned int priority, task_t &&task)
+{
+    {
+        worker_t &w = *workers[worker];
+        const std::lock_guard<std::mutex> lock(w.M);
+        if (w.levels.size() <= priority) {
+            w.levels.resize(priority+1);
+        }
+        w.levels[priority].push_back( std::move(task) );
+        queued += 1;                    // under the lock, so that no thief can take the task and decrement first
+    }
+    /* Take the lock so that a worker that is about to wait cannot miss the notification */
+    const std::lock_guard<std::mutex> lock(Mwait);
+    work_available.notify_one();
+}
+
+/* Newest task from the deepest level of our own deques */
+bool thread_pool::pop_local(size_t me, task_t &task)
+{
+    worker_t &w = *workers[me];
+    const std::lock_guard<std::mutex> lock(w.M);
+    for (auto it = w.levels.rbegin(); it != w.levels.rend(); ++it) {
+        if (!it->empty()) {
+            task = std::move(it->back());
+            it->pop_back();
+            queued -= 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Oldest task from the shallowest level of somebody else's deques.
+ * Start with our neighbor so that thieves spread out.
+ */
+bool thread_pool::steal(size_t me, task_t &task)
+{
+    for (size_t i=1; i<workers.size(); i++) {
+        worker_t &victim = *workers[(me+i) % workers.size()];
+        const std::lock_guard<std::mutex> lock(victim.M);
+        for (auto &level: victim.levels) {
+            if (!level.empty()) {
+                task = std::move(level.front());
+                level.pop_front();
+                queued -= 1;
+                steals += 1;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void thread_pool::run_task(task_t &task)
+{
+    try {
+        task();
+    }
+    catch (const std::exception &e) {
+        std::cerr << "thread_pool: task threw std::exception: " << e.what() << "\n";
+    }
+    catch (...) {
+        std::cerr << "thread_pool: task threw an unknown exception\n";
+    }
+    task = nullptr;                     // release anything the task captured before we report it done
+    if (--outstanding == 0) {
+        const std::lock_guard<std::mutex> lock(Mwait);
+        all_done.notify_all();
+    }
+}
+
+void thread_pool::worker_main(size_t me)
+{
+    tl_pool   = this;
+    tl_worker = me;
+    task_t task;
+    while (true) {
+        if (pop_local(me, task) || steal(me, task)) {
+            run_task(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(Mwait);
+        work_available.wait(lock, [this]{ return queued>0 || stopping; });
+        if (stopping && queued==0) {
+            return;
+        }
+    }
+}
+
+/* Tasks submitted by a worker stay on that worker; everything else is dealt out round-robin. */
+void thread_pool::submit(task_t task, unsigned int priority)
+{
+    outstanding += 1;
+    if (in_worker()) {
+        push(tl_worker, priority, std::move(task));
+    } else {
+        push(next_worker++ % workers.size(), priority, std::move(task));
+    }
+}
+
+void thread_pool::drain()
+{
+    if (in_worker()) {
+        throw std::runtime_error("thread_pool::drain cannot be called from a worker thread");
+    }
+    std::unique_lock<std::mutex> lock(Mwait);
+    all_done.wait(lock, [this]{ return outstanding==0; });
+}
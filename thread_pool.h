@@ -0,0 +1,83 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+/**
+ * \file
+ * thread_pool.h:
+ * A work-stealing executor. It is owned by the scanner_set, which uses it to process sbufs,
+ * but it knows nothing about scanners and can run any task.
+ *
+ * Each worker owns a deque of tasks for each priority level. The scanner_set uses the
+ * recursion depth of an sbuf as its priority.
+ * - A task submitted by a worker (for example, a child sbuf found while scanning) goes onto
+ *   the back of that worker's own deque at its level.
+ * - A worker takes its next task from the back of its own deepest non-empty level (LIFO).
+ *   This finishes a recursion tree on one core while its data is still in the cache, and
+ *   releases the memory of decoded children as soon as possible.
+ * - An idle worker steals from the front of the shallowest non-empty level of another
+ *   worker (FIFO). That task is usually the one with the most work under it.
+ * - A task submitted from outside the pool is given to the workers round-robin.
+ *
+ * Each worker's deques share one mutex, so the only contention is between a worker and a thief.
+ *
+ * The pool must not be destroyed by one of its own tasks, because the destructor joins every worker.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class thread_pool {
+    // A boring class: can't copy or assign it.
+    thread_pool(const thread_pool &)=delete;
+    thread_pool &operator=(const thread_pool &)=delete;
+
+public:
+    typedef std::function<void()> task_t;
+
+private:
+    struct worker_t {
+        std::mutex         M {};        // protects levels
+        std::vector<std::deque<task_t>> levels {}; // levels[priority]; grown on demand
+        std::thread        thread {};
+    };
+    std::vector<std::unique_ptr<worker_t>> workers {};
+
+    std::atomic<uint64_t> outstanding {0};  // tasks submitted but not yet finished
+    std::atomic<uint64_t> queued {0};       // tasks sitting in a deque
+    std::atomic<uint64_t> steals {0};       // number of successful steals, for stats
+    std::atomic<uint32_t> next_worker {0};  // round-robin for tasks submitted from outside
+    std::atomic<bool>     stopping {false};
+
+    std::mutex              Mwait {};       // protects the two condition variables
+    std::condition_variable work_available {};
+    std::condition_variable all_done {};
+
+    void   push(size_t worker, unsigned int priority, task_t &&task);
+    bool   pop_local(size_t me, task_t &task);
+    bool   steal(size_t me, task_t &task);
+    void   run_task(task_t &task);
+    void   worker_main(size_t me);
+
+public:
+    explicit thread_pool(unsigned int count);
+    virtual ~thread_pool();             // drains, then stops the workers. Must not be called from a task.
+
+    size_t   size() const { return workers.size(); }
+    uint64_t steal_count() const { return steals; }
+    uint64_t outstanding_count() const { return outstanding; }
+
+    void     submit(task_t task, unsigned int priority=0); // queue a task. Threadsafe; may be called from a task.
+    void     drain();                   // wait until every task, including tasks submitted by tasks, has finished
+    bool     in_worker() const;         // true if the calling thread is one of this pool's workers
+};
+
+#endif
@@ -37,11 +37,20 @@
 #include "utf8.h"
 
 /**************** BULK_EXTRACTOR 1.0 CODE ****************/
+static const char hexdigits[] = "0123456789ABCDEF";
+
+/* Append the \xFF escape for ch to out */
+static inline void append_hexesc(std::string &out, unsigned char ch)
+{
+    const char esc[4] = {'\\', 'x', hexdigits[ch >> 4], hexdigits[ch & 0x0f]};
+    out.append(esc, sizeof(esc));
+}
+
 std::string hexesc(unsigned char ch)
 {
-    char buf[10];
-    snprintf(buf,sizeof(buf),"\\x%02X",ch);
-    return std::string(buf);
+    std::string ret;
+    append_hexesc(ret, ch);
+    return ret;
 }
 
 /** returns true if this is a UTF8 continuation character */
@@ -89,6 +98,172 @@ bool valid_utf8codepoint(uint32_t unichar)
     return true;                        // must be valid
 }
 
+/**
+ * utf8_sequence_length:
+ * Returns the number of bytes at input[i] that validateOrEscapeUTF8 copies through unchanged:
+ * 1 for a printable ASCII character, 2-4 for a valid multi-byte sequence, or 0 if input[i] must be escaped.
+ */
+static inline size_t utf8_sequence_length(std::string_view input, size_t i, bool escape_backslash)
+{
+    const size_t len = input.size();
+    uint8_t ch = (uint8_t)input[i];
+
+    // utf8 1 byte prefix (0xxx xxxx)
+    if((ch & 0x80)==0x00){          // 00 .. 0x7f
+        if(ch=='\\' && escape_backslash) return 0; // escape the escape character as \x5C
+        if(ch < ' ') return 0;                      // not printable are escaped
+        return 1;                                   // printable is not escaped
+    }
+
+    // utf8 2 bytes  (110x xxxx) prefix
+    if(((ch & 0xe0)==0xc0)  // 2-byte prefix
+       && (i+1 < len)
+       && utf8cont((uint8_t)input[i+1])){
+        uint32_t unichar = (((uint8_t)input[i] & 0x1f) << 6) | (((uint8_t)input[i+1] & 0x3f));
+
+        // check for valid 2-byte encoding
+        if(valid_utf8codepoint(unichar)
+           && ((uint8_t)input[i]!=0xc0)
+           && (unichar >= 0x80)){
+            return 2;
+        }
+    }
+
+    // utf8 3 bytes (1110 xxxx prefix)
+    if(((ch & 0xf0) == 0xe0)
+       && (i+2 < len)
+       && utf8cont((uint8_t)input[i+1])
+       && utf8cont((uint8_t)input[i+2])){
+        uint32_t unichar = (((uint8_t)input[i] & 0x0f) << 12)
+            | (((uint8_t)input[i+1] & 0x3f) << 6)
+            | (((uint8_t)input[i+2] & 0x3f));
+
+        // check for a valid 3-byte code point
+        if(valid_utf8codepoint(unichar)
+           && unichar>=0x800){
+            return 3;
+        }
+    }
+
+    // utf8 4 bytes (1111 0xxx prefix)
+    if((( ch & 0xf8) == 0xf0)
+       && (i+3 < len)
+       && utf8cont((uint8_t)input[i+1])
+       && utf8cont((uint8_t)input[i+2])
+       && utf8cont((uint8_t)input[i+3])){
+        uint32_t unichar =( (((uint8_t)input[i] & 0x07) << 18)
+                            |(((uint8_t)input[i+1] & 0x3f) << 12)
+                            |(((uint8_t)input[i+2] & 0x3f) <<  6)
+                            |(((uint8_t)input[i+3] & 0x3f)));
+
+        if(valid_utf8codepoint(unichar) && unichar>=0x1000000){
+            return 4;
+        }
+    }
+    return 0;
+}
+
+/****************************************************************
+ *** SIMD kernels.
+ *** ascii_run(buf, len, escape_backslash) returns the length of the leading run of printable ASCII
+ *** (0x20..0x7F, and not a backslash if escape_backslash), which validateOrEscapeUTF8 copies unchanged.
+ *** Multi-byte sequences are rare in features, so they are checked one at a time by utf8_sequence_length.
+ *** The best implementation for this CPU is chosen the first time ascii_run is called.
+ ****************************************************************/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define UNICODE_X86_SIMD
+#endif
+
+typedef size_t ascii_kernel_t(const uint8_t *buf, size_t len, bool escape_backslash);
+
+static size_t ascii_run_scalar(const uint8_t *buf, size_t len, bool escape_backslash)
+{
+    size_t i = 0;
+    while (i < len && buf[i] >= ' ' && buf[i] < 0x80 && !(buf[i]=='\\' && escape_backslash)) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef UNICODE_X86_SIMD
+/* Bytes below ' ' and bytes with the high bit set are both less than ' ' when compared as signed chars */
+__attribute__((target("sse2")))
+static size_t ascii_run_sse2(const uint8_t *buf, size_t len, bool escape_backslash)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i bslash = escape_backslash ? _mm_set1_epi8('\\') : _mm_set1_epi8(' '-1);
+    size_t i = 0;
+    for (; i+16 <= len; i+=16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf+i));
+        __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, bslash));
+        unsigned int mask = _mm_movemask_epi8(bad);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + ascii_run_scalar(buf+i, len-i, escape_backslash);
+}
+
+__attribute__((target("avx2")))
+static size_t ascii_run_avx2(const uint8_t *buf, size_t len, bool escape_backslash)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i bslash = escape_backslash ? _mm256_set1_epi8('\\') : _mm256_set1_epi8(' '-1);
+    size_t i = 0;
+    for (; i+64 <= len; i+=64) {
+        __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf+i));
+        __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf+i+32));
+        __m256i bad0 = _mm256_or_si256(_mm256_cmpgt_epi8(space, v0), _mm256_cmpeq_epi8(v0, bslash));
+        __m256i bad1 = _mm256_or_si256(_mm256_cmpgt_epi8(space, v1), _mm256_cmpeq_epi8(v1, bslash));
+        uint64_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(bad0))
+            | (static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(bad1))) << 32);
+        if (mask) return i + __builtin_ctzll(mask);
+    }
+    for (; i+32 <= len; i+=32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf+i));
+        __m256i bad = _mm256_or_si256(_mm256_cmpgt_epi8(space, v), _mm256_cmpeq_epi8(v, bslash));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(bad));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + ascii_run_scalar(buf+i, len-i, escape_backslash);
+}
+#endif
+
+static ascii_kernel_t *select_ascii_kernel()
+{
+#ifdef UNICODE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return ascii_run_avx2;
+    if (__builtin_cpu_supports("sse2")) return ascii_run_sse2;
+#endif
+    return ascii_run_scalar;
+}
+
+static inline size_t ascii_run(const uint8_t *buf, size_t len, bool escape_backslash)
+{
+    static ascii_kernel_t *const kernel = select_ascii_kernel();
+    return (*kernel)(buf, len, escape_backslash);
+}
+
+/* Returns the end of the run starting at i that validateOrEscapeUTF8 copies unchanged */
+static size_t unchanged_run(std::string_view input, size_t i, bool escape_backslash)
+{
+    const uint8_t *buf = reinterpret_cast<const uint8_t *>(input.data());
+    while (i < input.size()) {
+        i += ascii_run(buf+i, input.size()-i, escape_backslash);
+        if (i == input.size()) break;
+        size_t n = utf8_sequence_length(input, i, escape_backslash);
+        if (n==0) break;
+        i += n;
+    }
+    return i;
+}
+
+size_t validateOrEscapeUTF8_unchanged(std::string_view input, bool escape_backslash)
+{
+    return unchanged_run(input, 0, escape_backslash);
+}
+
 /**
  * validateOrEscapeUTF8
  * Input: UTF8 string (possibly corrupt)
@@ -100,97 +275,31 @@ bool valid_utf8codepoint(uint32_t unichar)
  *   - UTF8 string.  If do_escape is set, then corruptions are escaped in \xFF notation where FF is a hex character.
  */
 
-std::string validateOrEscapeUTF8(const std::string &input,
-                                 bool escape_bad_utf8,
-                                 bool escape_backslash,
-                                 bool validateOrEscapeUTF8_validate)
+void validateOrEscapeUTF8(std::string_view input,
+                          bool escape_bad_utf8,
+                          bool escape_backslash,
+                          bool validateOrEscapeUTF8_validate,
+                          std::string &output)
 {
     // skip the validation if not escaping and not DEBUG_PEDANTIC
     if (escape_bad_utf8==false && escape_backslash==false && validateOrEscapeUTF8_validate==false){
-        return input;
+        output.append(input);
+        return;
     }
 
     // validate or escape input
-    std::string output;
-    for(std::string::size_type i = 0; i< input.length(); ) {
-        uint8_t ch = (uint8_t)input.at(i);
-
-        // utf8 1 byte prefix (0xxx xxxx)
-        if((ch & 0x80)==0x00){          // 00 .. 0x7f
-            if(ch=='\\' && escape_backslash){   // escape the escape character as \x92
-                output += hexesc(ch);
-                i++;
-                continue;
-            }
-
-            if( ch < ' '){              // not printable are escaped
-                output += hexesc(ch);
-                i++;
-                continue;
-            }
-            output += ch;               // printable is not escaped
+    for(size_t i = 0; i< input.size(); ) {
+        /* Copy the longest run that needs no escaping in one go */
+        size_t start = i;
+        i = unchanged_run(input, i, escape_backslash);
+        output.append(input.substr(start, i-start));
+        if (i == input.size()) break;
+
+        uint8_t ch = (uint8_t)input[i];
+        if (ch < 0x80 || escape_bad_utf8) {
+            // Control characters and backslashes are always escaped; bad UTF-8 is escaped if requested
+            append_hexesc(output, ch);
             i++;
-            continue;
-        }
-
-        // utf8 2 bytes  (110x xxxx) prefix
-        if(((ch & 0xe0)==0xc0)  // 2-byte prefix
-           && (i+1 < input.length())
-           && utf8cont((uint8_t)input.at(i+1))){
-            uint32_t unichar = (((uint8_t)input.at(i) & 0x1f) << 6) | (((uint8_t)input.at(i+1) & 0x3f));
-
-            // check for valid 2-byte encoding
-            if(valid_utf8codepoint(unichar)
-               && ((uint8_t)input.at(i)!=0xc0)
-               && (unichar >= 0x80)){
-                output += (uint8_t)input.at(i++);       // byte1
-                output += (uint8_t)input.at(i++);       // byte2
-                continue;
-            }
-        }
-
-        // utf8 3 bytes (1110 xxxx prefix)
-        if(((ch & 0xf0) == 0xe0)
-           && (i+2 < input.length())
-           && utf8cont((uint8_t)input.at(i+1))
-           && utf8cont((uint8_t)input.at(i+2))){
-            uint32_t unichar = (((uint8_t)input.at(i) & 0x0f) << 12)
-                | (((uint8_t)input.at(i+1) & 0x3f) << 6)
-                | (((uint8_t)input.at(i+2) & 0x3f));
-
-            // check for a valid 3-byte code point
-            if(valid_utf8codepoint(unichar)
-               && unichar>=0x800){
-                output += (uint8_t)input.at(i++);       // byte1
-                output += (uint8_t)input.at(i++);       // byte2
-                output += (uint8_t)input.at(i++);       // byte3
-                continue;
-            }
-        }
-
-        // utf8 4 bytes (1111 0xxx prefix)
-        if((( ch & 0xf8) == 0xf0)
-           && (i+3 < input.length())
-           && utf8cont((uint8_t)input.at(i+1))
-           && utf8cont((uint8_t)input.at(i+2))
-           && utf8cont((uint8_t)input.at(i+3))){
-            uint32_t unichar =( (((uint8_t)input.at(i) & 0x07) << 18)
-                                |(((uint8_t)input.at(i+1) & 0x3f) << 12)
-                                |(((uint8_t)input.at(i+2) & 0x3f) <<  6)
-                                |(((uint8_t)input.at(i+3) & 0x3f)));
-
-            if(valid_utf8codepoint(unichar) && unichar>=0x1000000){
-                output += (uint8_t)input.at(i++);       // byte1
-                output += (uint8_t)input.at(i++);       // byte2
-                output += (uint8_t)input.at(i++);       // byte3
-                output += (uint8_t)input.at(i++);       // byte4
-                continue;
-            }
-        }
-
-        if (escape_bad_utf8) {
-            // Just escape the next byte and carry on
-            output += hexesc((uint8_t)input.at(i++));
         } else {
             // fatal if we are debug pedantic, otherwise just ignore
             // note: we shouldn't be here anyway, since if we are not escaping and we are not
@@ -201,8 +310,18 @@ std::string validateOrEscapeUTF8(const std::string &input,
                 os.close();
                 throw std::runtime_error("INTERNAL ERROR: bad unicode stored in bad_unicode.txt\n");
             }
+            i++;
         }
     }
+}
+
+std::string validateOrEscapeUTF8(const std::string &input,
+                                 bool escape_bad_utf8,
+                                 bool escape_backslash,
+                                 bool validateOrEscapeUTF8_validate)
+{
+    std::string output;
+    validateOrEscapeUTF8(input, escape_bad_utf8, escape_backslash, validateOrEscapeUTF8_validate, output);
     return output;
 }
 
@@ -8,6 +8,7 @@
 #define UNICODE_ESCAPE_H
 
 #include <string>
+#include <string_view>
 #include <cstdint>
 #include <cstring>
 #include <cwctype>
@@ -47,6 +48,15 @@ struct unicode  {
  */
 std::string validateOrEscapeUTF8(const std::string &input, bool escape_bad_UTF8, bool escape_backslash, bool validate);
 
+/* The same, appending to output, which lets callers reuse a buffer. */
+void validateOrEscapeUTF8(std::string_view input, bool escape_bad_UTF8, bool escape_backslash, bool validate,
+                          std::string &output);
+
+/* Returns how many leading bytes of input validateOrEscapeUTF8 would copy unchanged when escaping.
+ * If it is input.size(), escaping would not change input and it can be used as it is.
+ */
+size_t validateOrEscapeUTF8_unchanged(std::string_view input, bool escape_backslash);
+
 /* Guess if this is valid utf16 and return likely endian */
 bool looks_like_utf16(const std::string &str,bool &little_endian);
 
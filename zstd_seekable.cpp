@@ -0,0 +1,449 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * zstd_seekable.cpp:
+ * Seekable zstd feature files. See zstd_seekable.h.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#define USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "zstd_seekable.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/* The seek table is a skippable frame:
+ *   u32 SKIPPABLE_MAGIC, u32 size of what follows,
+ *   for each frame: u32 compressed size, u32 decompressed size,
+ *   footer: u32 number of frames, u8 descriptor (bit 7: entries have checksums), u32 SEEKABLE_MAGIC
+ * All numbers are little-endian.
+ */
+static const uint32_t ZSTD_FRAME_MAGIC = 0xFD2FB528;
+static const uint32_t SKIPPABLE_MAGIC  = 0x184D2A5E;
+static const uint32_t SEEKABLE_MAGIC   = 0x8F92EAB1;
+static const size_t   SKIPPABLE_HEADER_SIZE = 8;
+static const size_t   SEEK_FOOTER_SIZE = 9;
+static const size_t   MAX_SCAN_WINDOW  = 256*1024*1024; // largest frame that recovery will find
+
+static void put_le32(std::string &out, uint32_t v)
+{
+    char b[4] = { char(v), char(v>>8), char(v>>16), char(v>>24) };
+    out.append(b, 4);
+}
+
+static uint32_t get_le32(const char *p)
+{
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    return uint32_t(u[0]) | uint32_t(u[1])<<8 | uint32_t(u[2])<<16 | uint32_t(u[3])<<24;
+}
+
+#ifdef USE_ZSTD
+typedef std::function<ssize_t(char *, size_t, uint64_t)> pread_fn;
+
+/* Read len bytes at offset, or fewer at the end of the file */
+static size_t read_fully(const pread_fn &rd, char *dst, size_t len, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = rd(dst+done, len-done, offset+done);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        done += r;
+    }
+    return done;
+}
+
+/* Read the seek table at the end of a file of fsize bytes. Returns false if there isn't a valid one. */
+static bool load_seek_table(const pread_fn &rd, uint64_t fsize,
+                            std::vector<zstd_seek_entry> &table, uint64_t &frames_end)
+{
+    if (fsize < SKIPPABLE_HEADER_SIZE + SEEK_FOOTER_SIZE) return false;
+    char footer[SEEK_FOOTER_SIZE];
+    if (read_fully(rd, footer, SEEK_FOOTER_SIZE, fsize-SEEK_FOOTER_SIZE) != SEEK_FOOTER_SIZE) return false;
+    if (get_le32(footer+5) != SEEKABLE_MAGIC) return false;
+    const uint32_t count = get_le32(footer);
+    const uint8_t descriptor = footer[4];
+    if ((descriptor & 0x7f) != 0) return false; // reserved bits
+    const size_t entry_size = (descriptor & 0x80) ? 12 : 8;
+    const uint64_t table_size = SKIPPABLE_HEADER_SIZE + uint64_t(count) * entry_size + SEEK_FOOTER_SIZE;
+    if (table_size > fsize) return false;
+
+    std::string t(table_size, '\0');
+    if (read_fully(rd, t.data(), table_size, fsize-table_size) != table_size) return false;
+    if (get_le32(t.data()) != SKIPPABLE_MAGIC ||
+        get_le32(t.data()+4) != table_size - SKIPPABLE_HEADER_SIZE) return false;
+
+    std::vector<zstd_seek_entry> entries;
+    entries.reserve(count);
+    uint64_t csum = 0;
+    for (uint32_t i=0; i<count; i++) {
+        const char *e = t.data() + SKIPPABLE_HEADER_SIZE + i*entry_size;
+        entries.push_back({get_le32(e), get_le32(e+4)});
+        csum += entries.back().csize;
+    }
+    if (csum != fsize - table_size) return false; // the frames don't fill the file before the table
+    table.swap(entries);
+    frames_end = csum;
+    return true;
+}
+
+/* Find the complete frames at the start of a file that has no seek table */
+static void scan_frames(const pread_fn &rd, uint64_t fsize,
+                        std::vector<zstd_seek_entry> &table, uint64_t &frames_end)
+{
+    table.clear();
+    uint64_t off = 0;
+    size_t window = ZSTD_compressBound(zstd_block_writer::FRAME_SIZE);
+    std::string buf;
+    while (off < fsize) {
+        const size_t want = std::min(static_cast<uint64_t>(window), fsize-off);
+        buf.resize(want);
+        const size_t got = read_fully(rd, buf.data(), want, off);
+        if (got < 4 || get_le32(buf.data()) != ZSTD_FRAME_MAGIC) break; // not a data frame
+        const size_t csize = ZSTD_findFrameCompressedSize(buf.data(), got);
+        if (ZSTD_isError(csize)) {
+            if (got == want && want < fsize-off && window < MAX_SCAN_WINDOW) {
+                window *= 2;            // the frame may be larger than the window
+                continue;
+            }
+            break;                      // incomplete frame
+        }
+        const unsigned long long dsize = ZSTD_getFrameContentSize(buf.data(), got);
+        if (dsize == ZSTD_CONTENTSIZE_UNKNOWN || dsize == ZSTD_CONTENTSIZE_ERROR ||
+            dsize > UINT32_MAX || csize > UINT32_MAX) break; // not written by zstd_block_writer
+        table.push_back({uint32_t(csize), uint32_t(dsize)});
+        off += csize;
+    }
+    frames_end = off;
+}
+
+/* Decompress one whole frame into out */
+static bool decompress_frame(ZSTD_DCtx *dctx, const std::string &cbuf, const zstd_seek_entry &e, std::string &out)
+{
+    out.resize(e.dsize);
+    const size_t r = ZSTD_decompressDCtx(dctx, out.data(), out.size(), cbuf.data(), e.csize);
+    return !ZSTD_isError(r) && r == e.dsize;
+}
+#endif
+
+/****************************************************************
+ *** zstd_block_writer
+ ****************************************************************/
+
+bool zstd_block_writer::available()
+{
+#ifdef USE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+}
+
+#ifdef USE_ZSTD
+zstd_block_writer::zstd_block_writer(const std::string &fname_, int level_):
+    block_writer(fname_, false), level(level_)
+{
+    cctx = ZSTD_createCCtx();
+    if (cctx == nullptr) {
+        throw WriteError(get_fname() + ": cannot create zstd context");
+    }
+    try {
+        recover();
+    } catch (const WriteError &e) {
+        ZSTD_freeCCtx(cctx);
+        throw;
+    }
+}
+#else
+/* Without zstd the constructors always throw */
+#  ifdef HAVE_DIAGNOSTIC_MISSING_NORETURN
+#    pragma GCC diagnostic ignored "-Wmissing-noreturn"
+#  endif
+/* Refuse before block_writer creates the file */
+static const std::string &require_zstd(const std::string &fname)
+{
+    throw block_writer::WriteError(fname + ": zstd compression was not compiled in");
+}
+
+zstd_block_writer::zstd_block_writer(const std::string &fname_, int level_):
+    block_writer(require_zstd(fname_), false), level(level_)
+{
+    throw WriteError(get_fname() + ": zstd compression was not compiled in");
+}
+#  ifdef HAVE_DIAGNOSTIC_MISSING_NORETURN
+#    pragma GCC diagnostic warning "-Wmissing-noreturn"
+#  endif
+#endif
+
+zstd_block_writer::~zstd_block_writer()
+{
+    try {
+        close();
+    } catch (const WriteError &e) {
+    }
+#ifdef USE_ZSTD
+    ZSTD_freeCCtx(cctx);
+#endif
+}
+
+void zstd_block_writer::recover()
+{
+#ifdef USE_ZSTD
+    const uint64_t fsize = block_writer::size();
+    if (fsize == 0) return;
+    pread_fn rd = [this](char *dst, size_t len, uint64_t offset) { return read_at(dst, len, offset); };
+
+    char magic[4];
+    if (read_fully(rd, magic, sizeof(magic), 0) != sizeof(magic) || get_le32(magic) != ZSTD_FRAME_MAGIC) {
+        throw WriteError(get_fname() + ": exists and is not a zstd file");
+    }
+    if (!load_seek_table(rd, fsize, seek_table, frames_end)) {
+        scan_frames(rd, fsize, seek_table, frames_end); // killed before the seek table was written
+    }
+    udata_size = 0;
+    for (const auto &e : seek_table) {
+        udata_size += e.dsize;
+    }
+    truncate(frames_end);               // new frames overwrite the seek table (or a partial frame)
+#endif
+}
+
+/* Frames end on a line, except perhaps the last one if the file was flushed in the middle of a line.
+ * In that case the frame is decompressed, and its complete lines become the start of the next frame.
+ */
+void zstd_block_writer::resume_after_last_newline()
+{
+#ifdef USE_ZSTD
+    if (seek_table.empty()) return;
+    const zstd_seek_entry last = seek_table.back();
+    const uint64_t start = frames_end - last.csize;
+
+    pread_fn rd = [this](char *dst, size_t len, uint64_t offset) { return read_at(dst, len, offset); };
+    std::string frame(last.csize, '\0');
+    if (read_fully(rd, frame.data(), last.csize, start) != last.csize) {
+        throw WriteError(get_fname() + ": cannot read last frame");
+    }
+    std::string data;
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    const bool ok = dctx && decompress_frame(dctx, frame, last, data);
+    ZSTD_freeDCtx(dctx);
+    if (!ok) {
+        throw WriteError(get_fname() + ": cannot decompress last frame");
+    }
+    if (data.empty() || data.back() == '\n') return;
+
+    const size_t nl = data.rfind('\n');
+    data.resize(nl == std::string::npos ? 0 : nl+1);
+    truncate(start);
+    frames_end = start;
+    udata_size -= last.dsize;
+    seek_table.pop_back();
+    pending.insert(0, data);
+#endif
+}
+
+void zstd_block_writer::write_frame(std::string_view data)
+{
+#ifdef USE_ZSTD
+    if (data.size() > UINT32_MAX) {
+        throw WriteError(get_fname() + ": line too long for a zstd frame");
+    }
+    cbuf.resize(ZSTD_compressBound(data.size()));
+    const size_t csize = ZSTD_compressCCtx(cctx, cbuf.data(), cbuf.size(), data.data(), data.size(), level);
+    if (ZSTD_isError(csize)) {
+        throw WriteError(get_fname() + ": " + ZSTD_getErrorName(csize));
+    }
+    block_writer::write(std::string_view(cbuf.data(), csize));
+    seek_table.push_back({uint32_t(csize), uint32_t(data.size())});
+    frames_end += csize;
+    udata_size += data.size();
+#else
+    (void)data;
+#endif
+}
+
+void zstd_block_writer::write_seek_table()
+{
+    std::string t;
+    t.reserve(SKIPPABLE_HEADER_SIZE + seek_table.size()*8 + SEEK_FOOTER_SIZE);
+    put_le32(t, SKIPPABLE_MAGIC);
+    put_le32(t, seek_table.size()*8 + SEEK_FOOTER_SIZE);
+    for (const auto &e : seek_table) {
+        put_le32(t, e.csize);
+        put_le32(t, e.dsize);
+    }
+    put_le32(t, seek_table.size());
+    t.push_back('\0');                  // descriptor: no checksums
+    put_le32(t, SEEKABLE_MAGIC);
+    block_writer::write(t);
+    table_written = true;
+}
+
+void zstd_block_writer::write(std::string_view data)
+{
+    if (table_written) {
+        truncate(frames_end);           // the seek table is rewritten at the next flush
+        table_written = false;
+    }
+    const size_t old_size = pending.size();
+    pending.append(data);
+    if (pending.size() >= FRAME_SIZE) {
+        /* End the frame at the last newline just written, so frames hold whole lines */
+        size_t nl = std::string_view(pending).substr(old_size).rfind('\n');
+        if (nl != std::string_view::npos) {
+            nl += old_size + 1;
+            write_frame(std::string_view(pending).substr(0, nl));
+            pending.erase(0, nl);
+        }
+    }
+}
+
+void zstd_block_writer::flush()
+{
+    if (!pending.empty()) {
+        write_frame(pending);
+        pending.clear();
+    }
+    if (!table_written && !seek_table.empty()) {
+        write_seek_table();
+    }
+    block_writer::flush();
+}
+
+void zstd_block_writer::close()
+{
+    flush();
+    block_writer::close();
+}
+
+/****************************************************************
+ *** zstd_seekable_reader
+ ****************************************************************/
+
+bool zstd_seekable_reader::is_zstd_file(const std::string &fname)
+{
+    int fd = ::open(fname.c_str(), O_RDONLY|O_BINARY);
+    if (fd < 0) return false;
+    char magic[4];
+    const bool ret = (::read(fd, magic, sizeof(magic)) == sizeof(magic) && get_le32(magic) == ZSTD_FRAME_MAGIC);
+    ::close(fd);
+    return ret;
+}
+
+#ifdef USE_ZSTD
+zstd_seekable_reader::zstd_seekable_reader(const std::string &fname_):
+    fname(fname_)
+{
+    fd = ::open(fname.c_str(), O_RDONLY|O_BINARY);
+    if (fd < 0) {
+        throw ReadError(fname + ": " + strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw ReadError(fname + ": " + strerror(errno));
+    }
+    const int rfd = fd;
+    pread_fn rd = [rfd](char *dst, size_t len, uint64_t offset) { return pread(rfd, dst, len, offset); };
+    std::vector<zstd_seek_entry> table;
+    uint64_t frames_end = 0;
+    if (!load_seek_table(rd, st.st_size, table, frames_end)) {
+        scan_frames(rd, st.st_size, table, frames_end); // still being written, or the writer was killed
+    }
+    uint64_t coffset = 0, doffset = 0;
+    for (const auto &e : table) {
+        frames.push_back({coffset, doffset, e});
+        coffset += e.csize;
+        doffset += e.dsize;
+    }
+    dctx = ZSTD_createDCtx();
+    if (dctx == nullptr) {
+        ::close(fd);
+        throw ReadError(fname + ": cannot create zstd context");
+    }
+}
+#else
+#  ifdef HAVE_DIAGNOSTIC_MISSING_NORETURN
+#    pragma GCC diagnostic ignored "-Wmissing-noreturn"
+#  endif
+zstd_seekable_reader::zstd_seekable_reader(const std::string &fname_):
+    fname(fname_)
+{
+    throw ReadError(fname + ": zstd compression was not compiled in");
+}
+#  ifdef HAVE_DIAGNOSTIC_MISSING_NORETURN
+#    pragma GCC diagnostic warning "-Wmissing-noreturn"
+#  endif
+#endif
+
+zstd_seekable_reader::~zstd_seekable_reader()
+{
+#ifdef USE_ZSTD
+    ZSTD_freeDCtx(dctx);
+#endif
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+uint64_t zstd_seekable_reader::uncompressed_size() const
+{
+    return frames.empty() ? 0 : frames.back().doffset + frames.back().size.dsize;
+}
+
+size_t zstd_seekable_reader::frame_for_offset(uint64_t offset) const
+{
+    auto it = std::upper_bound(frames.begin(), frames.end(), offset,
+                               [](uint64_t o, const frame_t &f) { return o < f.doffset; });
+    if (it == frames.begin()) return frames.size();
+    --it;
+    if (offset >= it->doffset + it->size.dsize) return frames.size(); // past the end
+    return it - frames.begin();
+}
+
+void zstd_seekable_reader::read_frame(size_t i, std::string &out)
+{
+#ifdef USE_ZSTD
+    if (i >= frames.size()) {
+        throw ReadError(fname + ": no frame " + std::to_string(i));
+    }
+    const frame_t &f = frames[i];
+    cbuf.resize(f.size.csize);
+    const int rfd = fd;
+    pread_fn rd = [rfd](char *dst, size_t len, uint64_t offset) { return pread(rfd, dst, len, offset); };
+    if (read_fully(rd, cbuf.data(), f.size.csize, f.coffset) != f.size.csize ||
+        !decompress_frame(dctx, cbuf, f.size, out)) {
+        throw ReadError(fname + ": cannot decompress frame " + std::to_string(i));
+    }
+#else
+    (void)i;
+    (void)out;
+#endif
+}
+
+std::string zstd_seekable_reader::read(uint64_t offset, size_t len)
+{
+    std::string ret;
+    std::string frame;
+    for (size_t i = frame_for_offset(offset); i < frames.size() && ret.size() < len; i++) {
+        read_frame(i, frame);
+        const size_t skip = offset + ret.size() - frames[i].doffset;
+        ret.append(frame, skip, len - ret.size());
+    }
+    return ret;
+}
@@ -0,0 +1,110 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef ZSTD_SEEKABLE_H
+#define ZSTD_SEEKABLE_H
+
+/**
+ * \file
+ * zstd_seekable.h:
+ * Compressed feature files (feature_recorder_set::flags_t::compress_output).
+ *
+ * The file is a series of independent zstd frames, each holding about FRAME_SIZE bytes of whole lines,
+ * followed by a seek table in the zstd "seekable format" (a skippable frame listing the compressed and
+ * uncompressed size of every frame). Because the frames are independent, any offset in the uncompressed
+ * data can be reached by decompressing one frame, and the file can be read by the standard zstd tools.
+ *
+ * When a file is reopened for appending, the seek table is read and removed, and new frames follow the
+ * old ones. If the seek table is missing (the program was killed), the frames are found by walking the
+ * file, and anything after the last complete frame is discarded.
+ *
+ * zstd support is optional. If it was not compiled in, available() returns false and the constructors throw.
+ */
+
+#include <cstdint>
+#include <exception>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "block_writer.h"
+
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+
+struct zstd_seek_entry {
+    uint32_t csize;                     // bytes of the compressed frame
+    uint32_t dsize;                     // bytes it decompresses to
+};
+
+class zstd_block_writer : public block_writer {
+    zstd_block_writer(const zstd_block_writer &)=delete;
+    zstd_block_writer &operator=(const zstd_block_writer &)=delete;
+
+    std::string pending {};             // uncompressed data for the next frame
+    std::string cbuf {};                // compressed frame
+    std::vector<zstd_seek_entry> seek_table {};
+    uint64_t udata_size {0};            // uncompressed bytes in the frames written
+    uint64_t frames_end {0};            // file offset of the end of the last frame
+    bool     table_written {false};     // the seek table follows frames_end
+    const int level;
+    struct ZSTD_CCtx_s *cctx {nullptr};
+
+    void     recover();                 // find the frames already in the file and remove the seek table
+    void     write_frame(std::string_view data);
+    void     write_seek_table();
+
+public:
+    static const size_t FRAME_SIZE = 1024*1024; // uncompressed bytes per frame, rounded up to a whole line
+    static const int    DEFAULT_LEVEL = 3;
+
+    static bool available();            // was zstd compiled in?
+
+    zstd_block_writer(const std::string &fname, int level=DEFAULT_LEVEL);
+    virtual ~zstd_block_writer();
+
+    /* size() is the uncompressed size, so that the recorder can tell if the file is empty */
+    virtual uint64_t size() const override { return udata_size + pending.size(); }
+    virtual void resume_after_last_newline() override;
+    virtual void write(std::string_view data) override;
+    virtual void flush() override;      // ends the frame and writes the seek table
+    virtual void close() override;
+    size_t   frame_count() const { return seek_table.size(); }
+};
+
+/* Random access to a file written by zstd_block_writer */
+class zstd_seekable_reader {
+    zstd_seekable_reader(const zstd_seekable_reader &)=delete;
+    zstd_seekable_reader &operator=(const zstd_seekable_reader &)=delete;
+
+    struct frame_t {
+        uint64_t coffset;               // where the frame starts in the file
+        uint64_t doffset;               // where its data starts in the uncompressed data
+        zstd_seek_entry size;
+    };
+    const std::string fname;
+    int      fd {-1};
+    std::vector<frame_t> frames {};
+    std::string cbuf {};
+    struct ZSTD_DCtx_s *dctx {nullptr};
+
+public:
+    class ReadError : public std::exception {
+        std::string m_error{};
+    public:
+        ReadError(std::string_view error):m_error(error){}
+        const char *what() const noexcept override {return m_error.c_str();}
+    };
+
+    static bool is_zstd_file(const std::string &fname); // does the file start with a zstd frame?
+
+    zstd_seekable_reader(const std::string &fname);
+    virtual ~zstd_seekable_reader();
+
+    size_t   frame_count() const { return frames.size(); }
+    uint64_t uncompressed_size() const;
+    size_t   frame_for_offset(uint64_t offset) const; // the frame holding uncompressed byte offset
+    void     read_frame(size_t i, std::string &out);   // replaces out with frame i
+    std::string read(uint64_t offset, size_t len);    // len uncompressed bytes from offset, or fewer at the end
+};
+
+#endif